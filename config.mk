@@ -19,19 +19,19 @@ INSTALL_TOP=/usr/local
 
 INSTALL_BIN=$(INSTALL_TOP)/bin
 
-LIBS=-lreadline -ldl -lm
+LIBS=-lreadline -ldl -lm -lpthread
 
-LIBS_RELEASE=-lreadline -ldl -lm
+LIBS_RELEASE=-lreadline -ldl -lm -lpthread
 
 FLAGS=$(SOURCE_DIR)/*.c -Iinclude -Wall -rdynamic
 
 FLAGS_DEBUG=-g
 
-FLAGS_LOCAL=-o $(BUILD_DIR_DEBUG)/$(PROGRAM_NAME) -O2 $(LIBS) -D TRACK_MEMORY -D USE_READLINE -D USE_COLORS
+FLAGS_LOCAL=-o $(BUILD_DIR_DEBUG)/$(PROGRAM_NAME) -O2 $(LIBS) -D TRACK_MEMORY -D USE_READLINE -D USE_COLORS -D TEST_BUILTINS
 
 FLAGS_RELEASE=-o $(BUILD_DIR_RELEASE)/$(PROGRAM_NAME) -O2 -Werror $(LIBS_RELEASE) -D NDEBUG -D USE_COLORS -D USE_READLINE -D TRACK_MEMORY
 
-FLAGS_MINIMAL_BUILD=-o $(BUILD_DIR_DEBUG)/$(PROGRAM_NAME) -ldl -Os -D NO_JUMPTABLE
+FLAGS_MINIMAL_BUILD=-o $(BUILD_DIR_DEBUG)/$(PROGRAM_NAME) -ldl -lpthread -Os -D NO_JUMPTABLE
 
 CC=gcc
 
@@ -6,6 +6,7 @@
 #include "vm.h"
 #include "error.h"
 #include "list.h"
+#include "map.h"
 #include "object.h"
 #include "stack.h"
 #include "hash.h"
@@ -27,6 +28,9 @@ int si_push_number(struct VM_state* vm, obj_number number);
 
 int si_push_object(struct VM_state* vm, struct Object object);
 
+// The string is interned (copied), so the caller keeps ownership of it
+int si_push_string(struct VM_state* vm, const char* string, int length);
+
 int si_push_nil(struct VM_state* vm);
 
 int si_get_argc(struct VM_state* vm);
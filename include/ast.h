@@ -7,7 +7,13 @@
 
 typedef struct Token Value;
 
-typedef struct Node* Ast;
+struct Ast_arena;
+
+// Handle to a node of the tree, all nodes of a tree are stored in a single array (the arena)
+typedef struct {
+  struct Ast_arena* arena;
+  int node;
+} Ast;
 
 Ast ast_create();
 
@@ -23,14 +29,26 @@ Ast ast_get_last(Ast* ast);
 
 int ast_remove_node_at(Ast* ast, int index);
 
+// Link another tree to the node, so that the tree can be reached from it without being copied
+// The node takes ownership of the tree, which is released along with it
+int ast_link(Ast* ast, Ast* tree);
+
+// The tree that is linked to the node, or an empty tree
+Ast ast_get_link(const Ast* ast);
+
 int ast_child_count(const Ast* ast);
 
 int ast_child_count_total(const Ast* ast);
 
-Ast* ast_get_node(Ast* ast, int index);
-
+// The value is valid until more nodes are added to the tree
 Value* ast_get_node_value(Ast* ast, int index);
 
+// Value of the node itself
+Value* ast_get_value(Ast* ast);
+
+// Call 'func' on the value of every node that has been added to the tree (not including linked trees)
+void ast_for_each_value(Ast* ast, void (*func)(Value* value, void* data), void* data);
+
 void ast_print(const Ast ast);
 
 void ast_free(Ast* ast);
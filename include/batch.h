@@ -0,0 +1,52 @@
+// batch.h
+// Functions in the global scope are compiled in parallel when compiling eagerly
+
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include <pthread.h>
+
+#include "config.h"
+#include "ast.h"
+#include "object.h"
+#include "compile.h"
+
+struct VM_state;
+
+struct Compile_job {
+  Ast params;
+  Ast block;
+  int location;   // Variable slot of the function
+  int slot_count; // Variable slots that the declarations in the body may need
+  int next_slot;  // Next of the reserved slots to be handed out
+  int slot_end;
+  struct Code code;
+  struct Function function;
+  int compiled;   // The function has been compiled, if only with errors
+  int status;
+  pthread_mutex_t* lock;
+};
+
+struct Batch {
+  struct VM_state* vm;
+  struct Compile_job* jobs;
+  unsigned int job_count;
+  unsigned int job_capacity;
+  unsigned int next_job;  // Jobs before this one have been started
+  pthread_mutex_t lock;   // Taken to hand out jobs, and around anything the jobs share in the vm
+  pthread_t threads[COMPILE_THREADS_MAX];
+  unsigned int thread_count;
+};
+
+void batch_init(struct Batch* batch, struct VM_state* vm);
+
+// Queue the function, unless it has to be compiled in place ('queued' tells which)
+int batch_add(struct Batch* batch, Ast* params, Ast* block, int location, int* queued);
+
+// Compile the queued functions, and add them to the end of the program (skipped over by 'state')
+// Every function gets its variable slot, as it would have when compiled in place
+int batch_compile(struct Batch* batch, struct Func_state* state);
+
+void batch_free(struct Batch* batch);
+
+#endif
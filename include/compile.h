@@ -3,12 +3,113 @@
 #ifndef _COMPILE_H
 #define _COMPILE_H
 
+#include "ast.h"
+#include "hash.h"
 #include "object.h"
 
 struct VM_state;
+struct Batch;
+struct Compile_job;
+
+// Bytecode of a function that is compiled apart from the program, and appended to it afterwards
+struct Code {
+  Instruction* program;
+  int size;
+  int capacity;
+};
+
+// Compile-time function state
+struct Func_state {
+  struct Function* func;
+  struct Function* global;
+  struct Function local;
+  Htable args;
+  Htable constants; // Constant_key -> index into the constants of the scope (see store_constant)
+  struct Token** local_lists; // Declarations of lists that don't escape the function
+  unsigned int local_list_count;
+  unsigned int local_list_capacity;
+  int* local_list_slots;  // Variables holding those lists, cleared before returning
+  unsigned int local_list_slot_count;
+  unsigned int local_list_slot_capacity;
+  struct Compile_job* job;  // Set when compiling on a worker thread, code goes to the job instead of the program
+  struct Batch* batch;      // Global functions are queued here instead of compiled in place (see batch.c)
+  int* status;  // The vm status, or that of the job
+};
+
+// Function that hasn't been compiled yet, the function object refers to it until it's first called
+struct Lazy_function {
+  Ast params;
+  Ast block;
+  int location;  // Variable slot of the function
+  const char* text;  // Where the function starts in the source, which is checked before it's compiled
+};
+
+// Source text of a function in the global scope, from its name to the end of its body
+// The text is in a source of the vm, which only changes if a mapped file is written to (see file.c)
+struct Definition {
+  const char* text;
+  unsigned int length;
+  unsigned int hash;  // Of the text, so that most changed definitions are told apart without comparing them
+};
 
 int compile_from_tree(struct VM_state* vm, Ast* ast);
 
+// Compile a function that was left uncompiled, 'func' is updated to the compiled function
+int compile_lazy(struct VM_state* vm, struct Function* func);
+
+// Compile the functions in the tree that are new, or that have changed since they were compiled
+// The rest of the tree is left out, global state stays as it is
+int compile_reload(struct VM_state* vm, Ast* ast, int* reloaded);
+
+// Code generation, shared by the compiler and the single-pass compiler (see emit.c)
+
+int func_state_init(struct VM_state* vm, struct Func_state* state, struct Function* global, int in_global_scope);
+
+void func_state_free(struct Func_state* state);
+
+// Size of the code that the state compiles to, the program or that of its job
+int code_size(struct VM_state* vm, struct Func_state* state);
+
+int instruction_add(struct VM_state* vm, struct Func_state* state, Instruction instruction, unsigned int* ins_count);
+
+int instruction_add_arg(struct VM_state* vm, struct Func_state* state, Instruction instruction, int arg, unsigned int* ins_count);
+
+// Returns the location of the jump operand, to be patched once the target is known
+int instruction_add_jump(struct VM_state* vm, struct Func_state* state, Instruction instruction, unsigned int* ins_count);
+
+void patch_jump(struct VM_state* vm, struct Func_state* state, int jump_index, int target);
+
+// Point the breaks from 'start' to the end of the program at the end of the program
+int patchblock(struct VM_state* vm, struct Func_state* state, int start);
+
+int compile(struct VM_state* vm, Ast* ast, struct Func_state* state, unsigned int* ins_count);
+
+// Declare the function, and compile it (or leave it to compile_lazy, or to the batch)
+int compile_function(struct VM_state* vm, struct Token* identifier, Ast* params, Ast* block, struct Func_state* state, unsigned int* ins_count);
+
+// Compile the function body at the end of the code of the state
+int compile_function_body(struct VM_state* vm, Ast* params, Ast* block, struct Func_state* state, struct Function* func, unsigned int* ins_count);
+
+int compile_pushk(struct VM_state* vm, struct Func_state* state, struct Token constant, unsigned int* ins_count);
+
+int compile_pushvar(struct VM_state* vm, struct Func_state* state, struct Token variable, unsigned int* ins_count);
+
+int compile_declvar(struct VM_state* vm, struct Func_state* state, struct Token variable);
+
+int compile_assign(struct VM_state* vm, struct Func_state* state, struct Token variable, unsigned int* ins_count);
+
+int compile_load(struct VM_state* vm, const struct Token* path_token);
+
+int compile_return(struct VM_state* vm, struct Func_state* state, unsigned int* ins_count);
+
+int get_variable_location(struct VM_state* vm, struct Func_state* state, struct Token variable, int* location);
+
+int store_variable(struct VM_state* vm, struct Func_state* state, struct Token variable, int* location);
+
+int token_to_op(struct Token token);
+
 unsigned int compile_get_ins_arg_count(Instruction instruction);
 
+unsigned int compile_decode_ins(const Instruction* ins, Instruction* op, int* arg);
+
 #endif
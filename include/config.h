@@ -49,6 +49,19 @@
 
 #define PATH_LENGTH_MAX 512
 
-#define HASH_TABLE_INIT_SIZE 7
+#define PARSE_THREADS_MAX 8
+
+#define COMPILE_THREADS_MAX 8
+
+#define SINGLE_PASS_MAX 4096  // Sources up to this size are compiled without building a tree (see emit.c)
+
+#define SOURCE_MAP_MIN 65536  // Files of at least this size are mapped instead of read (see file.c)
+
+#define HASH_TABLE_INIT_SIZE 16
+
+#define GC_STEP_BUDGET 2000  // Objects (and the items in them) that a step of the garbage collector handles
+#define GC_STEP_SIZE (16 * 1024)  // Bytes allocated between steps, while a collection is under way
+#define GC_HEAP_MIN (256 * 1024)  // Heap size at which the first collection starts
+#define GC_GROWTH 200 // A collection starts once the heap has grown to this percentage of what was left by the last one
 
 #endif
@@ -0,0 +1,17 @@
+// emit.h
+
+#ifndef _EMIT_H
+#define _EMIT_H
+
+#include "ast.h"
+#include "file.h"
+
+struct VM_state;
+
+// Compile the source straight to bytecode at the end of the program, followed by an exit instruction
+// Returns PARSE_ERR on syntax errors, other errors are left in the vm status as with compile_from_tree
+// Code for the statements before an error is left in the program
+// Functions are added to 'functions', which has to be kept for as long as any of them is uncompiled
+int emit_source(struct VM_state* vm, const char* filename, const struct Source* source, Ast* functions);
+
+#endif
@@ -3,6 +3,51 @@
 #ifndef _FILE_H
 #define _FILE_H
 
-char* read_file(const char* path);
+#include <time.h>
 
-#endif
\ No newline at end of file
+// Source code that has been loaded, tokens refer to it for as long as a tree or a function uses them
+struct Source {
+	char* data;	// Not null-terminated, everything that reads it stops at data + size
+	unsigned long size;
+	char* name;	// File name, or where the string came from
+	unsigned int serial;	// Sources are numbered in the order they were added (see sources_release)
+	int fd;	// Of a mapped file, kept open to tell if the file has been written to since, -1 if the source was read
+	struct timespec modified;	// Of a mapped file, when it was mapped
+};
+
+struct Source_arr {
+	struct Source* sources;	// By address of the text, so that sources_find is a binary search
+	unsigned int count;
+	unsigned int capacity;
+	unsigned int added;	// Number of sources that have been added, the serial of the next one
+};
+
+void sources_init(struct Source_arr* arr);
+
+// Files smaller than SOURCE_MAP_MIN are read into a buffer of their own, larger ones are mapped
+// Nothing is shared, the file can be loaded without holding the lock of the sources
+int source_load_file(const char* path, struct Source* source);
+
+// Add a source that has been loaded, the sources take ownership of its text
+int sources_add(struct Source_arr* arr, const char* name, struct Source* source);
+
+// Load the file and add it
+int sources_add_file(struct Source_arr* arr, const char* path, struct Source* source);
+
+// Store a copy of the string
+int sources_add_string(struct Source_arr* arr, const char* name, const char* string, unsigned long size, struct Source* source);
+
+// Find the source that the string points into
+// The pointer is only good until the next source is added or released
+const struct Source* sources_find(const struct Source_arr* arr, const char* string);
+
+// Can the text still be read? A mapped file that has been written to in place has changed under
+// the tokens, and reading past its new end would fault: ERR is returned for those
+int sources_check(const struct Source* source);
+
+// Release the sources that have been added since 'added' was 'mark', nothing may refer to them
+void sources_release(struct Source_arr* arr, unsigned int mark);
+
+void sources_free(struct Source_arr* arr);
+
+#endif
@@ -0,0 +1,83 @@
+// gc.h
+// Incremental garbage collector for lists, maps and strings
+
+#ifndef _GC_H
+#define _GC_H
+
+#include "object.h"
+
+struct List;
+struct Map;
+
+#define GC_PAUSE_BUCKETS 6
+
+enum Gc_phase {
+  GC_IDLE,
+  GC_MARK,
+  GC_SWEEP,
+};
+
+struct Gc_stats {
+  unsigned long collections;  // That have been completed
+  unsigned long steps;
+  unsigned long freed;  // Objects and strings
+  unsigned long pauses[GC_PAUSE_BUCKETS]; // Number of steps by how long they took (see gc_print_stats)
+  double max_pause; // In seconds
+};
+
+struct Gc {
+  struct Gc_object* objects;
+  struct Gc_object** sweep;   // Link to the next object to be swept
+  unsigned int string_sweep;  // Next string to be swept
+  struct Gc_object** gray;    // Objects that have been reached, but not looked into
+  unsigned int gray_count;
+  unsigned int gray_capacity;
+  int root; // Next variable to be marked
+  unsigned int epoch; // Incremented for every collection
+  int phase;
+  unsigned long bytes;  // Taken by the objects, strings are counted by the intern table
+  unsigned long object_count;
+  unsigned long step_at;  // Heap size at which the next step is taken
+  unsigned int step_budget;
+  struct Gc_stats stats;
+};
+
+// Run a step if enough has been allocated since the last one
+// Only where every object that is in use can be reached from the stack or the variables
+#define gc_check(vm) \
+  if ((vm)->gc.bytes + (vm)->strings.bytes >= (vm)->gc.step_at) \
+    gc_step(vm)
+
+void gc_init(struct Gc* gc);
+
+// New objects survive the collection that is under way
+struct List* gc_new_list(struct VM_state* vm, int capacity);
+
+struct Map* gc_new_map(struct VM_state* vm);
+
+// Has to be called when a value is stored in an object
+void gc_barrier(struct VM_state* vm, struct Gc_object* object, const struct Object* value);
+
+// Has to be called when a value is assigned to a variable
+#define gc_barrier_variable(vm, value) \
+  if ((vm)->gc.phase == GC_MARK) \
+    gc_shade(vm, value)
+
+void gc_shade(struct VM_state* vm, const struct Object* value);
+
+// Count the current size of the object in the heap size, after it has grown or shrunk
+void gc_resize(struct VM_state* vm, struct Gc_object* object);
+
+unsigned long gc_heap_size(struct VM_state* vm);
+
+void gc_step(struct VM_state* vm);
+
+// Finish the collection that is under way, and then do a whole one
+void gc_collect(struct VM_state* vm);
+
+void gc_print_stats(struct VM_state* vm);
+
+// Release all objects
+void gc_free(struct VM_state* vm);
+
+#endif
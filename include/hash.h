@@ -3,43 +3,85 @@
 #ifndef _HASH_H
 #define _HASH_H
 
+// Default value type, for tables created with ht_create_empty()
 typedef int Hvalue;
-#define HTABLE_KEY_SIZE 32 - sizeof(Hvalue)
-typedef char Hkey[HTABLE_KEY_SIZE];
+
+// Slots are probed in groups of this many, see hash.c
+#define HTABLE_GROUP_SIZE 16
 
 struct Item;
 
 typedef struct {
+	unsigned char* ctrl;	// One control byte per slot: 7-bit hash tag of the key, empty or deleted
 	struct Item* items;
+	unsigned char* values;	// value_size bytes per slot
+	char* keys;	// Key arena, items refer to their key by offset
+	unsigned int keys_used;
+	unsigned int keys_size;
+	unsigned int keys_garbage;	// Bytes of the arena used by keys of removed elements
 	unsigned int count;	// Count of used slots
 	unsigned int size;	// Total size of the hash table
+	unsigned int tombstones;	// Count of deleted slots
+	unsigned int value_size;
 } Htable;
 
-// Important!
-// It's recommended that the size is a prime number
-// This will result in less key collisions
-Htable ht_create(unsigned int size);
+struct Htable_stats {
+	unsigned int count;
+	unsigned int size;
+	unsigned int tombstones;
+	float load_factor;	// Used and deleted slots / size
+	float avg_probe_length;	// Average number of groups probed to find a key
+	unsigned int max_probe_length;
+	unsigned int key_bytes;	// Bytes of the key arena in use, including keys of removed elements
+};
+
+// The size is rounded up to a power of two (and at least HTABLE_GROUP_SIZE)
+Htable ht_create(unsigned int size, unsigned int value_size);
 
+// Table of Hvalue
 Htable ht_create_empty();
 
+// Table of values of any type, 'value_size' bytes each
+Htable ht_create_empty_of(unsigned int value_size);
+
 int ht_is_empty(const Htable* table);
 
-unsigned int ht_insert_element(Htable* table, const Hkey key, const Hvalue value);
+// Keys are copied into the table, and don't have to be null-terminated
+// Returns the stored value, or NULL if we failed to allocate memory
+void* ht_insert(Htable* table, const char* key, unsigned int length, const void* value);
+
+unsigned int ht_insert_element(Htable* table, const char* key, unsigned int length, const Hvalue value);
+
+void* ht_lookup(const Htable* table, const char* key, unsigned int length);
 
-const Hvalue* ht_lookup(const Htable* table, const Hkey key);
+// The same as ht_insert, ht_lookup and ht_remove_element, for a key that has already been
+// hashed with ht_hash
+void* ht_insert_hashed(Htable* table, const char* key, unsigned int length, unsigned int h, const void* value);
 
-const Hvalue* ht_lookup_byindex(const Htable* table, const unsigned int index);
+void* ht_lookup_hashed(const Htable* table, const char* key, unsigned int length, unsigned int h);
 
-const Hkey* ht_lookup_key(const Htable* table, const unsigned int index);
+void ht_remove_hashed(Htable* table, const char* key, unsigned int length, unsigned int h);
 
-int ht_element_exists(const Htable* table, const Hkey key);
+void* ht_lookup_byindex(const Htable* table, const unsigned int index);
 
-void ht_remove_element(Htable* table, const Hkey key);
+const char* ht_lookup_key(const Htable* table, const unsigned int index, unsigned int* length);
+
+int ht_element_exists(const Htable* table, const char* key, unsigned int length);
+
+void ht_remove_element(Htable* table, const char* key, unsigned int length);
+
+// Returns 1 if the table was moved to fewer slots, after most of its elements were removed
+int ht_shrink(Htable* table);
 
 unsigned int ht_get_size(const Htable* table);
 
 unsigned int ht_num_elements(const Htable* table);
 
+void ht_get_stats(const Htable* table, struct Htable_stats* stats);
+
 void ht_free(Htable* table);
 
-#endif
\ No newline at end of file
+// The hash function used for keys
+unsigned int ht_hash(const char* key, unsigned int length);
+
+#endif
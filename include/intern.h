@@ -0,0 +1,54 @@
+// intern.h
+// Table of unique strings, every string value in the vm points into it
+
+#ifndef _INTERN_H
+#define _INTERN_H
+
+#include "hash.h"
+
+// Tables that are keyed by an interned string (a symbol) use the bytes of its index as the key
+#define SYMBOL_KEY(symbol) ((const char*)&(symbol)), sizeof(int)
+
+// Stored right before the characters of every interned string
+struct Intern_header {
+  int index;
+  unsigned int mark;  // For the garbage collector (see gc.c)
+};
+
+#define intern_header(data) ((struct Intern_header*)((char*)(data) - sizeof(struct Intern_header)))
+
+// Bytes taken by an interned string of this length
+#define intern_size(length) (sizeof(struct Intern_header) + (length) + 1)
+
+struct Interned {
+  char* data; // NULL once the string has been removed
+  int length;
+  unsigned int hash;
+};
+
+struct Intern_table {
+  Htable lookup;  // String -> index into 'strings'
+  struct Interned* strings;
+  unsigned int count;
+  unsigned int capacity;
+  int* free_slots;  // Of strings that have been removed, reused for new strings
+  unsigned int free_count;
+  unsigned int free_capacity;
+  unsigned long bytes;  // Taken by the strings
+  unsigned int mark;    // Given to strings as they are interned, or looked up
+};
+
+void intern_init(struct Intern_table* table);
+
+// Returns the index of the interned string, which stays the same until the string is removed
+int intern_index(struct Intern_table* table, const char* string, int length);
+
+// Returns the interned copy of the string, equal strings always give the same pointer
+const struct Interned* intern_string(struct Intern_table* table, const char* string, int length);
+
+// Release the string, nothing may refer to it anymore
+void intern_remove(struct Intern_table* table, int index);
+
+void intern_free(struct Intern_table* table);
+
+#endif
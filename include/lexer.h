@@ -4,16 +4,21 @@
 #define _LEXER_H
 
 #include "token.h"
+#include "intern.h"
 
 struct Lexer {
 	char* index;
+	const char* end;	// End of the input, which is not null-terminated
 	int line, count;
 	struct Token token;
 	const char* filename;
+	struct Intern_table* symbols;	// Identifiers are interned here
 };
 
 struct Token next_token(struct Lexer* lexer);
 
 struct Token get_token(struct Lexer* lexer);
 
+int skip_block(struct Lexer* lexer);
+
 #endif
\ No newline at end of file
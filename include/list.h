@@ -1,4 +1,9 @@
 // list.h
+// Dynamic arrays
+//
+// A list is a pointer to its elements, a count of elements in use and a capacity (the number of
+// elements allocated). The capacity grows geometrically, so pushing n elements only needs
+// O(log n) reallocations.
 
 #ifndef _LIST_H
 #define _LIST_H
@@ -7,29 +12,54 @@
 
 #include "mem.h"
 
-#define list_push(list, count, value) do { \
-	if (list == NULL) { list = list_init(sizeof(value), 1); list[0] = value; count = 1; break; } \
-	void* new_list = mrealloc(list, count * sizeof(*list), (1 + count) * (sizeof(value))); \
-	if (new_list) { \
-		list = new_list; \
-		list[(count)++] = value; \
+#define LIST_INIT_CAPACITY 8
+
+#define list_grow_capacity(capacity) ((capacity) < LIST_INIT_CAPACITY ? LIST_INIT_CAPACITY : (capacity) * 2)
+
+// Make sure that there is room for at least 'new_capacity' elements
+#define list_reserve(list, count, capacity, new_capacity) do { \
+	unsigned int list_new_capacity = (new_capacity); \
+	if (list_new_capacity > (unsigned int)(capacity)) { \
+		void* new_list = (list) ? \
+			mrealloc(list, (capacity) * sizeof(*(list)), list_new_capacity * sizeof(*(list))) : \
+			mmalloc(list_new_capacity * sizeof(*(list))); \
+		if (new_list) { \
+			list = new_list; \
+			capacity = list_new_capacity; \
+		} \
 	} \
-} while (0); \
+} while (0)
 
-#define list_realloc(list, count, new_size) { \
-	assert(list != NULL); \
-	void* new_list = mrealloc(list, count * sizeof(*list), (new_size) * (sizeof(*list))); \
-	if (new_list != NULL) { \
-		list = new_list; \
-		count = new_size; \
+#define list_push(list, count, capacity, value) do { \
+	if ((count) >= (capacity)) \
+		list_reserve(list, count, capacity, list_grow_capacity(capacity)); \
+	if ((count) < (capacity)) \
+		(list)[(count)++] = value; \
+} while (0)
+
+// Remove the last 'num' elements, the memory is kept for the elements pushed after this
+#define list_shrink(list, count, num) do { \
+	assert(((count) - (num)) >= 0); \
+	(count) -= (num); \
+} while (0)
+
+// Release the memory that is not used by any element
+#define list_shrink_to_fit(list, count, capacity) do { \
+	if ((list) != NULL && (count) < (capacity)) { \
+		if ((count) == 0) { \
+			mfree(list, (capacity) * sizeof(*(list))); \
+			list = NULL; \
+			capacity = 0; \
+			break; \
+		} \
+		void* new_list = mrealloc(list, (capacity) * sizeof(*(list)), (count) * sizeof(*(list))); \
+		if (new_list) { \
+			list = new_list; \
+			capacity = count; \
+		} \
 	} \
-} \
+} while (0)
 
-#define list_shrink(list, count, num) { \
-	assert((count - num) >= 0); \
-	list_realloc(list, count, count - num); \
-}
- 
 #define list_assign(list, count, index, value) { \
 	assert(list != NULL); \
 	if (index < count) { \
@@ -37,13 +67,13 @@
 	} else { assert(0); } \
 } \
 
-#define list_free(list, count) { \
-	if ((list) != NULL) { \
-		mfree(list, count * sizeof(*list)); \
-		count = 0; \
-    list = NULL; \
-	}\
-}
+#define list_free(list, count, capacity) do { \
+	if ((list) != NULL) \
+		mfree(list, (capacity) * sizeof(*(list))); \
+	list = NULL; \
+	count = 0; \
+	capacity = 0; \
+} while (0)
 
 // size of type, count of elements to allocate
 void* list_init(const unsigned int size, unsigned int count);
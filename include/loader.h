@@ -0,0 +1,73 @@
+// loader.h
+// Imported files are parsed in parallel, and linked together once all of them have been parsed
+
+#ifndef _LOADER_H
+#define _LOADER_H
+
+#include <pthread.h>
+
+#include "config.h"
+#include "hash.h"
+#include "ast.h"
+#include "file.h"
+#include "intern.h"
+#include "module.h"
+
+// Import statement, a placeholder node in the tree that the tree of the imported file is linked to
+struct Import {
+  Ast node;
+  int job;  // -1 if the file doesn't have to be loaded again
+};
+
+struct Import_arr {
+  struct Import* imports;
+  unsigned int count;
+  unsigned int capacity;
+};
+
+struct Import_job {
+  char path[PATH_LENGTH_MAX];
+  struct Source source;
+  struct Intern_table symbols;  // Identifiers of this file only, they are mapped to the vm symbols when it's spliced in
+  Ast ast;
+  struct Import_arr imports;
+  int status;
+  int spliced;
+};
+
+struct Loader {
+  struct Source_arr* sources;
+  struct Module_registry* modules;
+  struct Intern_table* symbols;
+  Htable job_lookup;  // Canonical path -> job index
+  struct Import_job** jobs;
+  unsigned int job_count;
+  unsigned int job_capacity;
+  unsigned int next_job;  // Jobs before this one have been started
+  unsigned int jobs_done;
+  unsigned char cancelled;
+  unsigned char finished;
+  unsigned char strict; // Parse function bodies right away
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  pthread_t threads[PARSE_THREADS_MAX];
+  unsigned int thread_count;
+  unsigned int thread_max;
+};
+
+int loader_init(struct Loader* loader, struct Source_arr* sources, struct Module_registry* modules, struct Intern_table* symbols, int strict);
+
+// Called by the parser for each import statement, from any thread
+// Queues the file to be read and parsed, 'job' is set to -1 if it has already been loaded
+int loader_import(struct Loader* loader, const char* path, int* job);
+
+// Help parsing the queued files, and wait until all of them have been parsed
+// Files that haven't been started yet are skipped if 'cancel' is set
+int loader_wait(struct Loader* loader, int cancel);
+
+// Link the trees of the imported files to their import placeholders
+int loader_splice(struct Loader* loader, struct Import_arr* imports);
+
+void loader_free(struct Loader* loader);
+
+#endif
@@ -0,0 +1,47 @@
+// map.h
+// Hash map from numbers or strings to objects
+
+#ifndef _MAP_H
+#define _MAP_H
+
+#include "hash.h"
+#include "object.h"
+
+struct Map_entry {
+  struct Object key;
+  struct Object value;
+};
+
+struct Map {
+  struct Gc_object gc;
+  Htable table; // Map_key -> Map_entry
+};
+
+void map_init(struct Map* map);
+
+// Only numbers and strings can be used as keys
+int map_is_valid_key(const struct Object* key);
+
+struct Object* map_get(struct Map* map, const struct Object* key);
+
+int map_set(struct Map* map, const struct Object* key, const struct Object* value);
+
+// Returns 1 if the map released some of its slots
+int map_del(struct Map* map, const struct Object* key);
+
+unsigned int map_count(const struct Map* map);
+
+// Iterate the entries of the map, 'iter' should start at zero
+// Entries can be removed while iterating, but adding entries may reorder the map
+// Returns NULL when there are no more entries
+const struct Map_entry* map_next(const struct Map* map, unsigned int* iter);
+
+// Bytes taken by the map, its entries included
+unsigned int map_size(const struct Map* map);
+
+// Remove all entries
+void map_clear(struct Map* map);
+
+void map_free(struct Map* map);
+
+#endif
@@ -0,0 +1,43 @@
+// module.h
+// Registry of the files that have been imported, so that each one is only loaded once
+
+#ifndef _MODULE_H
+#define _MODULE_H
+
+#include "hash.h"
+
+struct Module {
+  unsigned long size;
+  long mtime_sec;
+  long mtime_nsec;
+};
+
+// Canonical path -> struct Module
+struct Module_registry {
+  Htable modules;
+  char** pending; // Canonical paths of the files registered since the last commit
+  unsigned int pending_count;
+  unsigned int pending_capacity;
+};
+
+void modules_init(struct Module_registry* registry);
+
+// Canonical path of the file (at least PATH_MAX bytes), the registry is keyed by it
+int modules_resolve(const char* path, char* canonical);
+
+// Record the file as loaded
+// 'loaded' is set if the same file, unchanged since the last time, has already been loaded
+int modules_register(struct Module_registry* registry, const char* canonical, int* loaded);
+
+// Forget about the file, so that it's loaded again the next time
+void modules_forget(struct Module_registry* registry, const char* canonical);
+
+// The files registered since the last commit have been parsed and compiled
+void modules_commit(struct Module_registry* registry);
+
+// Forget about the files registered since the last commit, they failed to load
+void modules_rollback(struct Module_registry* registry);
+
+void modules_free(struct Module_registry* registry);
+
+#endif
@@ -8,14 +8,16 @@
 #include "token.h"
 
 struct VM_state;
+struct Map;
 typedef double obj_number;
 
-typedef int Instruction;
+typedef unsigned char Instruction;
 
 typedef int (*CFunction)(struct VM_state*);
 
 struct Scope {
   unsigned int constants_count;
+  unsigned int constants_capacity;
   struct Object* constants;
   Htable var_locations;
   struct Scope* parent;
@@ -23,13 +25,25 @@ struct Scope {
 
 struct Function {
   struct Scope scope;
-  Instruction addr;
+  int addr;
   int argc;
+  int lazy;  // Index of the uncompiled function (see compile_lazy), or -1 once it has been compiled
+};
+
+// Header of the objects that are managed by the garbage collector (see gc.c)
+struct Gc_object {
+  struct Gc_object* next; // Next of all the collectable objects, the newest come first
+  unsigned int mark;  // Equal to the epoch of the collector once the object has been reached
+  unsigned int size;  // Bytes that the object takes, as counted in the heap size
+  int type;
 };
 
 struct List {
+  struct Gc_object gc;  // Lists in a region are not collected, but are marked through all the same
   struct Object* data;
   int length;
+  int capacity;
+  unsigned char region;  // Allocated in the region of a function frame, released when the function returns
 };
 
 struct Object {
@@ -40,6 +54,7 @@ struct Object {
       int length;
     } str;
     struct List* list;
+    struct Map* map;
     struct Function func;
     CFunction cfunc;
   } value;
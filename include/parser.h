@@ -3,6 +3,38 @@
 #ifndef _PARSER_H
 #define _PARSER_H
 
-int parser_parse(char* input, struct Str_arr* str_arr, const char* filename, Ast* ast);
+#include "ast.h"
+#include "file.h"
+#include "intern.h"
+#include "module.h"
+
+struct Loader;
+struct Import_arr;
+
+struct Operator {
+  int left, right;
+};
+
+// Priority of the binary operators, indexed by token type
+extern const struct Operator op_priority[];
+
+#define UNARY_PRIORITY 12
+
+// The operator the token stands for, or T_NOBINOP/T_NOUNOP if it's not one
+int get_binop(struct Token token);
+
+int get_uop(struct Token token);
+
+// The source has to outlive the tree, and any imported files are added to 'sources'
+// Files that are already in the module registry, and haven't changed since, are not imported again
+// Function bodies are skipped and left for parser_parse_body, unless 'strict' is set
+int parser_parse(const struct Source* source, struct Source_arr* sources, struct Module_registry* modules, struct Intern_table* symbols, const char* filename, int strict, Ast* ast);
+
+// Parse a single file, its imports are queued in the loader and left as placeholders in the tree
+int parser_parse_file(struct Loader* loader, const struct Source* source, struct Intern_table* symbols, const char* filename, int strict, Ast* ast, struct Import_arr* imports);
+
+// Parse a function body that was skipped (T_DEFERRED), the statements of the body are added to 'ast'
+// Files that the body imports are loaded the same way as by parser_parse
+int parser_parse_body(const struct Source* source, struct Source_arr* sources, struct Module_registry* modules, struct Intern_table* symbols, const struct Token* body, int strict, Ast* ast);
 
 #endif
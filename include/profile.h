@@ -0,0 +1,55 @@
+// profile.h
+
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+// A loop is considered hot when it runs at least this many iterations on average each time it's entered
+#define PROFILE_HOT_LOOP_ITERATIONS 4
+
+// ... and at least this many iterations in total
+#define PROFILE_HOT_LOOP_MIN 64
+
+enum Branch_kind {
+  BRANCH_IF = 0,
+  BRANCH_WHILE,
+};
+
+struct Branch_site {
+  int kind;
+  int addr;       // Location of the branch operand
+  int back_edge;  // Location of the back-edge branch operand (rotated loops), or -1
+};
+
+struct Branch_count {
+  unsigned long executed; // Number of times the condition was evaluated
+  unsigned long taken;    // Number of times the condition was true
+};
+
+struct Profile {
+  struct Branch_site* sites;  // Branch sites, in the order they were compiled
+  unsigned int site_count;
+  unsigned int site_capacity;
+  struct Branch_count* counts;  // Recorded counts, indexed by branch operand location
+  unsigned int counts_size;
+  struct Branch_count* input; // Counts from a previous run, indexed by site
+  unsigned int input_count;
+  unsigned char recording;
+};
+
+void profile_init(struct Profile* profile);
+
+int profile_load(struct Profile* profile, const char* path);
+
+int profile_save(struct Profile* profile, const char* path);
+
+int profile_add_site(struct Profile* profile, int kind);
+
+void profile_set_site_addr(struct Profile* profile, int site, int addr, int back_edge);
+
+int profile_is_hot_loop(const struct Profile* profile, int site);
+
+void profile_branch(struct Profile* profile, int addr, int taken);
+
+void profile_free(struct Profile* profile);
+
+#endif
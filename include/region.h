@@ -0,0 +1,38 @@
+// region.h
+// Bump allocator for values that live as long as a function frame
+
+#ifndef _REGION_H
+#define _REGION_H
+
+#define REGION_BLOCK_SIZE (16 * 1024)
+
+struct Region_block {
+  struct Region_block* prev;
+  unsigned int size;
+  unsigned int used;
+  unsigned char data[];
+};
+
+struct Region {
+  struct Region_block* head;  // Block that we are currently allocating from
+  struct Region_block* free_blocks;
+};
+
+struct Region_mark {
+  struct Region_block* block;
+  unsigned int used;
+};
+
+void region_init(struct Region* region);
+
+void* region_alloc(struct Region* region, unsigned int size);
+
+struct Region_mark region_get_mark(const struct Region* region);
+
+void region_reset(struct Region* region, struct Region_mark mark);
+
+int region_contains(const struct Region* region, const void* pointer);
+
+void region_free(struct Region* region);
+
+#endif
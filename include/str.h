@@ -11,6 +11,10 @@ int string_to_number(char* string, double* number);
 
 int safe_string_to_number(char* string, int length, double* number);
 
+// Returns the number of characters that make up a valid number, which is less than 'length'
+// if the string is not a (complete) number literal
+int string_parse_number(const char* string, int length, double* number);
+
 void string_free(char* string);
 
 void string_nfree(char* string, int length);
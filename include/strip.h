@@ -0,0 +1,14 @@
+// strip.h
+
+#ifndef _STRIP_H
+#define _STRIP_H
+
+#include "ast.h"
+
+struct VM_state;
+
+// Remove the functions that can't be reached from the global code, before the tree is compiled
+// Needs the whole tree, function bodies that were skipped by the parser are not looked into
+int strip_unused(struct VM_state* vm, Ast* ast, int* stripped);
+
+#endif
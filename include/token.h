@@ -48,6 +48,7 @@ enum Token_types {
   T_CFUNCTION,
   T_LIST,
   T_NIL,
+  T_MAP,
 
   T_DECL, // 'let'
   T_RETURN,
@@ -60,6 +61,7 @@ enum Token_types {
 
   T_CALL,
   T_BLOCK,
+  T_DEFERRED, // Function body that hasn't been parsed yet, the token spans it from '{' to '}'
   T_EOF,
 
   T_COUNT
@@ -77,16 +79,17 @@ extern const char* token_desc[];
 #define TOKEN_LOAD "load"
 #define TOKEN_NIL "nil"
 
+// Every node of a tree holds one, the fields are packed so that a node takes 64 bytes (see ast.c)
 struct Token {
-  int type;
   char* string;
-  int length;
-  int count;
-  int line;
   union {
     double number;
-    int integer;  // NOTE(lucas): Unused
   } value;
+  int length;
+  int symbol; // T_IDENTIFIER: index of the identifier in the symbol table, -1 for any other token
+  int line;
+  unsigned int type : 8;  // All the token types fit in a byte, T_COUNT is well below 256
+  int count : 24; // Column, only shown in messages
 };
 
 void print_token(struct Token token);
@@ -0,0 +1,105 @@
+// trace.h
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "object.h"
+
+// Number of times a loop back-edge has to be taken before we try to record a trace for it
+#define TRACE_HOT_LOOP 64
+
+#define TRACE_MAX_LENGTH 512  // Maximum number of trace instructions
+#define TRACE_MAX_STACK 64    // Maximum stack depth inside of a trace
+#define TRACE_MAX_REGS 256
+#define TRACE_MAX_DEPTH 8     // Maximum depth of inlined calls
+
+#define TRACE_ARITH(T) \
+  T(ADD, +, obj_number) \
+  T(SUB, -, obj_number) \
+  T(MULT, *, obj_number) \
+  T(DIV, /, obj_number) \
+  T(LT, <, obj_number) \
+  T(GT, >, obj_number) \
+  T(EQ, ==, obj_number) \
+  T(LEQ, <=, obj_number) \
+  T(GEQ, >=, obj_number) \
+  T(NEQ, !=, obj_number) \
+  T(MOD, %, int) \
+  T(BAND, &, int) \
+  T(BOR, |, int) \
+  T(BXOR, ^, int) \
+  T(LEFTSHIFT, <<, int) \
+  T(RIGHTSHIFT, >>, int) \
+  T(AND, &&, obj_number) \
+  T(OR, ||, obj_number) \
+
+#define TRACE_OP(OP, C_OP, CAST) TR_##OP,
+
+enum Trace_op {
+  TRACE_ARITH(TRACE_OP)
+  TR_MINUS,
+  TR_NOT,
+  TR_MOV,
+  TR_GUARD, // Leave the trace if the truth of a register differs from the one that was recorded
+  TR_LOOP,  // Back to the start of the trace
+};
+
+struct Trace_ins {
+  unsigned char op;
+  unsigned char expect; // TR_GUARD: recorded truth of the condition
+  short dst;
+  short a;
+  short b;
+  int exit; // TR_GUARD: where to continue in the bytecode when the guard fails
+};
+
+enum Trace_slot_kind {
+  SLOT_VARIABLE = 0,
+  SLOT_ARG,
+};
+
+// Variable or function argument that is kept in a register while the trace runs
+struct Trace_slot {
+  unsigned char kind;
+  unsigned char written;  // Write back to the variable when leaving the trace?
+  short reg;
+  int index;  // Variable slot or argument index
+};
+
+struct Trace_const {
+  short reg;
+  obj_number value;
+};
+
+struct Trace {
+  int head; // Address of the loop head
+  struct Trace_slot* slots;
+  unsigned int slot_count;
+  struct Trace_const* consts;
+  unsigned int const_count;
+  struct Trace_ins* ins;
+  unsigned int ins_count;
+};
+
+struct Trace_site {
+  int hits; // Number of times the back-edge was taken, -1 if we gave up on tracing this loop
+  struct Trace* trace;
+};
+
+struct Trace_cache {
+  struct Trace_site* sites; // Indexed by the location of the back-edge jump operand
+  unsigned int sites_size;
+  unsigned int trace_count;
+};
+
+struct VM_state;
+
+void trace_cache_init(struct Trace_cache* cache);
+
+struct Trace* trace_back_edge(struct VM_state* vm, const struct Function* func, int stack_bp, int addr, int head);
+
+int trace_execute(struct VM_state* vm, const struct Trace* trace, int stack_bp);
+
+void trace_cache_free(struct Trace_cache* cache);
+
+#endif
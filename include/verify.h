@@ -0,0 +1,17 @@
+// verify.h
+
+#ifndef _VERIFY_H
+#define _VERIFY_H
+
+struct VM_state;
+
+struct Function;
+
+int verify_program(struct VM_state* vm, int start);
+
+int verify_function(struct VM_state* vm, int start, const struct Function* func);
+
+// Verify code as if it was global code added to the end of the program, the program is left as it was
+int verify_code(struct VM_state* vm, const unsigned char* code, int size);
+
+#endif
@@ -5,7 +5,14 @@
 
 #include "hash.h"
 #include "object.h"
-#include "strarr.h"
+#include "file.h"
+#include "intern.h"
+#include "module.h"
+#include "profile.h"
+#include "trace.h"
+#include "region.h"
+#include "compile.h"
+#include "gc.h"
 
 #define STACK_SIZE 512
 
@@ -45,12 +52,38 @@
   INS(T, RETURN) \
   INS(T, IF) \
   INS(T, WHILE) \
+  INS(T, LOOP) \
   INS(T, JUMP) \
   INS(T, CALL) \
   INS(T, PUSH_ARG) \
+  INS(T, LOCAL_LIST) \
+  INS(T, WIDE) \
+  INS(T, WIDE16) \
 \
   INS(T, EXIT) \
 
+// Bytecode encoding:
+// Every instruction is a one byte opcode, optionally followed by an operand.
+// Operands are 8-bit signed integers by default, which is enough for most variable slots and
+// constant indices. The I_WIDE16 prefix widens the operand of the next instruction to 16 bits, and
+// the I_WIDE prefix to 32 bits (little-endian).
+#define ARG_SIZE 1
+#define ARG_SIZE_16 2
+#define ARG_SIZE_WIDE 4
+#define ARG_MIN (-0x80)
+#define ARG_MAX 0x7f
+#define ARG_MIN_16 (-0x8000)
+#define ARG_MAX_16 0x7fff
+
+#define ARG_DECODE(ins) \
+  ((signed char)(ins)[0])
+
+#define ARG_DECODE_16(ins) \
+  ((short)((unsigned int)(ins)[0] | ((unsigned int)(ins)[1] << 8)))
+
+#define ARG_DECODE_WIDE(ins) \
+  ((int)((unsigned int)(ins)[0] | ((unsigned int)(ins)[1] << 8) | ((unsigned int)(ins)[2] << 16) | ((unsigned int)(ins)[3] << 24)))
+
 enum VM_instructions {
   INSTRUCTIONS(I)
 
@@ -61,15 +94,38 @@ enum VM_instructions {
 struct VM_state {
   struct Function global;
   struct Object* variables;
-  struct Str_arr buffers;
+  struct Intern_table strings; // All string values
+  struct Intern_table symbols; // Identifiers, scopes are keyed by their index
+  struct Source_arr sources;  // All source code that has been loaded
+  struct Module_registry modules; // Files that have been loaded, by canonical path
   int variable_count;
+  int variable_capacity;
   struct Object stack[STACK_SIZE];
   int stack_top;
   int stack_bp;
   int status;
   Instruction* program;
   int program_size;
+  int program_capacity;
   int prev_ip;  // Instruction pointer from the previous vm dispatch
+  struct Profile profile;
+  struct Trace_cache traces;
+  struct Region region; // Lists that don't escape the function that created them
+  struct Gc gc; // Lists, maps and strings (see gc.c)
+  struct Lazy_function* lazy_functions; // Functions that are compiled on their first call
+  unsigned int lazy_count;
+  unsigned int lazy_capacity;
+  Ast* trees; // Trees that lazy functions refer to
+  unsigned int tree_count;
+  unsigned int tree_capacity;
+  Htable global_constants; // Constant_key -> index into the constants of the global scope, kept from one compile to the next
+  Htable definitions;  // Source text of the global functions by variable slot, to tell which have changed on reload
+  struct Scope* retired_scopes; // Of functions that have been replaced, their old code may still be running
+  unsigned int retired_count;
+  unsigned int retired_capacity;
+  unsigned char eager; // Compile all functions up front
+  unsigned char strict; // Parse all function bodies up front, so that every syntax error is found before running
+  unsigned char strip;  // Leave out the functions that the global code can't reach (see strip.c)
   unsigned char heap_allocated; // Is the vm state heap allocated?
 };
 
@@ -77,10 +133,23 @@ int vm_init(struct VM_state* vm);
 
 struct VM_state* vm_state_new();
 
-int vm_exec(struct VM_state* vm, const char* filename, char* input, struct Str_arr* str_arr);
+// The input is copied, the vm keeps it for as long as it lives
+int vm_exec(struct VM_state* vm, const char* filename, const char* input);
+
+int vm_exec_file(struct VM_state* vm, const char* path);
+
+// Recompile the functions of the file that have changed since it was loaded, and add new ones
+// The global code of the file isn't run again, 'reloaded' is set to the number of functions compiled
+int vm_reload(struct VM_state* vm, const char* path, int* reloaded);
 
 int vm_disasm(struct VM_state* vm, const char* output_file);
 
+// The instruction with this name in the bytecode listing, or I_UNKNOWN
+int vm_instruction(const char* name, int length);
+
+// Size, load and probe lengths of the tables that the vm keeps (see ht_get_stats)
+void vm_print_table_stats(struct VM_state* vm);
+
 void vm_state_free(struct VM_state* vm);
 
 #endif
@@ -1,16 +1,20 @@
 // api.c
 
 #include <stdio.h>
+#include <string.h>
 
 #include "api.h"
 
 int si_store_object(struct VM_state* vm, struct Scope* scope, const char* name, struct Object object) {
-  if (ht_element_exists(&scope->var_locations, name)) {
+  int symbol = intern_index(&vm->symbols, name, strlen(name));
+  if (symbol < 0)
+    return ALLOC_ERR;
+  if (ht_element_exists(&scope->var_locations, SYMBOL_KEY(symbol))) {
     return ERR;
   }
-  Instruction location = vm->variable_count;
-  ht_insert_element(&scope->var_locations, name, location);
-  list_push(vm->variables, vm->variable_count, object);
+  int location = vm->variable_count;
+  ht_insert_element(&scope->var_locations, SYMBOL_KEY(symbol), location);
+  list_push(vm->variables, vm->variable_count, vm->variable_capacity, object);
   return NO_ERR;
 }
 
@@ -25,10 +29,13 @@ int si_store_number(struct VM_state* vm, const char* name, double number) {
 
 int si_store_string(struct VM_state* vm, const char* name, char* string, int length) {
   struct Scope* scope = &vm->global.scope;
+  const struct Interned* interned = intern_string(&vm->strings, string, length);
+  if (!interned)
+    return ALLOC_ERR;
   struct Object object = {
     .type = T_STRING,
-    .value.str.data = string,
-    .value.str.length = length,
+    .value.str.data = interned->data,
+    .value.str.length = interned->length,
   };
   return si_store_object(vm, scope, name, object);
 }
@@ -56,6 +63,19 @@ int si_push_object(struct VM_state* vm, struct Object object) {
   return 0;
 }
 
+int si_push_string(struct VM_state* vm, const char* string, int length) {
+  const struct Interned* interned = intern_string(&vm->strings, string, length);
+  if (!interned)
+    return ALLOC_ERR;
+  struct Object obj = (struct Object) {
+    .type = T_STRING,
+    .value.str.data = interned->data,
+    .value.str.length = interned->length,
+  };
+  stack_push(vm, obj);
+  return 0;
+}
+
 int si_push_nil(struct VM_state* vm) {
   struct Object nil_object = { .type = T_NIL };
   stack_push(vm, nil_object);
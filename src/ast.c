@@ -1,4 +1,8 @@
 // ast.c
+//
+// Nodes are stored in one array and refer to each other by index. Children of a node form a
+// doubly linked list of siblings. Each node remembers the child that was accessed last, so
+// that walking the children in order (or stepping back to the previous one) takes constant time.
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -6,59 +10,121 @@
 
 #include "error.h"
 #include "mem.h"
+#include "list.h"
 #include "ast.h"
 
+#define NO_NODE -1
+
 struct Node {
-  struct Node** children;
-  int child_count;
   Value value;
+  int first_child;
+  int last_child;
+  int prev_sibling;
+  int next_sibling;
+  int child_count;
+  int cursor; // Last accessed child
+  int cursor_index;
+  int link; // Index of the tree that is linked to this node, see ast_link()
+};
+
+struct Ast_arena {
+  struct Node* nodes;
+  unsigned int count;
+  unsigned int capacity;
+  Ast* links; // Trees that are owned by this one
+  unsigned int link_count;
+  unsigned int link_capacity;
 };
 
 static int is_empty(const Ast ast);
-static struct Node* create_node(Value value);
+static struct Node* get_node(const Ast ast);
+static int create_node(struct Ast_arena* arena, Value value);
+static int child_at(struct Ast_arena* arena, struct Node* parent, int index);
 static int print_tree(const Ast ast, int level);
 
 int is_empty(const Ast ast) {
-  return ast == NULL;
+  return ast.arena == NULL || ast.node == NO_NODE;
+}
+
+struct Node* get_node(const Ast ast) {
+  assert(!is_empty(ast));
+  return &ast.arena->nodes[ast.node];
 }
 
-struct Node* create_node(Value value) {
-  struct Node* node = mmalloc(sizeof(struct Node));
-  if (!node) {
+// Returns the index of the new node
+int create_node(struct Ast_arena* arena, Value value) {
+  struct Node node = {
+    .value = value,
+    .first_child = NO_NODE,
+    .last_child = NO_NODE,
+    .prev_sibling = NO_NODE,
+    .next_sibling = NO_NODE,
+    .child_count = 0,
+    .cursor = NO_NODE,
+    .cursor_index = 0,
+    .link = NO_NODE,
+  };
+  unsigned int count = arena->count;
+  list_push(arena->nodes, arena->count, arena->capacity, node);
+  if (arena->count == count) {
     error("Failed to allocate new AST node\n");
-    return NULL;
+    return NO_NODE;
   }
+  return count;
+}
 
-  node->value = value;
-  node->child_count = 0;
-  node->children = NULL;
-
+// Find the child by walking from whichever is closest: the first child, the last child or the cursor
+int child_at(struct Ast_arena* arena, struct Node* parent, int index) {
+  if (index < 0 || index >= parent->child_count)
+    return NO_NODE;
+  int node = parent->first_child;
+  int at = 0;
+  if (parent->child_count - 1 - index < index) {
+    node = parent->last_child;
+    at = parent->child_count - 1;
+  }
+  if (parent->cursor != NO_NODE && abs(parent->cursor_index - index) < abs(at - index)) {
+    node = parent->cursor;
+    at = parent->cursor_index;
+  }
+  for (; at < index; at++)
+    node = arena->nodes[node].next_sibling;
+  for (; at > index; at--)
+    node = arena->nodes[node].prev_sibling;
+  parent->cursor = node;
+  parent->cursor_index = index;
   return node;
 }
 
 int print_tree(const Ast ast, int level) {
   if (is_empty(ast))
     return NO_ERR;
+  const struct Node* node = get_node(ast);
   for (int i = 0; i < level - 1; i++) {
     printf("  ");
   }
-  if (ast->value.length > 0) {
-    printf("%.*s\n", ast->value.length, ast->value.string);
+  if (node->value.length > 0) {
+    printf("%.*s\n", node->value.length, node->value.string);
   }
   else if (level > 0) {
-    print_token(ast->value);
+    print_token(node->value);
     printf("\n");
   }
 
-  for (unsigned long i = 0; i < ast->child_count; i++) {
-    print_tree(ast->children[i], level + 1);
+  for (int child = node->first_child; child != NO_NODE; child = ast.arena->nodes[child].next_sibling) {
+    print_tree((Ast) { ast.arena, child }, level + 1);
+  }
+  if (node->link != NO_NODE) {
+    Ast link = ast.arena->links[node->link];
+    for (int child = get_node(link)->first_child; child != NO_NODE; child = link.arena->nodes[child].next_sibling)
+      print_tree((Ast) { link.arena, child }, level + 1);
   }
 
   return NO_ERR;
 }
 
 Ast ast_create() {
-  return NULL;
+  return (Ast) { NULL, NO_NODE };
 }
 
 int ast_is_empty(const Ast ast) {
@@ -66,102 +132,144 @@ int ast_is_empty(const Ast ast) {
 }
 
 int ast_add_node(Ast* ast, Value value) {
-  struct Node* new_node = create_node(value);
-  if (!new_node)
-    return ALLOC_ERR;
-
-  if (is_empty(*ast)) {
-    *ast = create_node((struct Token) {});
-    if (!(*ast))
+  assert(ast != NULL);
+  if (!ast->arena) {
+    struct Ast_arena* arena = mmalloc(sizeof(struct Ast_arena));
+    if (!arena)
+      return ALLOC_ERR;
+    arena->nodes = NULL;
+    arena->count = 0;
+    arena->capacity = 0;
+    arena->links = NULL;
+    arena->link_count = 0;
+    arena->link_capacity = 0;
+    ast->arena = arena;
+    ast->node = create_node(arena, (struct Token) {0});  // Root
+    if (ast->node == NO_NODE)
       return ALLOC_ERR;
   }
-  if (!(*ast)->children) {
-    (*ast)->children = mmalloc(sizeof(struct Node*));
-  }
-  else {
-    struct Node** tmp = mrealloc((*ast)->children, (sizeof(struct Node*) * (*ast)->child_count), (sizeof(struct Node*)) * ((*ast)->child_count + 1));
-    if (!tmp)
-      return REALLOC_ERR;
-    (*ast)->children = tmp;
-  }
-  (*ast)->children[(*ast)->child_count++] = new_node;
+  assert(ast->node != NO_NODE);
+  int new_node = create_node(ast->arena, value);
+  if (new_node == NO_NODE)
+    return ALLOC_ERR;
+  struct Node* parent = get_node(*ast);  // The nodes might have moved when we added the new one
+  ast->arena->nodes[new_node].prev_sibling = parent->last_child;
+  if (parent->last_child != NO_NODE)
+    ast->arena->nodes[parent->last_child].next_sibling = new_node;
+  else
+    parent->first_child = new_node;
+  parent->last_child = new_node;
+  parent->child_count++;
   return NO_ERR;
 }
 
 int ast_add_node_at(Ast* ast, int index, Value value) {
   assert(!is_empty(*ast));
-  assert(index < (*ast)->child_count);
-  return ast_add_node(&(*ast)->children[index], value);
+  assert(index < ast_child_count(ast));
+  Ast child = ast_get_node_at(ast, index);
+  return ast_add_node(&child, value);
 }
 
 Ast ast_get_node_at(Ast* ast, int index) {
   assert(!is_empty(*ast));
-  if (index < 0 || index > (*ast)->child_count)
-    return NULL;
-  return (*ast)->children[index];
+  return (Ast) { ast->arena, child_at(ast->arena, get_node(*ast), index) };
 }
 
 Ast ast_get_last(Ast* ast) {
   assert(!is_empty(*ast));
-  int child_count = ast_child_count(ast);
-  if (child_count == 0)
-    return NULL;
-  return (*ast)->children[child_count - 1];
+  return (Ast) { ast->arena, get_node(*ast)->last_child };
 }
 
+// The node (and its subtree) is unlinked from the tree, its memory is released with the rest of the tree
 int ast_remove_node_at(Ast* ast, int index) {
   assert(!is_empty(*ast));
-  int child_count = ast_child_count(ast);
-  assert(index < child_count);
-  Ast node_to_remove = ast_get_node_at(ast, index);
-  ast_free(&node_to_remove);	// NOTE(lucas): Removes the subtree(s) from this node - if there are any
-  (*ast)->children[index] = NULL;
-  for (int i = index; i < child_count - 1; i++) {
-    (*ast)->children[i] = (*ast)->children[i + 1];
-  }
-  (*ast)->child_count--;
+  struct Node* parent = get_node(*ast);
+  int child = child_at(ast->arena, parent, index);
+  assert(child != NO_NODE);
+  struct Node* node = &ast->arena->nodes[child];
+  if (node->prev_sibling != NO_NODE)
+    ast->arena->nodes[node->prev_sibling].next_sibling = node->next_sibling;
+  else
+    parent->first_child = node->next_sibling;
+  if (node->next_sibling != NO_NODE)
+    ast->arena->nodes[node->next_sibling].prev_sibling = node->prev_sibling;
+  else
+    parent->last_child = node->prev_sibling;
+  parent->child_count--;
+  parent->cursor = NO_NODE;
+  return NO_ERR;
+}
+
+int ast_link(Ast* ast, Ast* tree) {
+  assert(!is_empty(*ast) && tree != NULL);
+  assert(get_node(*ast)->link == NO_NODE);
+  if (is_empty(*tree))
+    return NO_ERR;
+  struct Ast_arena* arena = ast->arena;
+  unsigned int count = arena->link_count;
+  list_push(arena->links, arena->link_count, arena->link_capacity, *tree);
+  if (arena->link_count == count)
+    return ALLOC_ERR;
+  get_node(*ast)->link = count;
+  *tree = ast_create();
   return NO_ERR;
 }
 
+Ast ast_get_link(const Ast* ast) {
+  assert(!is_empty(*ast));
+  const struct Node* node = get_node(*ast);
+  if (node->link == NO_NODE)
+    return ast_create();
+  return ast->arena->links[node->link];
+}
+
 int ast_child_count(const Ast* ast) {
   assert(ast != NULL);
-  if (!(*ast))
+  if (is_empty(*ast))
     return 0;
-  return (*ast)->child_count;
+  return get_node(*ast)->child_count;
 }
 
 int ast_child_count_total(const Ast* ast) {
   assert(ast != NULL);
-  if (!(*ast)) {
+  if (is_empty(*ast)) {
     return 0;
   }
-  if (!(*ast)->child_count) {
+  const struct Node* node = get_node(*ast);
+  if (!node->child_count) {
     return 1;
   }
   int count = 0;
-  for (int i = 0; i < (*ast)->child_count; i++) {
-    count += ast_child_count_total(&(*ast)->children[i]);
+  for (int child = node->first_child; child != NO_NODE; child = ast->arena->nodes[child].next_sibling) {
+    Ast child_ast = { ast->arena, child };
+    count += ast_child_count_total(&child_ast);
   }
   return count;
 }
 
-Ast* ast_get_node(Ast* ast, int index) {
+void ast_for_each_value(Ast* ast, void (*func)(Value* value, void* data), void* data) {
   assert(ast != NULL);
-  if (index >= 0 && index < ast_child_count(ast)) {
-    return &(*ast)->children[index];
-  }
-  return NULL;
+  if (!ast->arena)
+    return;
+  for (unsigned int i = 0; i < ast->arena->count; i++)
+    func(&ast->arena->nodes[i].value, data);
 }
 
 Value* ast_get_node_value(Ast* ast, int index) {
   assert(ast != NULL);
-  if (index >= 0 && index < ast_child_count(ast)) {
-    struct Node* node = (*ast)->children[index];
-    if (!node)
-      return NULL;
-    return &node->value;
-  }
-  return NULL;
+  if (is_empty(*ast))
+    return NULL;
+  int child = child_at(ast->arena, get_node(*ast), index);
+  if (child == NO_NODE)
+    return NULL;
+  return &ast->arena->nodes[child].value;
+}
+
+Value* ast_get_value(Ast* ast) {
+  assert(ast != NULL);
+  if (is_empty(*ast))
+    return NULL;
+  return &get_node(*ast)->value;
 }
 
 void ast_print(const Ast ast) {
@@ -170,22 +278,16 @@ void ast_print(const Ast ast) {
   printf("\n");
 }
 
+// Releases the whole tree that the node belongs to, and the trees linked to it
 void ast_free(Ast* ast) {
   assert(ast != NULL);
-  if (is_empty(*ast)) return;
-
-  for (unsigned long i = 0; i < (*ast)->child_count; i++) {
-    ast_free(&(*ast)->children[i]);
-  }
-
-  if ((*ast)->children) {
-    mfree((*ast)->children, sizeof(struct Node*) * (*ast)->child_count);
-    (*ast)->children = NULL;
-    (*ast)->child_count = 0;
-  }
-  if (*ast) {
-    mfree(*ast, sizeof(struct Node));
-    *ast = NULL;
+  if (ast->arena) {
+    for (unsigned int i = 0; i < ast->arena->link_count; i++)
+      ast_free(&ast->arena->links[i]);
+    list_free(ast->arena->links, ast->arena->link_count, ast->arena->link_capacity);
+    list_free(ast->arena->nodes, ast->arena->count, ast->arena->capacity);
+    mfree(ast->arena, sizeof(struct Ast_arena));
   }
+  *ast = ast_create();
   assert(is_empty(*ast));
 }
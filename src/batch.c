@@ -0,0 +1,194 @@
+// batch.c
+// Parallel compilation of functions
+//
+// When every function is compiled before the program runs, the functions in the global scope are
+// queued as they are declared instead of compiled in place. Once the global code has been
+// compiled, each queued function is a job, compiled by whichever thread gets to it first into code
+// of its own. The global scope is complete by then and nothing adds to it while the jobs run, so
+// the jobs only read it. The variable slots that a job declares are reserved up front, and the few
+// things the jobs do share (interned strings) are done with the batch lock held.
+//
+// The code of the jobs is then appended to the program on the calling thread, in the order the
+// functions were declared, and the function addresses are moved along with it. Jumps are relative,
+// so they stay as they are.
+
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "mem.h"
+#include "list.h"
+#include "token.h"
+#include "vm.h"
+#include "batch.h"
+
+static int scan_body(Ast* ast, int* declarations);
+static void compile_job(struct Batch* batch, struct Compile_job* job);
+static void run_jobs(struct Batch* batch);
+static void* worker(void* data);
+static int link_job(struct Batch* batch, struct Compile_job* job);
+
+// Can the body be compiled apart from the rest of the program?
+// Imports and loads change the global state, and bodies that are still to be parsed need the parser
+// Every declaration in the body takes a variable slot, functions inside of it included
+int scan_body(Ast* ast, int* declarations) {
+  for (int i = 0; i < ast_child_count(ast); i++) {
+    const struct Token* token = ast_get_node_value(ast, i);
+    if (!token)
+      continue;
+    if (token->type == T_IMPORT || token->type == T_LOAD || token->type == T_DEFERRED)
+      return 0;
+    if (token->type == T_DECL || token->type == T_FUNC_DEF)
+      (*declarations)++;
+    Ast child = ast_get_node_at(ast, i);
+    if (!scan_body(&child, declarations))
+      return 0;
+  }
+  return 1;
+}
+
+void compile_job(struct Batch* batch, struct Compile_job* job) {
+  struct VM_state* vm = batch->vm;
+  struct Func_state state;
+  func_state_init(vm, &state, &vm->global, 1);
+  state.job = job;
+  state.status = &job->status;
+  unsigned int ins_count = 0;
+  job->compiled = compile_function_body(vm, &job->params, &job->block, &state, &job->function, &ins_count) == NO_ERR;
+  func_state_free(&state);
+}
+
+void run_jobs(struct Batch* batch) {
+  for (;;) {
+    pthread_mutex_lock(&batch->lock);
+    struct Compile_job* job = NULL;
+    if (batch->next_job < batch->job_count)
+      job = &batch->jobs[batch->next_job++];
+    pthread_mutex_unlock(&batch->lock);
+    if (!job)
+      break;
+    compile_job(batch, job);
+  }
+}
+
+void* worker(void* data) {
+  run_jobs(data);
+  return NULL;
+}
+
+int link_job(struct Batch* batch, struct Compile_job* job) {
+  struct VM_state* vm = batch->vm;
+  if (!job->compiled)
+    return COMPILE_ERR;
+  int base = vm->program_size;
+  list_reserve(vm->program, vm->program_size, vm->program_capacity, base + job->code.size);
+  if (vm->program_capacity < base + job->code.size) {
+    scope_free(&job->function.scope);
+    return ALLOC_ERR;
+  }
+  memcpy(&vm->program[base], job->code.program, job->code.size * sizeof(Instruction));
+  vm->program_size += job->code.size;
+  for (int i = job->slot_end - job->slot_count; i < job->next_slot; i++) {
+    struct Function* func = &vm->variables[i].value.func;
+    if (vm->variables[i].type == T_FUNCTION && func->lazy < 0)
+      func->addr += base;
+  }
+  job->function.addr += base;
+  struct Object* variable = &vm->variables[job->location];
+  variable->type = T_FUNCTION;
+  variable->value.func = job->function;
+  return job->status;
+}
+
+void batch_init(struct Batch* batch, struct VM_state* vm) {
+  assert(batch != NULL && vm != NULL);
+  batch->vm = vm;
+  batch->jobs = NULL;
+  batch->job_count = 0;
+  batch->job_capacity = 0;
+  batch->next_job = 0;
+  batch->thread_count = 0;
+  pthread_mutex_init(&batch->lock, NULL);
+}
+
+int batch_add(struct Batch* batch, Ast* params, Ast* block, int location, int* queued) {
+  assert(batch != NULL && params != NULL && block != NULL && queued != NULL);
+  int declarations = 0;
+  *queued = 0;
+  if (!scan_body(block, &declarations))
+    return NO_ERR;
+  struct Compile_job job = {
+    .params = *params,
+    .block = *block,
+    .location = location,
+    .slot_count = declarations,
+    .next_slot = 0,
+    .slot_end = 0,
+    .code = { NULL, 0, 0 },
+    .compiled = 0,
+    .status = NO_ERR,
+    .lock = &batch->lock,
+  };
+  unsigned int count = batch->job_count;
+  list_push(batch->jobs, batch->job_count, batch->job_capacity, job);
+  if (batch->job_count == count)
+    return ALLOC_ERR;
+  *queued = 1;
+  return NO_ERR;
+}
+
+int batch_compile(struct Batch* batch, struct Func_state* state) {
+  assert(batch != NULL && state != NULL);
+  struct VM_state* vm = batch->vm;
+  if (batch->job_count == 0)
+    return NO_ERR;
+  for (unsigned int i = 0; i < batch->job_count; i++) {
+    struct Compile_job* job = &batch->jobs[i];
+    list_reserve(vm->variables, vm->variable_count, vm->variable_capacity, vm->variable_count + job->slot_count);
+    if (vm->variable_capacity < vm->variable_count + job->slot_count)
+      return *state->status = ALLOC_ERR;
+    job->next_slot = vm->variable_count;
+    for (int slot = 0; slot < job->slot_count; slot++)
+      vm->variables[vm->variable_count++] = (struct Object) { .type = T_NIL };
+    job->slot_end = vm->variable_count;
+  }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned int thread_max = cpus > 1 ? cpus - 1 : 0; // The calling thread compiles as well
+  if (thread_max > COMPILE_THREADS_MAX)
+    thread_max = COMPILE_THREADS_MAX;
+  if (thread_max > batch->job_count - 1)
+    thread_max = batch->job_count - 1;
+  for (unsigned int i = 0; i < thread_max; i++) {
+    if (pthread_create(&batch->threads[batch->thread_count], NULL, worker, batch) == 0)
+      batch->thread_count++;
+  }
+  run_jobs(batch);
+  for (unsigned int i = 0; i < batch->thread_count; i++)
+    pthread_join(batch->threads[i], NULL);
+  batch->thread_count = 0;
+
+  int skip_index = instruction_add_jump(vm, state, I_JUMP, NULL); // Skip the function blocks
+  int status = NO_ERR;
+  for (unsigned int i = 0; i < batch->job_count; i++) {
+    int job_status = link_job(batch, &batch->jobs[i]);
+    if (status == NO_ERR && job_status != NO_ERR)
+      status = job_status == ALLOC_ERR ? ALLOC_ERR : COMPILE_ERR;
+  }
+  patch_jump(vm, state, skip_index, code_size(vm, state));
+  if (status != NO_ERR)
+    *state->status = status;
+  return status;
+}
+
+void batch_free(struct Batch* batch) {
+  assert(batch != NULL);
+  assert(batch->thread_count == 0);
+  for (unsigned int i = 0; i < batch->job_count; i++) {
+    struct Code* code = &batch->jobs[i].code;
+    list_free(code->program, code->size, code->capacity);
+  }
+  list_free(batch->jobs, batch->job_count, batch->job_capacity);
+  pthread_mutex_destroy(&batch->lock);
+}
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 #include <dlfcn.h>
 
 #include "error.h"
@@ -16,14 +17,18 @@
 #include "vm.h"
 #include "object.h"
 #include "token.h"
+#include "parser.h"
 #include "compile.h"
+#include "verify.h"
+#include "batch.h"
 
-// Compile-time function state
-struct Func_state {
-  struct Function* func;
-  struct Function* global;
-  struct Function local;
-  Htable args;
+// Constants are looked up by value, so that each one is only stored once in the scope
+// Strings are interned, so two strings are the same if they have the same data
+struct Constant_key {
+  int type;
+  int length;
+  const char* data;
+  double number;
 };
 
 #define compile_error(fmt, ...) \
@@ -37,122 +42,176 @@ struct Func_state {
 
 #define UNRESOLVED_JUMP 0
 
-static int instruction_add(struct VM_state* vm, Instruction instruction, unsigned int* ins_count);
-static int func_state_init(struct Func_state* state, struct Function* global, int in_global_scope);
-static void func_state_free(struct Func_state* state);
-static const int* variable_lookup(struct VM_state* vm, struct Func_state* state, const char* identifier);
-static const int* local_lookup(struct VM_state* vm, struct Func_state* state, const char* identifier);
-static int patchblock(struct VM_state* vm, int block_size);
+static const int* variable_lookup(struct VM_state* vm, struct Func_state* state, int symbol);
+static const int* local_lookup(struct VM_state* vm, struct Func_state* state, int symbol);
 static int compile_ifstatement(struct VM_state* vm, Ast* cond, Ast* block, struct Func_state* state, unsigned int* ins_count);
 static int compile_whileloop(struct VM_state* vm, Ast* cond, Ast* block, struct Func_state* state, unsigned int* ins_count);
-static int compile_function(struct VM_state* vm, struct Token* identifier, Ast* params, Ast* block, struct Func_state* state, unsigned int* ins_count);
-static int compile(struct VM_state* vm, Ast* ast, struct Func_state* state, unsigned int* ins_count);
-static int compile_pushk(struct VM_state* vm, struct Func_state* state, struct Token constant, unsigned int* ins_count);
-static int compile_pushvar(struct VM_state* vm, struct Func_state* state, struct Token variable, unsigned int* ins_count);
-static int compile_declvar(struct VM_state* vm, struct Func_state* state, struct Token variable);
-static int get_variable_location(struct VM_state* vm, struct Func_state* state, struct Token variable, Instruction* location);
-static int store_constant(struct VM_state* vm, struct Func_state* state, struct Token constant, Instruction* location);
-static int store_variable(struct VM_state* vm, struct Func_state* state, struct Token variable, Instruction* location);
-static int token_to_op(struct Token token);
-
-int instruction_add(struct VM_state* vm, Instruction instruction, unsigned int* ins_count) {
-  list_push(vm->program, vm->program_size, instruction);
+static int parse_deferred(struct VM_state* vm, Ast* block);
+static const struct Source* changed_source(struct VM_state* vm, const char* text);
+static void store_definition(struct VM_state* vm, int location, struct Token* identifier, Ast* block);
+static int redefine(struct VM_state* vm, struct Func_state* state, int location, Ast* params, Ast* block);
+static int reload(struct VM_state* vm, Ast* ast, struct Func_state* state, int* reloaded);
+static struct Constant_key constant_key(const struct Object* object);
+static int store_constant(struct VM_state* vm, struct Func_state* state, struct Token constant, int* location);
+static int identifier_equal(const struct Token* a, const struct Token* b);
+static int identifier_is(const struct Token* token, const char* name);
+static int is_builtin(struct VM_state* vm, struct Func_state* state, const struct Token* identifier);
+static int is_leaf(struct VM_state* vm, struct Func_state* state, Ast* ast);
+static int is_whole_first_arg(Ast* args, const struct Token* identifier);
+static int list_escapes(Ast* ast, const struct Token* decl, int start);
+static void find_local_lists(struct VM_state* vm, struct Func_state* state, Ast* block);
+
+int code_size(struct VM_state* vm, struct Func_state* state) {
+  return state->job ? state->job->code.size : vm->program_size;
+}
+
+int instruction_add(struct VM_state* vm, struct Func_state* state, Instruction instruction, unsigned int* ins_count) {
+  if (state->job) {
+    struct Code* code = &state->job->code;
+    list_push(code->program, code->size, code->capacity, instruction);
+  }
+  else
+    list_push(vm->program, vm->program_size, vm->program_capacity, instruction);
   if (ins_count)
     (*ins_count)++;
   return NO_ERR;
 }
 
-int func_state_init(struct Func_state* state, struct Function* global, int in_global_scope) {
+// Add instruction with operand, using the smallest encoding the operand fits in
+int instruction_add_arg(struct VM_state* vm, struct Func_state* state, Instruction instruction, int arg, unsigned int* ins_count) {
+  int size = ARG_SIZE;
+  if (arg < ARG_MIN_16 || arg > ARG_MAX_16) {
+    instruction_add(vm, state, I_WIDE, ins_count);
+    size = ARG_SIZE_WIDE;
+  }
+  else if (arg < ARG_MIN || arg > ARG_MAX) {
+    instruction_add(vm, state, I_WIDE16, ins_count);
+    size = ARG_SIZE_16;
+  }
+  instruction_add(vm, state, instruction, ins_count);
+  for (int i = 0; i < size; i++)
+    instruction_add(vm, state, (Instruction)(((unsigned int)arg >> (i * 8)) & 0xff), ins_count);
+  return NO_ERR;
+}
+
+// Jumps are resolved after the fact, so they always get a wide operand
+// Returns the location of the (unresolved) jump operand
+int instruction_add_jump(struct VM_state* vm, struct Func_state* state, Instruction instruction, unsigned int* ins_count) {
+  instruction_add(vm, state, I_WIDE, ins_count);
+  instruction_add(vm, state, instruction, ins_count);
+  int jump_index = code_size(vm, state);
+  for (int i = 0; i < ARG_SIZE_WIDE; i++)
+    instruction_add(vm, state, UNRESOLVED_JUMP, ins_count);
+  return jump_index;
+}
+
+// Jumps are relative to the location of the jump operand
+void patch_jump(struct VM_state* vm, struct Func_state* state, int jump_index, int target) {
+  Instruction* program = state->job ? state->job->code.program : vm->program;
+  assert(jump_index >= 0 && jump_index + ARG_SIZE_WIDE <= code_size(vm, state));
+  unsigned int jump = (unsigned int)(target - jump_index);
+  for (int i = 0; i < ARG_SIZE_WIDE; i++)
+    program[jump_index + i] = (jump >> (i * 8)) & 0xff;
+}
+
+int func_state_init(struct VM_state* vm, struct Func_state* state, struct Function* global, int in_global_scope) {
   assert(state != NULL);
   state->args = ht_create_empty();
+  state->constants = ht_create_empty();
   if (!in_global_scope)
     state->func = &state->local;
   else
     state->func = global;
   state->global = global;
+  state->local_lists = NULL;
+  state->local_list_count = 0;
+  state->local_list_capacity = 0;
+  state->local_list_slots = NULL;
+  state->local_list_slot_count = 0;
+  state->local_list_slot_capacity = 0;
+  state->job = NULL;
+  state->batch = NULL;
+  state->status = &vm->status;
   return NO_ERR;
 }
 
 void func_state_free(struct Func_state* state) {
   ht_free(&state->args);
+  ht_free(&state->constants);
+  list_free(state->local_lists, state->local_list_count, state->local_list_capacity);
+  list_free(state->local_list_slots, state->local_list_slot_count, state->local_list_slot_capacity);
 }
 
 // First check the local scope,
 // then the parent scope,
 // and finally the global scope
-const int* variable_lookup(struct VM_state* vm, struct Func_state* state, const char* identifier) {
+const int* variable_lookup(struct VM_state* vm, struct Func_state* state, int symbol) {
   struct Scope* scope = &state->func->scope;
   struct Scope* parent_scope = state->func->scope.parent;
   struct Scope* global_scope = &state->global->scope;
   assert(scope != NULL);
   assert(global_scope != NULL);
-  const int* found = ht_lookup(&scope->var_locations, identifier);  // Find the location/index of the variable
+  const int* found = ht_lookup(&scope->var_locations, SYMBOL_KEY(symbol));  // Find the location/index of the variable
   if (found)
     return found;
 
   if (parent_scope) {
-    found = ht_lookup(&parent_scope->var_locations, identifier);
+    found = ht_lookup(&parent_scope->var_locations, SYMBOL_KEY(symbol));
     if (found)
       return found;
   }
-  found = ht_lookup(&global_scope->var_locations, identifier);
+  found = ht_lookup(&global_scope->var_locations, SYMBOL_KEY(symbol));
   return found;
 }
 
-const int* local_lookup(struct VM_state* vm, struct Func_state* state, const char* identifier) {
-  const int* found = ht_lookup(&state->args, identifier);
+const int* local_lookup(struct VM_state* vm, struct Func_state* state, int symbol) {
+  const int* found = ht_lookup(&state->args, SYMBOL_KEY(symbol));
   return found;
 }
 
-// Update all goto/break statements in block
-int patchblock(struct VM_state* vm, int block_size) {
-  int end = vm->program_size - 1;
-  for (int i = end - block_size; i < end; i++) {
-    Instruction instruction = vm->program[i];
-    if (instruction == I_JUMP || instruction == I_IF) {
-      if (vm->program[i + 1] == UNRESOLVED_JUMP)  { // Fix unresolved jump
-        vm->program[i + 1] = end - i;
-      }
-      i++;
-    }
-    else // Skip any other instruction that isn't a jump
-      i += compile_get_ins_arg_count(instruction);
+// Update all goto/break statements in block (from start to the end of the program)
+int patchblock(struct VM_state* vm, struct Func_state* state, int start) {
+  Instruction* program = state->job ? state->job->code.program : vm->program;
+  int end = code_size(vm, state);
+  for (int i = start; i < end;) {
+    Instruction instruction = I_UNKNOWN;
+    int arg = 0;
+    unsigned int size = compile_decode_ins(&program[i], &instruction, &arg);
+    if ((instruction == I_JUMP || instruction == I_IF) && arg == UNRESOLVED_JUMP) // Fix unresolved jump
+      patch_jump(vm, state, i + size - ARG_SIZE_WIDE, end);
+    i += size;
   }
   return NO_ERR;
 }
 
 int compile_pushk(struct VM_state* vm, struct Func_state* state, struct Token constant, unsigned int* ins_count) {
-  Instruction location = -1;
+  int location = -1;
   store_constant(vm, state, constant, &location);
-  instruction_add(vm, I_PUSHK, ins_count);
-  instruction_add(vm, location, ins_count);
+  instruction_add_arg(vm, state, I_PUSHK, location, ins_count);
   return NO_ERR;
 }
 
 int compile_pushvar(struct VM_state* vm, struct Func_state* state, struct Token variable, unsigned int* ins_count) {
-  Instruction location = -1;
+  int location = -1;
   Instruction push_instruction = I_PUSH_VAR;
-  char* identifier = string_new_copy(variable.string, variable.length);
-  const int* found = ht_lookup(&state->args, identifier);
+  const int* found = local_lookup(vm, state, variable.symbol);
   push_instruction = I_PUSH_ARG;
   if (!found) {
-    found = variable_lookup(vm, state, identifier);
+    found = variable_lookup(vm, state, variable.symbol);
     push_instruction = I_PUSH_VAR;
   }
-  string_free(identifier);
   if (!found) {
     compile_error2((&variable), "Undeclared identifier '%.*s'\n", variable.length, variable.string);
     return COMPILE_ERR;
   }
   location = *found;
-  instruction_add(vm, push_instruction, ins_count);
-  instruction_add(vm, location, ins_count);
   assert(location >= 0);
+  instruction_add_arg(vm, state, push_instruction, location, ins_count);
   return NO_ERR;
 }
 
 int compile_declvar(struct VM_state* vm, struct Func_state* state, struct Token variable) {
-  Instruction location = -1;
+  int location = -1;
   int err = store_variable(vm, state, variable, &location);
   if (err == WARN) {
     compile_warning((&variable), "Variable '%.*s' has already been declared\n", variable.length, variable.string);
@@ -164,11 +223,43 @@ int compile_declvar(struct VM_state* vm, struct Func_state* state, struct Token
   return NO_ERR;
 }
 
-int get_variable_location(struct VM_state* vm, struct Func_state* state, struct Token variable, Instruction* location) {
+int compile_assign(struct VM_state* vm, struct Func_state* state, struct Token variable, unsigned int* ins_count) {
+  Instruction assign_instruction = I_ASSIGN;
+  const int* found = local_lookup(vm, state, variable.symbol);
+  if (found)
+    assign_instruction = I_LOCAL_ASSIGN;
+  else
+    found = variable_lookup(vm, state, variable.symbol);
+  if (!found) {
+    compile_error2((&variable), "%s\n", "No such variable");
+    return COMPILE_ERR;
+  }
+  assert(*found >= 0);
+  instruction_add_arg(vm, state, assign_instruction, *found, ins_count);
+  return NO_ERR;
+}
+
+// load "path", where path.so is a library with an 'init' function that adds its functions to the vm
+int compile_load(struct VM_state* vm, const struct Token* path_token) {
+  char path[PATH_LENGTH_MAX] = {0};
+  snprintf(path, PATH_LENGTH_MAX, "%.*s.so", path_token->length, path_token->string);
+  void* lib_handle = dlopen(path, RTLD_LAZY);
+  if (!lib_handle) {
+    compile_error2(path_token, "Failed to open library '%s'; %s\n", path, dlerror());
+    return COMPILE_ERR;
+  }
+  CFunction init = dlsym(lib_handle, "init");
+  if (!init) {
+    compile_error2(path_token, "Failed to find symbol 'init'\n");
+    return COMPILE_ERR;
+  }
+  init(vm);
+  return NO_ERR;
+}
+
+int get_variable_location(struct VM_state* vm, struct Func_state* state, struct Token variable, int* location) {
   struct Scope* scope = &state->func->scope;
-  char* identifier = string_new_copy(variable.string, variable.length);
-  const int* found = ht_lookup(&scope->var_locations, identifier);
-  string_free(identifier);
+  const int* found = ht_lookup(&scope->var_locations, SYMBOL_KEY(variable.symbol));
   if (!found) {
     compile_error2((&variable), "No such variable '%.*s'\n", variable.length, variable.string);
     return COMPILE_ERR;
@@ -177,30 +268,63 @@ int get_variable_location(struct VM_state* vm, struct Func_state* state, struct
   return NO_ERR;
 }
 
-int store_constant(struct VM_state* vm, struct Func_state* state, struct Token constant, Instruction* location) {
+struct Constant_key constant_key(const struct Object* object) {
+  struct Constant_key key;
+  memset(&key, 0, sizeof(key));  // The key is compared byte for byte, padding included
+  key.type = object->type;
+  switch (object->type) {
+    case T_NUMBER:
+      key.number = object->value.number;
+      break;
+    case T_STRING:
+      key.data = object->value.str.data;
+      key.length = object->value.str.length;
+      break;
+    default:
+      break;
+  }
+  return key;
+}
+
+// The global scope is added to by every compile, so its lookup is kept in the vm
+int store_constant(struct VM_state* vm, struct Func_state* state, struct Token constant, int* location) {
   assert(location != NULL);
   struct Scope* scope = &state->func->scope;
-  *location = scope->constants_count;
+  Htable* constants = state->func == state->global ? &vm->global_constants : &state->constants;
+  if (state->job)
+    pthread_mutex_lock(state->job->lock);  // Strings are interned in the vm
   struct Object object = token_to_object(vm, constant);
-  list_push(scope->constants, scope->constants_count, object);
+  if (state->job)
+    pthread_mutex_unlock(state->job->lock);
+  struct Constant_key key = constant_key(&object);
+  const Hvalue* found = ht_lookup(constants, (const char*)&key, sizeof(key));
+  if (found) {
+    *location = *found;
+    return NO_ERR;
+  }
+  *location = scope->constants_count;
+  list_push(scope->constants, scope->constants_count, scope->constants_capacity, object);
+  ht_insert_element(constants, (const char*)&key, sizeof(key), *location);
   return NO_ERR;
 }
 
-int store_variable(struct VM_state* vm, struct Func_state* state, struct Token variable, Instruction* location) {
+int store_variable(struct VM_state* vm, struct Func_state* state, struct Token variable, int* location) {
   assert(location != NULL);
   struct Scope* scope = &state->func->scope;
-  char* identifier = string_new_copy(variable.string, variable.length);
-  if (ht_element_exists(&scope->var_locations, identifier)) {
-    string_free(identifier);
+  if (ht_element_exists(&scope->var_locations, SYMBOL_KEY(variable.symbol))) {
     return WARN;
   }
+  else if (state->job) {  // The slots of the job have been reserved before it started
+    assert(state->job->next_slot < state->job->slot_end);
+    *location = state->job->next_slot++;
+    ht_insert_element(&scope->var_locations, SYMBOL_KEY(variable.symbol), *location);
+  }
   else {
     struct Object object = token_to_object(vm, variable);
     *location = vm->variable_count;
-    ht_insert_element(&scope->var_locations, identifier, *location);
-    list_push(vm->variables, vm->variable_count, object);
-    assert(ht_element_exists(&scope->var_locations, identifier) != 0);
-    string_free(identifier);
+    ht_insert_element(&scope->var_locations, SYMBOL_KEY(variable.symbol), *location);
+    list_push(vm->variables, vm->variable_count, vm->variable_capacity, object);
+    assert(ht_element_exists(&scope->var_locations, SYMBOL_KEY(variable.symbol)) != 0);
   }
   return NO_ERR;
 }
@@ -235,19 +359,186 @@ int token_to_op(struct Token token) {
   return I_UNKNOWN;
 }
 
+int identifier_equal(const struct Token* a, const struct Token* b) {
+  return a->type == T_IDENTIFIER && b->type == T_IDENTIFIER && a->symbol == b->symbol;
+}
+
+int identifier_is(const struct Token* token, const char* name) {
+  return token->type == T_IDENTIFIER && (int)strlen(name) == token->length && !strncmp(token->string, name, token->length);
+}
+
+// Does the identifier refer to a C function from the global scope?
+int is_builtin(struct VM_state* vm, struct Func_state* state, const struct Token* identifier) {
+  const int* found = NULL;
+  if (!local_lookup(vm, state, identifier->symbol))  // Arguments can hold any value
+    found = variable_lookup(vm, state, identifier->symbol);
+  return found && vm->variables[*found].type == T_CFUNCTION;
+}
+
+// A function is a leaf if it only calls C functions, so no other frame can see its variables while it runs
+int is_leaf(struct VM_state* vm, struct Func_state* state, Ast* ast) {
+  for (int i = 0; i < ast_child_count(ast); i++) {
+    const struct Token* token = ast_get_node_value(ast, i);
+    if (!token)
+      continue;
+    switch (token->type) {
+      case T_FUNC_DEF:
+      case T_IMPORT:
+      case T_LOAD:
+        return 0;
+      case T_CALL: {
+        const struct Token* callee = i > 0 ? ast_get_node_value(ast, i - 1) : NULL;
+        if (!callee || callee->type != T_IDENTIFIER || !is_builtin(vm, state, callee))
+          return 0;
+        break;
+      }
+      default:
+        break;
+    }
+    Ast child = ast_get_node_at(ast, i);
+    if (!is_leaf(vm, state, &child))
+      return 0;
+  }
+  return 1;
+}
+
+// Is the first argument of the call exactly the identifier (and not part of a larger expression)?
+int is_whole_first_arg(Ast* args, const struct Token* identifier) {
+  const struct Token* first = ast_get_node_value(args, 0);
+  if (!first || !identifier_equal(first, identifier))
+    return 0;
+  int depth = 0;  // Number of values on the stack above the first argument
+  for (int i = 1; i < ast_child_count(args); i++) {
+    const struct Token* token = ast_get_node_value(args, i);
+    const struct Token* prev = ast_get_node_value(args, i - 1);
+    switch (token->type) {
+      case T_IDENTIFIER:
+        if (prev->type != T_ASSIGN)  // Assignment target
+          depth++;
+        break;
+      case T_NUMBER:
+        if (prev->type != T_CALL)  // Argument count
+          depth++;
+        break;
+      case T_STRING:
+      case T_NIL:
+        depth++;
+        break;
+      case T_CALL:
+        break;
+      case T_ASSIGN:
+      case T_MINUS:
+      case T_NOT:
+        if (depth < 1)
+          return 0;
+        if (token->type == T_ASSIGN)
+          depth--;
+        break;
+      default:
+        if (token->type > T_UNKNOWN && token->type < T_NOBINOP && depth >= 2) {
+          depth--;
+          break;
+        }
+        return 0;
+    }
+  }
+  return 1;
+}
+
+// Escape analysis for the list declared by 'decl'
+// The list doesn't escape if it's only ever passed as the first argument to one of the
+// list functions below, since none of them keep a reference to the list
+int list_escapes(Ast* ast, const struct Token* decl, int start) {
+  for (int i = start; i < ast_child_count(ast); i++) {
+    const struct Token* token = ast_get_node_value(ast, i);
+    if (!token)
+      continue;
+    switch (token->type) {
+      case T_IDENTIFIER:
+        if (identifier_equal(token, decl))
+          return 1;
+        break;
+
+      case T_DECL: {
+        const struct Token* identifier = ast_get_node_value(ast, ++i);
+        if (identifier != decl && identifier_equal(identifier, decl))
+          return 1;
+        Ast expr = ast_get_node_at(ast, i);
+        if (list_escapes(&expr, decl, 0))
+          return 1;
+        break;
+      }
+
+      case T_CALL: {
+        const struct Token* callee = i > 0 ? ast_get_node_value(ast, i - 1) : NULL;
+        Ast args = ast_get_node_at(ast, i);
+        int skip = 0;
+        if (callee && (identifier_is(callee, "list_index") || identifier_is(callee, "list_length") || identifier_is(callee, "list_free") || identifier_is(callee, "print")))
+          skip = is_whole_first_arg(&args, decl);
+        if (list_escapes(&args, decl, skip))
+          return 1;
+        i++;  // Skip the argument count
+        break;
+      }
+
+      default: {
+        Ast child = ast_get_node_at(ast, i);
+        if (list_escapes(&child, decl, 0))
+          return 1;
+        break;
+      }
+    }
+  }
+  return 0;
+}
+
+// Find the lists in the function body that can be allocated in the frame region instead of on the heap
+// Only lists declared at the top level of the body are considered, a list declared in a loop
+// would take up more of the region on every iteration
+void find_local_lists(struct VM_state* vm, struct Func_state* state, Ast* block) {
+  if (!is_leaf(vm, state, block))
+    return;
+  for (int i = 0; i < ast_child_count(block); i++) {
+    const struct Token* token = ast_get_node_value(block, i);
+    if (!token || token->type != T_DECL)
+      continue;
+    struct Token* identifier = ast_get_node_value(block, ++i);
+    Ast expr = ast_get_node_at(block, i);
+    // let identifier = list(...)
+    if (ast_child_count(&expr) != 3)
+      continue;
+    const struct Token* callee = ast_get_node_value(&expr, 0);
+    const struct Token* call = ast_get_node_value(&expr, 1);
+    if (!identifier_is(callee, "list") || call->type != T_CALL || !is_builtin(vm, state, callee))
+      continue;
+    if (local_lookup(vm, state, identifier->symbol) || list_escapes(block, identifier, 0))
+      continue;
+    list_push(state->local_lists, state->local_list_count, state->local_list_capacity, identifier);
+  }
+}
+
+// Clear the variables that refer to lists in the frame region, since they are released when we return
+int compile_return(struct VM_state* vm, struct Func_state* state, unsigned int* ins_count) {
+  for (unsigned int i = 0; i < state->local_list_slot_count; i++) {
+    compile_pushk(vm, state, (struct Token) { .type = T_NIL }, ins_count);
+    instruction_add_arg(vm, state, I_ASSIGN, state->local_list_slots[i], ins_count);
+  }
+  instruction_add(vm, state, I_RETURN, ins_count);
+  return NO_ERR;
+}
+
 // Generated code:
 // COND ...
 // i_if, jump,
 //   BLOCK ...
 int compile_ifstatement(struct VM_state* vm, Ast* cond, Ast* block, struct Func_state* state, unsigned int* ins_count) {
+  int site = state->job ? -1 : profile_add_site(&vm->profile, BRANCH_IF); // No profile is used when compiling in parallel
   compile(vm, cond, state, ins_count);
-  unsigned int block_size = 0;
-  instruction_add(vm, I_IF, &block_size);
-  instruction_add(vm, UNRESOLVED_JUMP, ins_count);
-  Instruction jump_index = vm->program_size - 1;
-  compile(vm, block, state, &block_size);
-  list_assign(vm->program, vm->program_size, jump_index, block_size);
-  *ins_count += block_size;
+  int jump_index = instruction_add_jump(vm, state, I_IF, ins_count);
+  if (site >= 0)
+    profile_set_site_addr(&vm->profile, site, jump_index, -1);
+  compile(vm, block, state, ins_count);
+  patch_jump(vm, state, jump_index, code_size(vm, state));
   return NO_ERR;
 }
 
@@ -256,22 +547,35 @@ int compile_ifstatement(struct VM_state* vm, Ast* cond, Ast* block, struct Func_
 // i_while, jump,
 //   BLOCK ...
 // jump_back (to COND)
+//
+// Loops that the profile says are hot get rotated, saving a dispatch per iteration:
+// COND ...
+// i_while, jump,
+//   BLOCK ...
+// COND ...
+// i_loop, jump_back (to BLOCK)
 int compile_whileloop(struct VM_state* vm, Ast* cond, Ast* block, struct Func_state* state, unsigned int* ins_count) {
-  unsigned int cond_size = 0;
-  unsigned int block_size = 0;
-  compile(vm, cond, state, &cond_size);
-  instruction_add(vm, I_WHILE, &block_size);
-  instruction_add(vm, UNRESOLVED_JUMP, ins_count);
-  int jump_index = vm->program_size - 1;
-  compile(vm, block, state, &block_size);
-  instruction_add(vm, I_JUMP, &block_size);
-  instruction_add(vm, UNRESOLVED_JUMP, &block_size);
-  int jumpback_index = vm->program_size - 1;
-  list_assign(vm->program, vm->program_size, jump_index, block_size);
-  list_assign(vm->program, vm->program_size, jumpback_index, -(block_size + cond_size));
-  assert(vm->program[jump_index] != 0 && vm->program[jump_index] != 0);
-  *ins_count += block_size + cond_size;
-  patchblock(vm, block_size); // Patch up all unresolved jumps in this block
+  int site = state->job ? -1 : profile_add_site(&vm->profile, BRANCH_WHILE);
+  int loop_begin = code_size(vm, state);
+  compile(vm, cond, state, ins_count);
+  int jump_index = instruction_add_jump(vm, state, I_WHILE, ins_count);
+  int block_begin = code_size(vm, state);
+  compile(vm, block, state, ins_count);
+  if (profile_is_hot_loop(&vm->profile, site)) {
+    compile(vm, cond, state, ins_count);
+    int loop_index = instruction_add_jump(vm, state, I_LOOP, ins_count);
+    patch_jump(vm, state, loop_index, block_begin);
+    if (site >= 0)
+      profile_set_site_addr(&vm->profile, site, jump_index, loop_index);
+  }
+  else {
+    int jumpback_index = instruction_add_jump(vm, state, I_JUMP, ins_count);
+    patch_jump(vm, state, jumpback_index, loop_begin);
+    if (site >= 0)
+      profile_set_site_addr(&vm->profile, site, jump_index, -1);
+  }
+  patch_jump(vm, state, jump_index, code_size(vm, state));
+  patchblock(vm, state, loop_begin); // Patch up all unresolved jumps in this block
   return NO_ERR;
 }
 
@@ -280,43 +584,144 @@ int compile_whileloop(struct VM_state* vm, Ast* cond, Ast* block, struct Func_st
 //  \--> ( parameter list )
 // T_BLOCK
 //  \--> { BLOCK }
+//
+// Functions in the global scope are compiled on their first call (see compile_lazy), unless we
+// compile eagerly or a branch profile is used. Branch sites are numbered in the order they are
+// compiled, which has to be the same from one run to the next. When compiling eagerly without a
+// profile, they are queued to be compiled in parallel once the global code is done (see batch.c).
 int compile_function(struct VM_state* vm, struct Token* identifier, Ast* params, Ast* block, struct Func_state* state, unsigned int* ins_count) {
-  unsigned int block_size = 0;  // The whole function block
-  instruction_add(vm, I_JUMP, &block_size);
-  instruction_add(vm, UNRESOLVED_JUMP, &block_size);
-  Instruction func_addr = vm->program_size;
-  struct Func_state func_state;
-  func_state_init(&func_state, state->global, 0);
-  func_init_with_parent_scope(func_state.func, &state->func->scope);
-  func_state.func->addr = func_addr;
-  Instruction location = -1;
+  int location = -1;
   int status = store_variable(vm, state, *identifier, &location);
   if (status != NO_ERR) {
     compile_error2(identifier, "Identifier '%.*s' has already been declared\n", identifier->length, identifier->string);
-    return vm->status = status;
+    return *state->status = status;
+  }
+  if (state->func == state->global)
+    store_definition(vm, location, identifier, block);
+  int lazy = state->func == state->global && !vm->eager && !vm->profile.recording && vm->profile.input_count == 0;
+  if (lazy) {
+    struct Lazy_function stub = {
+      .params = *params,
+      .block = *block,
+      .location = location,
+      .text = identifier->string,
+    };
+    unsigned int count = vm->lazy_count;
+    list_push(vm->lazy_functions, vm->lazy_count, vm->lazy_capacity, stub);
+    if (vm->lazy_count == count)
+      return *state->status = ALLOC_ERR;
+    struct Object* func = &vm->variables[location];
+    func->type = T_FUNCTION;
+    func_init_with_parent_scope(&func->value.func, &state->func->scope);
+    func->value.func.addr = -1;
+    func->value.func.argc = ast_child_count(params);
+    func->value.func.lazy = count;
+    return NO_ERR;
+  }
+  Ast parsed_block = *block;
+  if (state->batch && state->func == state->global) {
+    const struct Token* body = ast_get_value(block);
+    if (body && body->type == T_DEFERRED && parse_deferred(vm, &parsed_block) != NO_ERR)
+      return *state->status = COMPILE_ERR;
+    block = &parsed_block;
+    int queued = 0;
+    if (batch_add(state->batch, params, block, location, &queued) != NO_ERR)
+      return *state->status = ALLOC_ERR;
+    if (queued)
+      return NO_ERR;
+  }
+  int skip_index = instruction_add_jump(vm, state, I_JUMP, ins_count); // Skip the function block
+  struct Function function;
+  status = compile_function_body(vm, params, block, state, &function, ins_count);
+  patch_jump(vm, state, skip_index, code_size(vm, state));
+  if (status != NO_ERR)
+    return status;
+  struct Object* func = &vm->variables[location];
+  func->type = T_FUNCTION;
+  func->value.func = function; // Apply function compile state to the 'real' function
+  return NO_ERR;
+}
+
+// Remember where the function came from, so that we can tell if it has changed when reloading
+// Only known for bodies that were skipped by the parser, which span the source they came from
+void store_definition(struct VM_state* vm, int location, struct Token* identifier, Ast* block) {
+  const struct Token* body = ast_get_value(block);
+  if (!body || body->type != T_DEFERRED)
+    return;
+  unsigned int length = body->string + body->length - identifier->string;
+  struct Definition definition = {
+    .text = identifier->string,
+    .length = length,
+    .hash = ht_hash(identifier->string, length),
+  };
+  ht_insert(&vm->definitions, SYMBOL_KEY(location), &definition);
+}
+
+// Parse a function body that the parser skipped, 'block' is replaced by the parsed body
+// The tree is kept for as long as the vm lives, the compiled code refers to its tokens
+int parse_deferred(struct VM_state* vm, Ast* block) {
+  const struct Token* body = ast_get_value(block);
+  const struct Source* found = sources_find(&vm->sources, body->string);
+  assert(found != NULL);
+  struct Source source = *found;  // The sources are moved around when the body imports files
+  if (sources_check(&source) != NO_ERR) {
+    compile_error2(body, "'%s' has changed since it was loaded\n", source.name);
+    return COMPILE_ERR;
+  }
+  Ast tree = ast_create();
+  unsigned int tree_count = vm->tree_count;
+  list_push(vm->trees, vm->tree_count, vm->tree_capacity, tree);
+  if (vm->tree_count == tree_count)
+    return ALLOC_ERR;
+  int status = parser_parse_body(&source, &vm->sources, &vm->modules, &vm->symbols, body, vm->strict, &vm->trees[tree_count]);
+  *block = vm->trees[tree_count];
+  return status;
+}
+
+// The source that the text is in, if it's a mapped file that has been written to since it was
+// loaded (see sources_check). Tokens in it can't be read any more.
+const struct Source* changed_source(struct VM_state* vm, const char* text) {
+  const struct Source* source = sources_find(&vm->sources, text);
+  if (source && sources_check(source) != NO_ERR)
+    return source;
+  return NULL;
+}
+
+// Compile the function body at the end of the program
+int compile_function_body(struct VM_state* vm, Ast* params, Ast* block, struct Func_state* state, struct Function* func, unsigned int* ins_count) {
+  const struct Token* body = ast_get_value(block);
+  Ast parsed_block = *block;
+  if (body && body->type == T_DEFERRED) {
+    if (parse_deferred(vm, &parsed_block) != NO_ERR)
+      return *state->status = COMPILE_ERR;
+    block = &parsed_block;
   }
+  int func_addr = code_size(vm, state);
+  struct Func_state func_state;
+  func_state_init(vm, &func_state, state->global, 0);
+  func_state.job = state->job;
+  func_state.status = state->status;
+  func_init_with_parent_scope(func_state.func, &state->func->scope);
+  func_state.func->addr = func_addr;
   int arg_count = ast_child_count(params);
   for (int i = 0; i < arg_count; i++) {
     const struct Token* value = ast_get_node_value(params, i);
     assert(value != NULL);
-    char* arg_key = string_new_copy(value->string, value->length);
-    if (ht_lookup(&func_state.args, arg_key)) {
-      compile_error2(value, "Parameter '%s' has already been identified\n", arg_key);
-      string_free(arg_key);
+    if (ht_lookup(&func_state.args, SYMBOL_KEY(value->symbol))) {
+      compile_error2(value, "Parameter '%.*s' has already been identified\n", value->length, value->string);
+      scope_free(&func_state.func->scope);
       func_state_free(&func_state);
-      return vm->status = COMPILE_ERR;
+      return *state->status = COMPILE_ERR;
     }
-    ht_insert_element(&func_state.args, arg_key, i);
-    string_free(arg_key);
+    ht_insert_element(&func_state.args, SYMBOL_KEY(value->symbol), i);
   }
   func_state.func->argc = arg_count;
-  compile(vm, block, &func_state, &block_size);  // Compile the function body
-  instruction_add(vm, I_RETURN, &block_size);
-  patchblock(vm, block_size); // Fix the unresolved jump (skip the function block)
-  struct Object* func = &vm->variables[location];
-  func->type = T_FUNCTION;
-  func->value.func = *func_state.func; // Apply function compile state to the 'real' function
-  *ins_count += block_size;
+  find_local_lists(vm, &func_state, block);
+  compile(vm, block, &func_state, ins_count);  // Compile the function body
+  compile_return(vm, &func_state, ins_count);
+  struct Scope* scope = &func_state.func->scope;
+  list_shrink_to_fit(scope->constants, scope->constants_count, scope->constants_capacity);  // No more constants are added to the function
+  *func = *func_state.func;
   func_state_free(&func_state);
   return NO_ERR;
 }
@@ -339,7 +744,7 @@ int compile(struct VM_state* vm, Ast* ast, struct Func_state* state, unsigned in
         case T_IDENTIFIER: {
           int status = compile_pushvar(vm, state, *token, ins_count);
           if (status != NO_ERR)
-            return vm->status = status;
+            return *state->status = status;
           break;
         }
 
@@ -351,54 +756,48 @@ int compile(struct VM_state* vm, Ast* ast, struct Func_state* state, unsigned in
           assert(identifier != NULL);
           int status = compile_declvar(vm, state, *identifier);
           if (status != NO_ERR)
-            return vm->status = status;
+            return *state->status = status;
           Ast expr_branch = ast_get_node_at(ast, i);
           assert(ast_child_count(&expr_branch) > 0);
-          compile(vm, &expr_branch, state, ins_count);  // Compile the right-hand side expression
-          Instruction location = -1;
+          int location = -1;
           get_variable_location(vm, state, *identifier, &location);
           assert(location >= 0);
-          instruction_add(vm, I_ASSIGN, ins_count);
-          instruction_add(vm, location, ins_count);
+          int local_list = 0;
+          for (unsigned int j = 0; j < state->local_list_count; j++)
+            local_list |= state->local_lists[j] == identifier;
+          if (local_list) {
+            // let identifier = list(...), where the list doesn't escape the function
+            Ast args_branch = ast_get_node_at(&expr_branch, 1);
+            const struct Token* num_args_token = ast_get_node_value(&expr_branch, 2);
+            compile(vm, &args_branch, state, ins_count);
+            instruction_add_arg(vm, state, I_LOCAL_LIST, (int)num_args_token->value.number, ins_count);
+            list_push(state->local_list_slots, state->local_list_slot_count, state->local_list_slot_capacity, location);
+          }
+          else
+            compile(vm, &expr_branch, state, ins_count);  // Compile the right-hand side expression
+          instruction_add_arg(vm, state, I_ASSIGN, location, ins_count);
           break;
         }
 
         // { assign, identifier }
         case T_ASSIGN: {
-          int assign_instruction = I_ASSIGN;
           struct Token* identifier_token = ast_get_node_value(ast, ++i);
           assert(identifier_token != NULL);
-          char* identifier = string_new_copy(identifier_token->string, identifier_token->length);
-          Instruction location = -1;
-          const int* found = NULL;
-          found = local_lookup(vm, state, identifier);
-          if (found) {
-            assign_instruction = I_LOCAL_ASSIGN;
-          }
-          else {
-            found = variable_lookup(vm, state, identifier);
-          }
-          string_free(identifier);
-          if (!found) {
-            compile_error2(identifier_token, "%s\n", "No such variable");
-            return vm->status = COMPILE_ERR;
-          }
-          location = *found;
-          assert(location >= 0);
-          instruction_add(vm, assign_instruction, ins_count);
-          instruction_add(vm, location, ins_count);
+          int status = compile_assign(vm, state, *identifier_token, ins_count);
+          if (status != NO_ERR)
+            return *state->status = status;
           break;
         }
 
         case T_RETURN:
-          instruction_add(vm, I_RETURN, ins_count);
+          compile_return(vm, state, ins_count);
           break;
 
         case T_IF: {
           Ast cond = ast_get_node_at(ast, i);
           Ast block = ast_get_node_at(ast, ++i);
-          assert(cond != NULL);
-          assert(block != NULL);
+          assert(!ast_is_empty(cond));
+          assert(!ast_is_empty(block));
           compile_ifstatement(vm, &cond, &block, state, ins_count);
           break;
         }
@@ -406,25 +805,24 @@ int compile(struct VM_state* vm, Ast* ast, struct Func_state* state, unsigned in
         case T_WHILE: {
           Ast cond = ast_get_node_at(ast, i);
           Ast block = ast_get_node_at(ast, ++i);
-          assert(cond != NULL);
-          assert(block != NULL);
+          assert(!ast_is_empty(cond));
+          assert(!ast_is_empty(block));
           compile_whileloop(vm, &cond, &block, state, ins_count);
           break;
         }
 
         case T_BREAK:
-          instruction_add(vm, I_JUMP, ins_count);
-          instruction_add(vm, UNRESOLVED_JUMP, ins_count);
+          instruction_add_jump(vm, state, I_JUMP, ins_count);
           break;
 
         case T_FUNC_DEF: {
           struct Token* identifier = ast_get_node_value(ast, ++i);
           Ast params = ast_get_node_at(ast, i);
           Ast block = ast_get_node_at(ast, ++i);
-          assert(block != NULL);
+          assert(!ast_is_empty(block));
           int status = compile_function(vm, identifier, &params, &block, state, ins_count);
           if (status != NO_ERR)
-            return vm->status = status;
+            return *state->status = status;
           break;
         }
 
@@ -433,8 +831,16 @@ int compile(struct VM_state* vm, Ast* ast, struct Func_state* state, unsigned in
           compile(vm, &args_branch, state, ins_count);
           const struct Token* num_args_token = ast_get_node_value(ast, ++i);
           int num_args = (int)num_args_token->value.number;
-          instruction_add(vm, I_CALL, ins_count);
-          instruction_add(vm, num_args, ins_count);
+          instruction_add_arg(vm, state, I_CALL, num_args, ins_count);
+          break;
+        }
+
+        // The tree of the imported file is linked to the import (unless it has already been loaded)
+        case T_IMPORT: {
+          Ast node = ast_get_node_at(ast, i);
+          Ast module = ast_get_link(&node);
+          if (!ast_is_empty(module) && compile(vm, &module, state, ins_count) != NO_ERR)
+            return *state->status;
           break;
         }
 
@@ -442,31 +848,21 @@ int compile(struct VM_state* vm, Ast* ast, struct Func_state* state, unsigned in
           ++i;
           struct Token* path_token = ast_get_node_value(ast, ++i);
           assert(path_token != NULL);
-          char path[PATH_LENGTH_MAX] = {0};
-          snprintf(path, PATH_LENGTH_MAX, "%.*s.so", path_token->length, path_token->string);
-          void* lib_handle = dlopen(path, RTLD_LAZY);
-          if (!lib_handle) {
-            compile_error2(path_token, "Failed to open library '%s'; %s\n", path, dlerror());
-            return vm->status = COMPILE_ERR;
-          }
-          CFunction init = dlsym(lib_handle, "init");
-          if (!init) {
-            compile_error2(path_token, "Failed to find symbol 'init'\n");
-            return vm->status = COMPILE_ERR;
-          }
-          init(vm);
+          int status = compile_load(vm, path_token);
+          if (status != NO_ERR)
+            return *state->status = status;
           break;
         }
 
         default: {
           int op = token_to_op(*token);
           if (op != I_UNKNOWN) {
-            instruction_add(vm, op, ins_count);
+            instruction_add(vm, state, op, ins_count);
             break;
           }
           compile_error2(token, "%s\n", "Invalid instruction");
           assert(0);
-          return vm->status = COMPILE_ERR;
+          return *state->status = COMPILE_ERR;
         }
       }
     }
@@ -480,15 +876,139 @@ int compile_from_tree(struct VM_state* vm, Ast* ast) {
   if (ast_is_empty(*ast))
     return NO_ERR;
   struct Func_state global_state;
-  func_state_init(&global_state, &vm->global, 1);
+  func_state_init(vm, &global_state, &vm->global, 1);
   global_state.global = &vm->global;
+  struct Batch batch;
+  int parallel = vm->eager && !vm->profile.recording && vm->profile.input_count == 0;
+  if (parallel) {
+    batch_init(&batch, vm);
+    global_state.batch = &batch;
+  }
   unsigned int ins_count = 0;
   compile(vm, ast, &global_state, &ins_count);
-  instruction_add(vm, I_RETURN, NULL);
+  if (parallel) {
+    if (vm->status == NO_ERR)
+      batch_compile(&batch, &global_state);
+    batch_free(&batch);
+  }
+  instruction_add(vm, &global_state, I_RETURN, NULL);
   func_state_free(&global_state);
   return vm->status;
 }
 
+int compile_lazy(struct VM_state* vm, struct Function* func) {
+  assert(vm != NULL && func != NULL);
+  assert(func->lazy >= 0 && func->lazy < (int)vm->lazy_count);
+  struct Lazy_function stub = vm->lazy_functions[func->lazy];
+  struct Object* variable = &vm->variables[stub.location];
+  if (variable->value.func.lazy >= 0) { // Not yet compiled through another copy of the function
+    const struct Source* source = changed_source(vm, stub.text);
+    if (source) {
+      compile_error("'%s' has changed since it was loaded\n", source->name);
+      return vm->status = COMPILE_ERR;
+    }
+    struct Func_state global_state;
+    func_state_init(vm, &global_state, &vm->global, 1);
+    struct Function function;
+    unsigned int ins_count = 0;
+    int start = vm->program_size;
+    int status = compile_function_body(vm, &stub.params, &stub.block, &global_state, &function, &ins_count);
+    func_state_free(&global_state);
+    if (status != NO_ERR) {
+      modules_rollback(&vm->modules); // Files imported by the body are loaded again the next time
+      return vm->status = COMPILE_ERR;
+    }
+    if (vm->status == NO_ERR)
+      status = verify_function(vm, start, &function);
+    if (status != NO_ERR || vm->status != NO_ERR) {
+      scope_free(&function.scope);
+      if (vm->program_size > start)
+        list_shrink(vm->program, vm->program_size, vm->program_size - start);
+      modules_rollback(&vm->modules);
+      return vm->status = COMPILE_ERR;
+    }
+    modules_commit(&vm->modules);
+    variable = &vm->variables[stub.location];  // Variables may have been added while compiling
+    scope_free(&variable->value.func.scope);
+    variable->value.func = function;
+  }
+  *func = variable->value.func;
+  return NO_ERR;
+}
+
+// Compile a new version of the function in the variable slot at the end of the program
+// Frames that are running the old version keep using it, so its scope is retired instead of freed
+int redefine(struct VM_state* vm, struct Func_state* state, int location, Ast* params, Ast* block) {
+  struct Function function;
+  unsigned int ins_count = 0;
+  int start = vm->program_size;
+  if (compile_function_body(vm, params, block, state, &function, &ins_count) != NO_ERR)
+    return COMPILE_ERR;
+  if (vm->status != NO_ERR || verify_function(vm, start, &function) != NO_ERR) {
+    scope_free(&function.scope);
+    if (vm->program_size > start)
+      list_shrink(vm->program, vm->program_size, vm->program_size - start);
+    return COMPILE_ERR;
+  }
+  struct Object* variable = &vm->variables[location];
+  if (variable->type == T_FUNCTION)
+    list_push(vm->retired_scopes, vm->retired_count, vm->retired_capacity, variable->value.func.scope);
+  variable->type = T_FUNCTION;
+  variable->value.func = function;
+  return NO_ERR;
+}
+
+int reload(struct VM_state* vm, Ast* ast, struct Func_state* state, int* reloaded) {
+  for (int i = 0; i < ast_child_count(ast); i++) {
+    const struct Token* token = ast_get_node_value(ast, i);
+    if (!token)
+      continue;
+    if (token->type == T_IMPORT) {  // Files that have changed since they were imported
+      Ast node = ast_get_node_at(ast, i);
+      Ast link = ast_get_link(&node);
+      if (reload(vm, &link, state, reloaded) != NO_ERR)
+        return COMPILE_ERR;
+      continue;
+    }
+    if (token->type != T_FUNC_DEF)
+      continue;
+    struct Token* identifier = ast_get_node_value(ast, ++i);
+    Ast params = ast_get_node_at(ast, i);
+    Ast block = ast_get_node_at(ast, ++i);
+    int location = -1;
+    const int* found = ht_lookup(&vm->global.scope.var_locations, SYMBOL_KEY(identifier->symbol));
+    if (found) {
+      location = *found;
+      if (vm->variables[location].type != T_FUNCTION) {
+        compile_error2(identifier, "Identifier '%.*s' has already been declared, and is not a function\n", identifier->length, identifier->string);
+        return COMPILE_ERR;
+      }
+      const struct Definition* definition = ht_lookup(&vm->definitions, SYMBOL_KEY(location));
+      const struct Token* body = ast_get_value(&block);
+      unsigned int length = body->string + body->length - identifier->string;
+      if (definition && body->type == T_DEFERRED && !changed_source(vm, definition->text) && definition->length == length && definition->hash == ht_hash(identifier->string, length) && !memcmp(definition->text, identifier->string, length))
+        continue; // Unchanged
+    }
+    else if (store_variable(vm, state, *identifier, &location) != NO_ERR)
+      return COMPILE_ERR;
+    if (redefine(vm, state, location, &params, &block) != NO_ERR)
+      return COMPILE_ERR;
+    store_definition(vm, location, identifier, &block);
+    (*reloaded)++;
+  }
+  return NO_ERR;
+}
+
+int compile_reload(struct VM_state* vm, Ast* ast, int* reloaded) {
+  assert(vm != NULL && ast != NULL && reloaded != NULL);
+  struct Func_state global_state;
+  func_state_init(vm, &global_state, &vm->global, 1);
+  *reloaded = 0;
+  int status = reload(vm, ast, &global_state, reloaded);
+  func_state_free(&global_state);
+  return status;
+}
+
 unsigned int compile_get_ins_arg_count(Instruction instruction) {
   switch (instruction) {
     case I_ASSIGN:
@@ -497,11 +1017,37 @@ unsigned int compile_get_ins_arg_count(Instruction instruction) {
     case I_PUSH_VAR:
     case I_IF:
     case I_WHILE:
+    case I_LOOP:
     case I_JUMP:
     case I_PUSH_ARG:
     case I_CALL:
+    case I_LOCAL_LIST:
       return 1;
     default:
       return 0;
   }
 }
+
+// Decode the instruction at 'ins' (including the I_WIDE or I_WIDE16 prefix, if there is one)
+// Returns the size of the instruction in bytes
+unsigned int compile_decode_ins(const Instruction* ins, Instruction* op, int* arg) {
+  unsigned int size = 1;
+  int arg_size = ARG_SIZE;
+  if (*ins == I_WIDE || *ins == I_WIDE16) {
+    arg_size = *ins == I_WIDE ? ARG_SIZE_WIDE : ARG_SIZE_16;
+    ins++;
+    size++;
+  }
+  *op = *ins;
+  *arg = 0;
+  if (compile_get_ins_arg_count(*op) > 0) {
+    if (arg_size == ARG_SIZE_WIDE)
+      *arg = ARG_DECODE_WIDE(ins + 1);
+    else if (arg_size == ARG_SIZE_16)
+      *arg = ARG_DECODE_16(ins + 1);
+    else
+      *arg = ARG_DECODE(ins + 1);
+    size += arg_size;
+  }
+  return size;
+}
@@ -0,0 +1,550 @@
+// emit.c
+// Single-pass compiler, source -> instruction sequence
+//
+// Input from the prompt and small scripts are compiled as they are read, without building a tree
+// first. The grammar is the same as in parser.c, and the code is generated with the same functions
+// as compile.c uses, so the program comes out the same. Forward jumps (if, while, break) are patched
+// once the end of their block has been reached.
+//
+// Only the global code is compiled this way. Function bodies are skipped, as the parser does, and
+// compiled from a tree on their first call, where the optimizations that need to see the whole body
+// can be done. Imported files are parsed and compiled from a tree as usual.
+
+#include <assert.h>
+#include <stdio.h>
+#include <limits.h>
+
+#include "error.h"
+#include "config.h"
+#include "list.h"
+#include "token.h"
+#include "lexer.h"
+#include "parser.h"
+#include "compile.h"
+#include "vm.h"
+#include "emit.h"
+
+#define parseerror(fmt, ...) \
+  (error("%s:%i:%i: " COLOR_ERROR "parse-error: " COLOR_NONE fmt, e->lexer->filename, e->lexer->line, e->lexer->count, ##__VA_ARGS__))
+
+#define compile_error2(token, fmt, ...) \
+  error("%i:%i: " COLOR_ERROR "compile-error: " COLOR_NONE fmt, token->line, token->count, ##__VA_ARGS__)
+
+struct Emitter {
+  struct VM_state* vm;
+  struct Lexer* lexer;
+  struct Func_state* state;
+  Ast* functions; // Functions that have been read, they are compiled from here
+  unsigned int ins_count;
+  int status;
+  int loop; // Are we in a loop block?
+};
+
+static int expect(struct Emitter* e, enum Token_types expected_type);
+static int block_end(struct Emitter* e);
+static void emit_op(struct Emitter* e, struct Token token);
+static int declare_variable(struct Emitter* e);
+static int ifstatement(struct Emitter* e);
+static int whileloop(struct Emitter* e);
+static int returnstat(struct Emitter* e);
+static int import_file(struct Emitter* e, const char* path);
+static int importstat(struct Emitter* e);
+static int loadstat(struct Emitter* e);
+static int params(struct Emitter* e, Ast* identifier);
+static int arglist(struct Emitter* e, int* num_args);
+static int funcstat(struct Emitter* e);
+static int block(struct Emitter* e);
+static int breakstat(struct Emitter* e);
+static int statement(struct Emitter* e);
+static int statements(struct Emitter* e);
+static int postfix_expr(struct Emitter* e);
+static int simple_expr(struct Emitter* e);
+static int expr(struct Emitter* e, int priority);
+
+int expect(struct Emitter* e, enum Token_types expected_type) {
+  struct Token token = get_token(e->lexer);
+  return token.type == expected_type;
+}
+
+int block_end(struct Emitter* e) {
+  struct Token token = get_token(e->lexer);
+  return token.type == T_EOF || token.type == T_BLOCKEND;
+}
+
+void emit_op(struct Emitter* e, struct Token token) {
+  if (e->status != NO_ERR)
+    return;
+  int op = token_to_op(token);
+  if (op == I_UNKNOWN) {
+    compile_error2((&token), "%s\n", "Invalid instruction");
+    e->status = COMPILE_ERR;
+    return;
+  }
+  instruction_add(e->vm, e->state, op, &e->ins_count);
+}
+
+// let a = <value> ;
+// Generated code:
+// (expr)
+// i_assign, location
+int declare_variable(struct Emitter* e) {
+  next_token(e->lexer); // Skip 'let'
+  struct Token identifier = get_token(e->lexer);
+  if (identifier.type != T_IDENTIFIER) {
+    parseerror("Expected identifier\n");
+    return e->status = PARSE_ERR;
+  }
+  next_token(e->lexer); // Skip 'identifier'
+  if (!expect(e, T_ASSIGN)) {
+    parseerror("Expected '='\n");
+    return e->status = PARSE_ERR;
+  }
+  next_token(e->lexer); // Skip '='
+  if ((e->status = compile_declvar(e->vm, e->state, identifier)) != NO_ERR)
+    return e->status;
+  expr(e, 0);
+  if (e->status != NO_ERR)
+    return e->status;
+  int location = -1;
+  get_variable_location(e->vm, e->state, identifier, &location);
+  assert(location >= 0);
+  instruction_add_arg(e->vm, e->state, I_ASSIGN, location, &e->ins_count);
+  return NO_ERR;
+}
+
+// if COND {}
+// Generated code:
+// COND ...
+// i_if, jump,
+//   BLOCK ...
+int ifstatement(struct Emitter* e) {
+  struct VM_state* vm = e->vm;
+  next_token(e->lexer); // Skip 'if'
+  int site = profile_add_site(&vm->profile, BRANCH_IF);
+  expr(e, 0); // Read condition
+  if (e->status != NO_ERR)
+    return e->status;
+  if (!expect(e, T_BLOCKBEGIN)) {
+    parseerror("Expected '{' block begin after condition\n");
+    return e->status = PARSE_ERR;
+  }
+  next_token(e->lexer); // Skip '{'
+  int jump_index = instruction_add_jump(vm, e->state, I_IF, &e->ins_count);
+  profile_set_site_addr(&vm->profile, site, jump_index, -1);
+  if (block(e) != NO_ERR)
+    return e->status;
+  patch_jump(vm, e->state, jump_index, code_size(vm, e->state));
+  return NO_ERR;
+}
+
+// Generated code:
+// COND ...
+// i_while, jump,
+//   BLOCK ...
+// jump_back (to COND)
+int whileloop(struct Emitter* e) {
+  struct VM_state* vm = e->vm;
+  e->loop++;  // We are now in a while loop block (increment for nested loops)
+  next_token(e->lexer); // Skip 'while'
+  int site = profile_add_site(&vm->profile, BRANCH_WHILE);
+  int loop_begin = code_size(vm, e->state);
+  expr(e, 0); // Read condition
+  if (e->status != NO_ERR)
+    return e->status;
+  if (!expect(e, T_BLOCKBEGIN)) {
+    parseerror("Expected '{' block begin\n");
+    return e->status = PARSE_ERR;
+  }
+  next_token(e->lexer); // Skip '{'
+  int jump_index = instruction_add_jump(vm, e->state, I_WHILE, &e->ins_count);
+  if (block(e) != NO_ERR)
+    return e->status;
+  int jumpback_index = instruction_add_jump(vm, e->state, I_JUMP, &e->ins_count);
+  patch_jump(vm, e->state, jumpback_index, loop_begin);
+  profile_set_site_addr(&vm->profile, site, jump_index, -1);
+  patch_jump(vm, e->state, jump_index, code_size(vm, e->state));
+  patchblock(vm, e->state, loop_begin); // Patch up all unresolved jumps in this block
+  e->loop--;  // Exit this loop block
+  return NO_ERR;
+}
+
+// return ;
+// return (expr) ;
+int returnstat(struct Emitter* e) {
+  next_token(e->lexer); // Skip 'return'
+  expr(e, 0);
+  if (e->status != NO_ERR)
+    return e->status;
+  compile_return(e->vm, e->state, &e->ins_count);
+  return NO_ERR;
+}
+
+// The imported file is compiled in place, from a tree like any other file
+int import_file(struct Emitter* e, const char* path) {
+  struct VM_state* vm = e->vm;
+  char canonical[PATH_MAX] = {0};
+  int loaded = 0;
+  struct Source source;
+  if (modules_resolve(path, canonical) != NO_ERR || modules_register(&vm->modules, canonical, &loaded) != NO_ERR) {
+    parseerror("'%s': No such file\n", path);
+    return e->status = PARSE_ERR;
+  }
+  if (loaded)
+    return NO_ERR;
+  if (sources_add_file(&vm->sources, path, &source) != NO_ERR) {
+    parseerror("'%s': No such file\n", path);
+    return e->status = PARSE_ERR;
+  }
+  Ast ast = ast_create();
+  unsigned int lazy_count = vm->lazy_count;
+  e->status = parser_parse(&source, &vm->sources, &vm->modules, &vm->symbols, path, vm->strict, &ast);
+  if (e->status == NO_ERR) {
+    compile(vm, &ast, e->state, &e->ins_count);
+    e->status = vm->status;
+  }
+  if (vm->lazy_count != lazy_count) { // Keep the tree around for the functions that haven't been compiled yet
+    unsigned int tree_count = vm->tree_count;
+    list_push(vm->trees, vm->tree_count, vm->tree_capacity, ast);
+    if (vm->tree_count != tree_count)
+      return e->status;
+  }
+  ast_free(&ast);
+  return e->status;
+}
+
+// import filename
+int importstat(struct Emitter* e) {
+  struct Token token = next_token(e->lexer);
+  next_token(e->lexer);
+  if (token.type != T_STRING) {
+    parseerror("Expected string\n");
+    return e->status = PARSE_ERR;
+  }
+  char path[PATH_LENGTH_MAX] = {0};
+  snprintf(path, PATH_LENGTH_MAX, "%.*s", token.length, token.string);
+  return import_file(e, path);
+}
+
+// load filename
+int loadstat(struct Emitter* e) {
+  struct Token path_token = next_token(e->lexer);
+  if (path_token.type != T_STRING) {
+    parseerror("Expected string\n");
+    return e->status = PARSE_ERR;
+  }
+  next_token(e->lexer);
+  return e->status = compile_load(e->vm, &path_token);
+}
+
+int params(struct Emitter* e, Ast* identifier) {
+  if (expect(e, T_CLOSEDPAREN)) // In case the function has no parameters
+    return NO_ERR;
+  for (;;) {
+    struct Token token = get_token(e->lexer);
+    if (token.type != T_IDENTIFIER) {
+      parseerror("Invalid token in paramlist\n");
+      return e->status = PARSE_ERR;
+    }
+    next_token(e->lexer);
+    if (ast_add_node(identifier, token) != NO_ERR)
+      return e->status = ALLOC_ERR;
+    if (expect(e, T_CLOSEDPAREN))
+      return NO_ERR;
+    else if (expect(e, T_COMMA))
+      next_token(e->lexer);
+  }
+  return NO_ERR;
+}
+
+int arglist(struct Emitter* e, int* num_args) {
+  if (expect(e, T_CLOSEDPAREN))
+    return NO_ERR;
+  for (;;) {
+    (*num_args)++;
+    expr(e, 0);
+    if (e->status != NO_ERR)
+      return e->status;
+    if (expect(e, T_COMMA)) {
+      next_token(e->lexer);
+      continue;
+    }
+    return NO_ERR;
+  }
+  return NO_ERR;
+}
+
+// fn identifier ( parameter list ) { BLOCK }
+// The body is skipped, the function is added to the tree of functions the way the parser adds it:
+// identifier
+//  \--> ( parameter list )
+// T_DEFERRED
+// and is compiled on its first call (see compile_function)
+int funcstat(struct Emitter* e) {
+  next_token(e->lexer); // Skip 'fn'
+  if (!expect(e, T_IDENTIFIER)) {
+    parseerror("Expected identifier\n");
+    return e->status = PARSE_ERR;
+  }
+  if (ast_add_node(e->functions, get_token(e->lexer)) != NO_ERR)
+    return e->status = ALLOC_ERR;
+  Ast identifier = ast_get_last(e->functions);
+  next_token(e->lexer); // Skip 'identifier'
+  if (expect(e, T_OPENPAREN)) {
+    next_token(e->lexer); // Skip '('
+    if (params(e, &identifier) != NO_ERR)
+      return e->status;
+    if (!expect(e, T_CLOSEDPAREN)) {
+      parseerror("Expected ')'\n");
+      return e->status = PARSE_ERR;
+    }
+    next_token(e->lexer); // Skip ')'
+  }
+  if (!expect(e, T_BLOCKBEGIN)) {
+    parseerror("Expected '{'\n");
+    return e->status = PARSE_ERR;
+  }
+  struct Token body = get_token(e->lexer);
+  if (skip_block(e->lexer) != NO_ERR) {
+    parseerror("Expected '}' block end\n");
+    return e->status = PARSE_ERR;
+  }
+  body.type = T_DEFERRED;
+  body.length = e->lexer->index - body.string;
+  if (ast_add_node(e->functions, body) != NO_ERR)
+    return e->status = ALLOC_ERR;
+  Ast block = ast_get_last(e->functions);
+  next_token(e->lexer); // Skip '}'
+  return e->status = compile_function(e->vm, ast_get_value(&identifier), &identifier, &block, e->state, &e->ins_count);
+}
+
+int block(struct Emitter* e) {
+  if (statements(e) != NO_ERR)
+    return e->status;
+  if (!expect(e, T_BLOCKEND)) {
+    parseerror("Expected '}' block end\n");
+    return e->status = PARSE_ERR;
+  }
+  next_token(e->lexer); // Skip '}'
+  return NO_ERR;
+}
+
+int breakstat(struct Emitter* e) {
+  next_token(e->lexer);
+  if (!e->loop) {
+    parseerror("No loop to break\n");
+    return e->status = PARSE_ERR;
+  }
+  instruction_add_jump(e->vm, e->state, I_JUMP, &e->ins_count);
+  return NO_ERR;
+}
+
+int statement(struct Emitter* e) {
+  struct Token token = get_token(e->lexer);
+
+  switch (token.type) {
+    case T_EOF:
+      return NO_ERR;
+
+    case T_SEMICOLON:
+      next_token(e->lexer);
+      break;
+
+    case T_DECL:
+      declare_variable(e);
+      break;
+
+    case T_FUNC_DEF:
+      funcstat(e);
+      break;
+
+    case T_WHILE:
+      whileloop(e);
+      break;
+
+    case T_BREAK:
+      breakstat(e);
+      break;
+
+    case T_IF:
+      ifstatement(e);
+      break;
+
+    case T_RETURN:
+      returnstat(e);
+      break;
+
+    case T_IMPORT:
+      importstat(e);
+      break;
+
+    case T_LOAD:
+      loadstat(e);
+      break;
+
+    default:
+      expr(e, 0);
+      break;
+  }
+  if (e->status != NO_ERR)
+    return e->status;
+
+  if (expect(e, T_SEMICOLON))
+    next_token(e->lexer);
+  return e->status;
+}
+
+// Unlike the parser, we stop at the first error, the code for what follows it would be of no use
+int statements(struct Emitter* e) {
+  while (!block_end(e) && e->status == NO_ERR)
+    statement(e);
+  return e->status;
+}
+
+// identifier
+// identifier = (expr)
+// (expr)
+// followed by any number of calls: '(' args ')'
+int postfix_expr(struct Emitter* e) {
+  struct VM_state* vm = e->vm;
+  struct Token token = get_token(e->lexer);
+  switch (token.type) {
+    case T_IDENTIFIER:
+      next_token(e->lexer);
+      if (expect(e, T_ASSIGN)) {  // Variable assignment?
+        next_token(e->lexer); // Skip '='
+        expr(e, 0); // Parse the right hand side expression
+        if (e->status == NO_ERR)
+          e->status = compile_assign(vm, e->state, token, &e->ins_count);
+      }
+      else
+        e->status = compile_pushvar(vm, e->state, token, &e->ins_count);
+      if (e->status != NO_ERR)
+        return e->status;
+      break;
+
+    case T_OPENPAREN: {
+      next_token(e->lexer); // Skip '('
+      expr(e, 0);
+      if (e->status != NO_ERR)
+        return e->status;
+      if (!expect(e, T_CLOSEDPAREN)) {
+        parseerror("Missing ')' closing parenthesis in expression\n");
+        return e->status = PARSE_ERR;
+      }
+      next_token(e->lexer); // Skip ')'
+      break;
+    }
+
+    case T_EOF:
+      return NO_ERR;
+
+    default: {
+      parseerror("Unexpected symbol\n");
+      next_token(e->lexer);
+      return e->status = PARSE_ERR;
+    }
+  }
+  if (expect(e, T_COLON))
+    next_token(e->lexer);
+
+  while (expect(e, T_OPENPAREN)) {
+    next_token(e->lexer);
+    int num_args = 0;
+    if (arglist(e, &num_args) != NO_ERR)
+      return e->status;
+    if (!expect(e, T_CLOSEDPAREN)) {
+      parseerror("Missing ')' closing parenthesis in expression\n");
+      return e->status = PARSE_ERR;
+    }
+    next_token(e->lexer);
+    instruction_add_arg(vm, e->state, I_CALL, num_args, &e->ins_count);
+  }
+  return NO_ERR;
+}
+
+int simple_expr(struct Emitter* e) {
+  struct Token token = get_token(e->lexer);
+  switch (token.type) {
+    case T_SEMICOLON:
+    case T_COLON:
+      next_token(e->lexer);
+      break;
+
+    case T_NUMBER:
+    case T_STRING:
+    case T_NIL:
+      next_token(e->lexer);
+      compile_pushk(e->vm, e->state, token, &e->ins_count);
+      break;
+
+    default:
+      return postfix_expr(e);
+  }
+  return e->status;
+}
+
+// Arithmetic operation on expressions
+// expr op expr
+// Returns the operator that ended the expression, as in parser.c
+int expr(struct Emitter* e, int priority) {
+  struct Token uop_token = get_token(e->lexer);
+  int uop = get_uop(uop_token);
+  if (uop != T_NOUNOP) {
+    uop_token.type = uop;
+    next_token(e->lexer); // Skip operator token
+    expr(e, UNARY_PRIORITY);
+    emit_op(e, uop_token);
+  }
+  else
+    simple_expr(e);
+
+  struct Token token = get_token(e->lexer);
+  int op = get_binop(token);
+  while (e->status == NO_ERR && op != T_NOBINOP && op_priority[op].left > priority) {
+    int next_op;
+    token = get_token(e->lexer);
+    next_token(e->lexer);
+    next_op = expr(e, op_priority[op].right);
+    emit_op(e, token);
+    op = next_op;
+  }
+  return op;
+}
+
+int emit_source(struct VM_state* vm, const char* filename, const struct Source* source, Ast* functions) {
+  assert(vm != NULL && source != NULL && functions != NULL);
+  struct Lexer lexer = {
+    .index = source->data,
+    .end = source->data + source->size,
+    .line = 1,
+    .count = 0,
+    .token = (struct Token) {0},
+    .filename = filename,
+    .symbols = &vm->symbols,
+  };
+  struct Func_state global_state;
+  func_state_init(vm, &global_state, &vm->global, 1);
+  struct Emitter emitter = {
+    .vm = vm,
+    .lexer = &lexer,
+    .state = &global_state,
+    .functions = functions,
+    .ins_count = 0,
+    .status = NO_ERR,
+    .loop = 0,
+  };
+  struct Emitter* e = &emitter;
+  next_token(e->lexer);
+  statements(e);
+  if (e->status == NO_ERR && !expect(e, T_EOF)) {
+    parseerror("Unexpected symbol\n");
+    e->status = PARSE_ERR;
+  }
+  instruction_add(vm, &global_state, I_RETURN, NULL);
+  func_state_free(&global_state);
+  if (e->status == PARSE_ERR)
+    return PARSE_ERR;
+  if (e->status != NO_ERR && vm->status == NO_ERR)
+    vm->status = e->status;
+  return NO_ERR;
+}
@@ -6,23 +6,19 @@
 
 #include "error.h"
 
-struct Error_state {
-	enum Error_codes status;
-	int show_warnings;
-};
-
-static struct Error_state err_state = {
-	.status = NO_ERR,
-	.show_warnings = 1,
-};
-
-void error_init(int show_warnings) {
-	err_state.status = NO_ERR;
-	err_state.show_warnings = show_warnings;
+// Files may be parsed on several threads at once, so every thread has an error status of its own.
+// The warning setting is only written by error_init(), before any other thread is started.
+static _Thread_local enum Error_codes err_status = NO_ERR;
+
+static int show_warnings = 1;
+
+void error_init(int show) {
+	err_status = NO_ERR;
+	show_warnings = show;
 }
 
 int is_error() {
-	return err_state.status != NO_ERR;
+	return err_status != NO_ERR;
 }
 
 void error(const char* format, ...) {
@@ -32,11 +28,11 @@ void error(const char* format, ...) {
 	vprintf(format, args);
 	va_end(args);
 
-	err_state.status = ERR;
+	err_status = ERR;
 }
 
 void warn(const char* format, ...) {
-	if (!err_state.show_warnings)
+	if (!show_warnings)
 		return;
 	va_list args;
 	va_start(args, format);
@@ -45,5 +41,5 @@ void warn(const char* format, ...) {
 }
 
 int get_error() {
-	return err_state.status;
+	return err_status;
 }
\ No newline at end of file
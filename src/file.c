@@ -1,37 +1,196 @@
 // file.c
+//
+// Files are read into a buffer of their own, unless they are large: those are mapped, so that they
+// are neither copied nor kept on the heap. The mapping is private, but writes to the file in place
+// still show through it, and truncating the file makes the pages past its new end fault. The
+// descriptor is kept open to tell if that has happened (see sources_check). A file that has been
+// replaced instead, as editors and most tools do, is a new file, the mapping keeps the old one.
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "error.h"
+#include "config.h"
 #include "mem.h"
+#include "list.h"
 #include "file.h"
 
-char* read_file(const char* path) {
-	long buffer_size, read_size;
-	FILE* file = fopen(path, "rb");
+static char* copy_name(const char* name);
+static int read_file(int fd, unsigned long size, char** data);
+static void release_source(struct Source* source);
+static unsigned int find_index(const struct Source_arr* arr, const char* string);
 
-	if (file == NULL)
-		return NULL;
+char* copy_name(const char* name) {
+	unsigned long length = strlen(name);
+	char* copy = mmalloc(length + 1);
+	if (copy)
+		memcpy(copy, name, length + 1);
+	return copy;
+}
 
-	fseek(file, 0, SEEK_END);
+void sources_init(struct Source_arr* arr) {
+	arr->sources = NULL;
+	arr->count = 0;
+	arr->capacity = 0;
+	arr->added = 0;
+}
 
-	buffer_size = ftell(file);
+// The buffer is a byte larger than the text, so that an empty source has an address of its own too
+int read_file(int fd, unsigned long size, char** data) {
+	*data = mmalloc(size + 1);
+	if (!*data)
+		return ALLOC_ERR;
+	unsigned long length = 0;
+	while (length < size) {
+		ssize_t count = read(fd, *data + length, size - length);
+		if (count <= 0)  // Failed, or the file has been truncated since fstat
+			break;
+		length += count;
+	}
+	if (length != size) {
+		mfree(*data, size + 1);
+		return ERR;
+	}
+	return NO_ERR;
+}
 
-	rewind(file);
+// Index of the first source that starts after 'string'
+unsigned int find_index(const struct Source_arr* arr, const char* string) {
+	unsigned int low = 0;
+	unsigned int high = arr->count;
+	while (low < high) {
+		unsigned int middle = low + (high - low) / 2;
+		if (arr->sources[middle].data <= string)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
 
-	char* buffer = (char*)malloc(sizeof(char) * (buffer_size + 1));
+// The text is released if the source can't be added
+int sources_add(struct Source_arr* arr, const char* name, struct Source* source) {
+	source->name = copy_name(name);
+	source->serial = arr->added;
+	if (arr->count >= arr->capacity)
+		list_reserve(arr->sources, arr->count, arr->capacity, list_grow_capacity(arr->capacity));
+	if (!source->name || arr->count >= arr->capacity) {
+		release_source(source);
+		return ALLOC_ERR;
+	}
+	unsigned int index = find_index(arr, source->data);
+	memmove(&arr->sources[index + 1], &arr->sources[index], (arr->count - index) * sizeof(*arr->sources));
+	arr->sources[index] = *source;
+	arr->count++;
+	arr->added++;
+	return NO_ERR;
+}
 
-	read_size = fread(buffer, sizeof(char), buffer_size, file);
-	buffer[read_size] = '\0';
+void release_source(struct Source* source) {
+	if (source->fd >= 0) {
+		munmap(source->data, source->size);
+		close(source->fd);
+	}
+	else
+		mfree(source->data, source->size + 1);
+	if (source->name)
+		mfree(source->name, strlen(source->name) + 1);
+}
 
-	if (buffer_size != read_size) {
-		free(buffer);
-		buffer = NULL;
-		fclose(file);
+// The size is taken from fstat, and the file is read straight into the buffer that is kept
+int source_load_file(const char* path, struct Source* source) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return ERR;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return ERR;
+	}
+	*source = (struct Source) {
+		.size = st.st_size,
+		.fd = -1,
+		.modified = st.st_mtim,
+	};
+	if (source->size >= SOURCE_MAP_MIN) {
+		void* data = mmap(NULL, source->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+			return ERR;
+		}
+		source->data = data;
+		source->fd = fd;
+	}
+	else {
+		int status = read_file(fd, source->size, &source->data);
+		close(fd);
+		if (status != NO_ERR)
+			return status;
+	}
+	return NO_ERR;
+}
+
+int sources_add_file(struct Source_arr* arr, const char* path, struct Source* source) {
+	int status = source_load_file(path, source);
+	if (status != NO_ERR)
+		return status;
+	return sources_add(arr, path, source);
+}
+
+int sources_add_string(struct Source_arr* arr, const char* name, const char* string, unsigned long size, struct Source* source) {
+	*source = (struct Source) {
+		.data = mmalloc(size + 1),
+		.size = size,
+		.fd = -1,
+	};
+	if (!source->data)
+		return ALLOC_ERR;
+	memcpy(source->data, string, size);
+	return sources_add(arr, name, source);
+}
+
+const struct Source* sources_find(const struct Source_arr* arr, const char* string) {
+	unsigned int index = find_index(arr, string);
+	if (index == 0)
 		return NULL;
+	const struct Source* source = &arr->sources[index - 1];
+	if (string <= source->data + source->size)
+		return source;
+	return NULL;
+}
+
+// The file may be written to right after it has been looked at, this only catches the changes that
+// were made before. A file that is written to while it is being parsed can still fault.
+int sources_check(const struct Source* source) {
+	if (source->fd < 0)
+		return NO_ERR;
+	struct stat st;
+	if (fstat(source->fd, &st) != 0)
+		return ERR;
+	if ((unsigned long)st.st_size != source->size || st.st_mtim.tv_sec != source->modified.tv_sec || st.st_mtim.tv_nsec != source->modified.tv_nsec)
+		return ERR;
+	return NO_ERR;
+}
+
+void sources_release(struct Source_arr* arr, unsigned int mark) {
+	unsigned int count = 0;
+	for (unsigned int i = 0; i < arr->count; i++) {
+		struct Source* source = &arr->sources[i];
+		if (source->serial >= mark)
+			release_source(source);
+		else
+			arr->sources[count++] = *source;
 	}
-	fclose(file);
-	return buffer;
-}
\ No newline at end of file
+	arr->count = count;
+}
+
+void sources_free(struct Source_arr* arr) {
+	for (unsigned int i = 0; i < arr->count; i++)
+		release_source(&arr->sources[i]);
+	list_free(arr->sources, arr->count, arr->capacity);
+}
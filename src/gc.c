@@ -0,0 +1,378 @@
+// gc.c
+// Incremental mark and sweep garbage collector
+//
+// Lists and maps are kept in a list of all objects, strings in the intern table of the vm. Objects
+// are white (not reached), gray (reached, but not looked into) or black (reached and looked into).
+// Instead of clearing the marks after every collection, a collection starts by incrementing the
+// epoch: anything that isn't marked with the current epoch is white, marked objects are gray while
+// they are in the gray list and black after that.
+//
+// A collection is done in small steps, interleaved with the program, each step handling about as many
+// objects as the budget allows:
+//  - Marking: the stack and the constants start out gray, the variables are marked a few at a time,
+//    and the gray objects are looked into until there are none left.
+//    The program keeps running in between, so values that are stored in an object that is black
+//    have to be marked (gc_barrier), as do values that are assigned to a variable
+//    (gc_barrier_variable). The stack is changed all the time without a barrier, so once there is
+//    nothing gray left it's marked once more, and whatever that turns gray is looked into within
+//    the budget as well. We only sweep after a step in which the stack turned nothing gray.
+//    The longest step is then bounded by the budget, the stack (STACK_SIZE values) and the
+//    largest list or map, since a single object is always looked into at once.
+//  - Sweeping: objects and strings that are white are released.
+// Objects and strings that are created while a collection is under way are marked, so they are kept
+// until the next collection. Strings that are looked up in the intern table are marked as well, since
+// the compiler may hand them out to constants at any time.
+//
+// Steps are only taken at the points where every object that is in use can be reached from the
+// stack or from the variables: after a C function has returned (see gc_check).
+
+#include <assert.h>
+#include <stdio.h>
+#include <limits.h>
+#include <time.h>
+
+#include "error.h"
+#include "mem.h"
+#include "list.h"
+#include "token.h"
+#include "map.h"
+#include "vm.h"
+#include "gc.h"
+
+static unsigned int list_size(const struct List* list);
+static void add_object(struct VM_state* vm, struct Gc_object* object, int type, unsigned int size);
+static void shade_object(struct VM_state* vm, struct Gc_object* object);
+static int shade(struct VM_state* vm, const struct Object* value);
+static int shade_scope(struct VM_state* vm, const struct Scope* scope);
+static int shade_stack(struct VM_state* vm);
+static int traverse(struct VM_state* vm, struct Gc_object* object);
+static void free_object(struct VM_state* vm, struct Gc_object* object);
+static void start(struct VM_state* vm);
+static int finish_marking(struct VM_state* vm);
+static int mark(struct VM_state* vm, int budget);
+static int sweep(struct VM_state* vm, int budget);
+static void record_pause(struct Gc_stats* stats, double seconds);
+
+// Upper bounds of the pause buckets, in seconds (the last bucket has none)
+static const double pause_limits[GC_PAUSE_BUCKETS - 1] = { 10e-6, 50e-6, 100e-6, 500e-6, 1e-3 };
+static const char* pause_names[GC_PAUSE_BUCKETS] = { "<10us", "<50us", "<100us", "<500us", "<1ms", ">=1ms" };
+
+unsigned int list_size(const struct List* list) {
+  return sizeof(struct List) + list->capacity * sizeof(struct Object);
+}
+
+void add_object(struct VM_state* vm, struct Gc_object* object, int type, unsigned int size) {
+  struct Gc* gc = &vm->gc;
+  object->next = gc->objects;
+  object->mark = gc->epoch;
+  object->size = size;
+  object->type = type;
+  gc->objects = object;
+  gc->bytes += size;
+  gc->object_count++;
+}
+
+void shade_object(struct VM_state* vm, struct Gc_object* object) {
+  struct Gc* gc = &vm->gc;
+  if (object->mark == gc->epoch)
+    return;
+  object->mark = gc->epoch;
+  unsigned int count = gc->gray_count;
+  list_push(gc->gray, gc->gray_count, gc->gray_capacity, object);
+  if (gc->gray_count == count)  // Out of memory, look into it right away instead
+    traverse(vm, object);
+}
+
+// Returns the work done
+int shade(struct VM_state* vm, const struct Object* value) {
+  switch (value->type) {
+    case T_STRING:
+      intern_header(value->value.str.data)->mark = vm->gc.epoch;
+      break;
+    case T_LIST:
+      shade_object(vm, &value->value.list->gc);
+      break;
+    case T_MAP:
+      shade_object(vm, &value->value.map->gc);
+      break;
+    case T_FUNCTION:
+      return 1 + shade_scope(vm, &value->value.func.scope);
+    default:
+      break;
+  }
+  return 1;
+}
+
+int shade_scope(struct VM_state* vm, const struct Scope* scope) {
+  int work = 0;
+  for (unsigned int i = 0; i < scope->constants_count; i++)
+    work += shade(vm, &scope->constants[i]);
+  return work;
+}
+
+int shade_stack(struct VM_state* vm) {
+  int work = 0;
+  for (int i = 0; i < vm->stack_top; i++)
+    work += shade(vm, &vm->stack[i]);
+  return work;
+}
+
+int traverse(struct VM_state* vm, struct Gc_object* object) {
+  int work = 1;
+  switch (object->type) {
+    case T_LIST: {
+      const struct List* list = (const struct List*)object;
+      for (int i = 0; i < list->length; i++)
+        work += shade(vm, &list->data[i]);
+      break;
+    }
+    case T_MAP: {
+      unsigned int iter = 0;
+      const struct Map_entry* entry = NULL;
+      while ((entry = map_next((const struct Map*)object, &iter))) {
+        work += shade(vm, &entry->key);
+        work += shade(vm, &entry->value);
+      }
+      break;
+    }
+    default:
+      assert(0);
+      break;
+  }
+  return work;
+}
+
+void free_object(struct VM_state* vm, struct Gc_object* object) {
+  struct Gc* gc = &vm->gc;
+  gc->bytes -= object->size;
+  gc->object_count--;
+  switch (object->type) {
+    case T_LIST: {
+      struct List* list = (struct List*)object;
+      assert(!list->region);
+      list_free(list->data, list->length, list->capacity);
+      mfree(list, sizeof(struct List));
+      break;
+    }
+    case T_MAP:
+      map_free((struct Map*)object);
+      break;
+    default:
+      assert(0);
+      break;
+  }
+}
+
+void start(struct VM_state* vm) {
+  struct Gc* gc = &vm->gc;
+  gc->epoch++;
+  vm->strings.mark = gc->epoch;
+  gc->phase = GC_MARK;
+  gc->root = 0;
+  shade_stack(vm);
+  shade_scope(vm, &vm->global.scope);
+  for (unsigned int i = 0; i < vm->retired_count; i++)  // Their code may still be running
+    shade_scope(vm, &vm->retired_scopes[i]);
+}
+
+// The stack may have changed since it was marked, the variables have a barrier
+// Starts sweeping if nothing on the stack was still white, returns the work done
+int finish_marking(struct VM_state* vm) {
+  struct Gc* gc = &vm->gc;
+  int work = shade_stack(vm);
+  if (gc->gray_count == 0) {
+    gc->phase = GC_SWEEP;
+    gc->sweep = &gc->objects;
+    gc->string_sweep = 0;
+  }
+  return work;
+}
+
+// Returns what is left of the budget
+int mark(struct VM_state* vm, int budget) {
+  struct Gc* gc = &vm->gc;
+  while (budget > 0) {
+    if (gc->gray_count > 0)
+      budget -= traverse(vm, gc->gray[--gc->gray_count]);
+    else if (gc->root < vm->variable_count)
+      budget -= shade(vm, &vm->variables[gc->root++]);
+    else {
+      budget -= finish_marking(vm);
+      if (gc->phase != GC_MARK)
+        break;
+    }
+  }
+  return budget;
+}
+
+int sweep(struct VM_state* vm, int budget) {
+  struct Gc* gc = &vm->gc;
+  while (budget > 0 && *gc->sweep) {
+    struct Gc_object* object = *gc->sweep;
+    if (object->mark != gc->epoch) {
+      *gc->sweep = object->next;
+      free_object(vm, object);
+      gc->stats.freed++;
+    }
+    else
+      gc->sweep = &object->next;
+    budget--;
+  }
+  struct Intern_table* strings = &vm->strings;
+  while (budget > 0 && gc->string_sweep < strings->count) {
+    int index = gc->string_sweep++;
+    const char* data = strings->strings[index].data;
+    if (data && intern_header(data)->mark != gc->epoch) {
+      intern_remove(strings, index);
+      gc->stats.freed++;
+    }
+    budget--;
+  }
+  if (*gc->sweep == NULL && gc->string_sweep >= strings->count) {
+    gc->phase = GC_IDLE;
+    gc->stats.collections++;
+  }
+  return budget;
+}
+
+void record_pause(struct Gc_stats* stats, double seconds) {
+  int bucket = 0;
+  while (bucket < GC_PAUSE_BUCKETS - 1 && seconds >= pause_limits[bucket])
+    bucket++;
+  stats->pauses[bucket]++;
+  if (seconds > stats->max_pause)
+    stats->max_pause = seconds;
+}
+
+void gc_init(struct Gc* gc) {
+  assert(gc != NULL);
+  gc->objects = NULL;
+  gc->sweep = NULL;
+  gc->string_sweep = 0;
+  gc->gray = NULL;
+  gc->gray_count = 0;
+  gc->gray_capacity = 0;
+  gc->root = 0;
+  gc->epoch = 0;
+  gc->phase = GC_IDLE;
+  gc->bytes = 0;
+  gc->object_count = 0;
+  gc->step_at = GC_HEAP_MIN;
+  gc->step_budget = GC_STEP_BUDGET;
+  gc->stats = (struct Gc_stats) {0};
+}
+
+struct List* gc_new_list(struct VM_state* vm, int capacity) {
+  assert(vm != NULL);
+  struct List* list = mmalloc(sizeof(struct List));
+  if (!list)
+    return NULL;
+  list->data = NULL;
+  list->length = 0;
+  list->capacity = 0;
+  list->region = 0;
+  if (capacity > 0)
+    list_reserve(list->data, list->length, list->capacity, capacity);
+  add_object(vm, &list->gc, T_LIST, list_size(list));
+  return list;
+}
+
+struct Map* gc_new_map(struct VM_state* vm) {
+  assert(vm != NULL);
+  struct Map* map = mmalloc(sizeof(struct Map));
+  if (!map)
+    return NULL;
+  map_init(map);
+  add_object(vm, &map->gc, T_MAP, map_size(map));
+  return map;
+}
+
+void gc_barrier(struct VM_state* vm, struct Gc_object* object, const struct Object* value) {
+  if (vm->gc.phase == GC_MARK && object->mark == vm->gc.epoch)
+    shade(vm, value);
+}
+
+void gc_shade(struct VM_state* vm, const struct Object* value) {
+  shade(vm, value);
+}
+
+void gc_resize(struct VM_state* vm, struct Gc_object* object) {
+  assert(object->type != T_LIST || !((struct List*)object)->region);
+  unsigned int size = object->type == T_LIST ? list_size((struct List*)object) : map_size((struct Map*)object);
+  vm->gc.bytes = vm->gc.bytes - object->size + size;  // The object may have shrunk
+  object->size = size;
+}
+
+unsigned long gc_heap_size(struct VM_state* vm) {
+  return vm->gc.bytes + vm->strings.bytes;
+}
+
+void gc_step(struct VM_state* vm) {
+  assert(vm != NULL);
+  struct Gc* gc = &vm->gc;
+  struct timespec begin;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  int budget = gc->step_budget;
+  if (gc->phase == GC_IDLE)
+    start(vm);
+  if (gc->phase == GC_MARK)
+    budget = mark(vm, budget);
+  if (gc->phase == GC_SWEEP)
+    sweep(vm, budget);
+  if (gc->phase == GC_IDLE) {
+    unsigned long live = gc_heap_size(vm);
+    gc->step_at = live * GC_GROWTH / 100;
+    if (gc->step_at < GC_HEAP_MIN)
+      gc->step_at = GC_HEAP_MIN;
+  }
+  else
+    gc->step_at = gc_heap_size(vm) + GC_STEP_SIZE;
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  gc->stats.steps++;
+  record_pause(&gc->stats, (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) * 1e-9);
+}
+
+void gc_collect(struct VM_state* vm) {
+  assert(vm != NULL);
+  struct Gc* gc = &vm->gc;
+  unsigned int budget = gc->step_budget;
+  gc->step_budget = INT_MAX;
+  if (gc->phase != GC_IDLE)
+    gc_step(vm);
+  gc_step(vm);
+  gc->step_budget = budget;
+  assert(gc->phase == GC_IDLE);
+}
+
+void gc_print_stats(struct VM_state* vm) {
+  assert(vm != NULL);
+  const struct Gc* gc = &vm->gc;
+  printf(
+    "GC stats:\n"
+    "  Heap size: %.2f KB (%lu objects, %u strings)\n"
+    "  Collections: %lu (%lu steps, %lu freed)\n"
+    "  Pauses:",
+    gc_heap_size(vm) / 1024.0,
+    gc->object_count,
+    vm->strings.count - vm->strings.free_count,
+    gc->stats.collections,
+    gc->stats.steps,
+    gc->stats.freed
+  );
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+    printf(" %s: %lu%s", pause_names[i], gc->stats.pauses[i], i < GC_PAUSE_BUCKETS - 1 ? "," : "");
+  printf(" (max: %.3f ms)\n", gc->stats.max_pause * 1e3);
+}
+
+void gc_free(struct VM_state* vm) {
+  assert(vm != NULL);
+  struct Gc* gc = &vm->gc;
+  while (gc->objects) {
+    struct Gc_object* object = gc->objects;
+    gc->objects = object->next;
+    free_object(vm, object);
+  }
+  list_free(gc->gray, gc->gray_count, gc->gray_capacity);
+  gc_init(gc);
+}
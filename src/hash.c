@@ -1,103 +1,248 @@
 // hash.c
 // Hash table implementation that uses open addressing
+//
+// The table is split up into groups of HTABLE_GROUP_SIZE slots. Each slot has a control byte that is
+// either empty, deleted, or holds the low 7 bits of the hash of its key (the tag). A lookup compares
+// the tag against a whole group of control bytes at once (with SSE2 when we have it), and only looks
+// at the keys where the tags match. The full hash is stored next to each key, so that keys don't have
+// to be compared when the hashes differ, and so that the table can grow without rehashing any keys.
+// Groups are probed quadratically; the search stops at the first group that has an empty slot.
+// Removed elements leave a tombstone behind, which are cleared out when the table is resized.
+//
+// Keys can be of any length. They are copied into an arena owned by the table, which is compacted
+// when the table is resized. Values are stored inline, 'value_size' bytes each.
 
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "config.h"
 #include "mem.h"
 #include "hash.h"
 
-#define UNUSED_SLOT 0
-#define USED_SLOT 1
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+
+#define HASH_TAG(h) ((h) & 0x7f)
+#define HASH_GROUP(h) ((h) >> 7)
+
+#define MAX_LOAD(size) ((size) - (size) / 8)	// 7/8
+
+#define KEYS_INIT_SIZE 64
 
 struct Item {
-	Hkey key;
-	Hvalue value;
-	int used_slot;
+	unsigned int hash;
+	unsigned int key_offset;
+	unsigned int key_length;
 };
 
-static unsigned int hash(const Hkey key, unsigned int tablesize);
-static int linear_probe(const Htable* table, const Hkey key, unsigned int* collision_count);
-static int key_compare(const Hkey a, const Hkey b);
-static Htable resize_table(Htable* table, unsigned int new_size);
-
-unsigned int hash(const Hkey key, unsigned int tablesize) {
+static unsigned int hash(const char* key, unsigned int length);
+static unsigned int group_match(const unsigned char* ctrl, unsigned char tag);
+static unsigned int group_match_empty(const unsigned char* ctrl);
+static unsigned int group_match_free(const unsigned char* ctrl);
+static int find(const Htable* table, const char* key, unsigned int length, unsigned int h, unsigned int* probe_length);
+static int find_free_slot(const Htable* table, unsigned int h, unsigned int* probe_length);
+static int key_compare(const Htable* table, const struct Item* item, const char* key, unsigned int length);
+static unsigned int store_key(Htable* table, const char* key, unsigned int length);
+static int resize_table(Htable* table, unsigned int new_size);
+static void* insert(Htable* table, const char* key, unsigned int length, unsigned int h, const void* value, unsigned int* probe_length);
+static unsigned int round_size(unsigned int size);
+
+// djb2, followed by a finalizer so that all bits of the hash depend on all of the key
+unsigned int hash(const char* key, unsigned int length) {
 	unsigned int hash_number = 5381;
-  unsigned int size = strlen(key);
-  int c;
+	for (unsigned int i = 0; i < length; i++)
+		hash_number = ((hash_number << 5) + hash_number) + key[i];
+	hash_number ^= hash_number >> 16;
+	hash_number *= 0x85ebca6b;
+	hash_number ^= hash_number >> 13;
+	hash_number *= 0xc2b2ae35;
+	hash_number ^= hash_number >> 16;
+	return hash_number;
+}
+
+// Returns a bit mask of the slots in the group that have the given tag
+#if defined(__SSE2__)
 
-  for (unsigned int i = 0; i < size; i++) {
-		c = key[i];
-		hash_number = ((hash_number << 5) + hash_number) + c;
-  }
-  return hash_number % tablesize;
+unsigned int group_match(const unsigned char* ctrl, unsigned char tag) {
+	__m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
 }
 
-int linear_probe(const Htable* table, const Hkey key, unsigned int* collision_count) {
-	int index = hash(key, ht_get_size(table));
-	int counter = 0;
-	for (; index < ht_get_size(table); index++, counter++) {
-		if (key_compare(table->items[index].key, key) || table->items[index].used_slot == UNUSED_SLOT)
-			return index;
+unsigned int group_match_empty(const unsigned char* ctrl) {
+	return group_match(ctrl, CTRL_EMPTY);
+}
 
-		if (counter >= ht_get_size(table))
-			return -1;
+// Empty or deleted slots are the only ones with the high bit set
+unsigned int group_match_free(const unsigned char* ctrl) {
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+}
 
-		if (index+1 >= ht_get_size(table)) {
-			++(*collision_count);
-			index = 0;
+#else
+
+unsigned int group_match(const unsigned char* ctrl, unsigned char tag) {
+	unsigned int mask = 0;
+	for (int i = 0; i < HTABLE_GROUP_SIZE; i++)
+		mask |= (ctrl[i] == tag) << i;
+	return mask;
+}
+
+unsigned int group_match_empty(const unsigned char* ctrl) {
+	return group_match(ctrl, CTRL_EMPTY);
+}
+
+unsigned int group_match_free(const unsigned char* ctrl) {
+	unsigned int mask = 0;
+	for (int i = 0; i < HTABLE_GROUP_SIZE; i++)
+		mask |= (ctrl[i] >> 7) << i;
+	return mask;
+}
+
+#endif
+
+// Returns the slot of the key, or -1 if it's not in the table
+int find(const Htable* table, const char* key, unsigned int length, unsigned int h, unsigned int* probe_length) {
+	unsigned int group_mask = table->size / HTABLE_GROUP_SIZE - 1;
+	unsigned int group = HASH_GROUP(h) & group_mask;
+	for (unsigned int step = 1; step <= group_mask + 1; step++) {
+		const unsigned char* ctrl = &table->ctrl[group * HTABLE_GROUP_SIZE];
+		for (unsigned int match = group_match(ctrl, HASH_TAG(h)); match; match &= match - 1) {
+			int index = group * HTABLE_GROUP_SIZE + __builtin_ctz(match);
+			const struct Item* item = &table->items[index];
+			if (item->hash == h && key_compare(table, item, key, length)) {
+				if (probe_length)
+					*probe_length = step;
+				return index;
+			}
 		}
-		++(*collision_count);
+		if (group_match_empty(ctrl))
+			break;
+		group = (group + step) & group_mask;
 	}
-	return index;
+	return -1;
 }
 
-int key_compare(const Hkey a, const Hkey b) {
-	return strcmp(a, b) == 0;
+// First empty or deleted slot along the probe sequence of the hash
+int find_free_slot(const Htable* table, unsigned int h, unsigned int* probe_length) {
+	unsigned int group_mask = table->size / HTABLE_GROUP_SIZE - 1;
+	unsigned int group = HASH_GROUP(h) & group_mask;
+	for (unsigned int step = 1; step <= group_mask + 1; step++) {
+		unsigned int match = group_match_free(&table->ctrl[group * HTABLE_GROUP_SIZE]);
+		if (match) {
+			if (probe_length)
+				*probe_length = step;
+			return group * HTABLE_GROUP_SIZE + __builtin_ctz(match);
+		}
+		group = (group + step) & group_mask;
+	}
+	return -1;
 }
 
-Htable resize_table(Htable* table, unsigned int new_size) {
-	assert(table != NULL);
-
-	if (ht_num_elements(table) > new_size)
-		return *table;
+int key_compare(const Htable* table, const struct Item* item, const char* key, unsigned int length) {
+	return item->key_length == length && memcmp(&table->keys[item->key_offset], key, length) == 0;
+}
 
-	Htable new_table = ht_create(new_size);
-	if (ht_get_size(&new_table) != new_size)
-		return *table;	// Allocation failed
+// Copy the key into the key arena, returns the offset of the key (or -1 if we failed to allocate memory)
+unsigned int store_key(Htable* table, const char* key, unsigned int length) {
+	if (table->keys_used + length > table->keys_size || !table->keys) {
+		unsigned int new_size = table->keys_size ? table->keys_size * 2 : KEYS_INIT_SIZE;
+		while (new_size < table->keys_used + length)
+			new_size *= 2;
+		char* keys = table->keys ?
+			mrealloc(table->keys, table->keys_size, new_size) :
+			mmalloc(new_size);
+		if (!keys)
+			return (unsigned int)-1;
+		table->keys = keys;
+		table->keys_size = new_size;
+	}
+	unsigned int offset = table->keys_used;
+	memcpy(&table->keys[offset], key, length);
+	table->keys_used += length;
+	return offset;
+}
 
-	struct Item item;
-	for (int i = 0; i < ht_get_size(table); i++) {
-		item = table->items[i];
-		if (item.used_slot != UNUSED_SLOT) {
-			ht_insert_element(&new_table, item.key, item.value);
+// Move all elements over to a table of 'new_size' slots, dropping the tombstones
+// The cached hashes are reused, so no keys are hashed again
+int resize_table(Htable* table, unsigned int new_size) {
+	assert(table != NULL);
+	if (ht_num_elements(table) > MAX_LOAD(new_size))
+		return 0;
+
+	Htable new_table = ht_create(new_size, table->value_size);
+	if (ht_get_size(&new_table) == 0)
+		return 0;	// Allocation failed
+
+	for (unsigned int i = 0; i < ht_get_size(table); i++) {
+		if (table->ctrl[i] & CTRL_EMPTY)
+			continue;
+		const struct Item* item = &table->items[i];
+		int index = find_free_slot(&new_table, item->hash, NULL);
+		assert(index >= 0);
+		unsigned int key_offset = store_key(&new_table, &table->keys[item->key_offset], item->key_length);
+		if (key_offset == (unsigned int)-1) {
+			ht_free(&new_table);
+			return 0;
 		}
+		new_table.ctrl[index] = HASH_TAG(item->hash);
+		new_table.items[index] = *item;
+		new_table.items[index].key_offset = key_offset;
+		memcpy(&new_table.values[index * table->value_size], &table->values[i * table->value_size], table->value_size);
+		new_table.count++;
 	}
 	ht_free(table);
-	return new_table;
+	*table = new_table;
+	return 1;
 }
 
-Htable ht_create(unsigned int size) {
-	if (!size) size = 1;
+unsigned int round_size(unsigned int size) {
+	unsigned int rounded = HTABLE_GROUP_SIZE;
+	while (rounded < size)
+		rounded *= 2;
+	return rounded;
+}
 
-	Htable table = {
-		.items = mcalloc(sizeof(struct Item), size),
-		.count = 0,
-		.size = size
-	};
-	if (!table.items) // Allocation failed!
-		table.size = 0;
+Htable ht_create(unsigned int size, unsigned int value_size) {
+	size = round_size(size);
+
+	Htable table = ht_create_empty_of(value_size);
+	table.ctrl = mmalloc(size);
+	table.items = mmalloc(sizeof(struct Item) * size);
+	table.values = mmalloc(value_size * size);
+	if (!table.ctrl || !table.items || !table.values) { // Allocation failed!
+		mfree(table.ctrl, size);
+		mfree(table.items, sizeof(struct Item) * size);
+		mfree(table.values, value_size * size);
+		return ht_create_empty_of(value_size);
+	}
+	table.size = size;
+	memset(table.ctrl, CTRL_EMPTY, size);
 	return table;
 }
 
 Htable ht_create_empty() {
+	return ht_create_empty_of(sizeof(Hvalue));
+}
+
+Htable ht_create_empty_of(unsigned int value_size) {
+	assert(value_size > 0);
 	Htable table = {
+		.ctrl = NULL,
 		.items = NULL,
+		.values = NULL,
+		.keys = NULL,
+		.keys_used = 0,
+		.keys_size = 0,
+		.keys_garbage = 0,
 		.count = 0,
-		.size = 0
+		.size = 0,
+		.tombstones = 0,
+		.value_size = value_size,
 	};
 	return table;
 }
@@ -107,96 +252,133 @@ int ht_is_empty(const Htable* table) {
   return table->items == NULL;
 }
 
-unsigned int ht_insert_element(Htable* table, const Hkey key, const Hvalue value) {
+// 'probe_length' is set to the number of groups probed to find the key, or a slot for it
+void* insert(Htable* table, const char* key, unsigned int length, unsigned int h, const void* value, unsigned int* probe_length) {
 	assert(table != NULL);
 	if (ht_is_empty(table)) {
-		Htable new_table = ht_create(HASH_TABLE_INIT_SIZE);
-		if (ht_get_size(&new_table) == HASH_TABLE_INIT_SIZE) {
-			*table = new_table;
-		}
-		else return 0;
-	}
-	if (ht_num_elements(table) > (ht_get_size(table) / 2)) {
-		*table = resize_table(table, table->size * 2);
+		*table = ht_create(HASH_TABLE_INIT_SIZE, table->value_size);
+		if (ht_is_empty(table))
+			return NULL;
 	}
-
-	unsigned int collisions = 0;
-	int index = linear_probe(table, key, &collisions);
-	if (index >= 0 && index < ht_get_size(table)) {
-		struct Item item = { .value = value, .used_slot = USED_SLOT };
-		strncpy(item.key, key, HTABLE_KEY_SIZE);
-		table->items[index] = item;
+	int index = find(table, key, length, h, probe_length);
+	if (index < 0) {
+		if (table->count + table->tombstones >= MAX_LOAD(table->size)) {
+			// Only grow if the table is actually full, otherwise it's enough to clear out the tombstones
+			unsigned int new_size = table->count >= table->size / 2 ? table->size * 2 : table->size;
+			if (!resize_table(table, new_size))
+				return NULL;
+		}
+		else if (table->keys_garbage > KEYS_INIT_SIZE && table->keys_garbage > table->keys_used / 2) {
+			resize_table(table, table->size);	// Compact the key arena
+		}
+		unsigned int key_offset = store_key(table, key, length);
+		if (key_offset == (unsigned int)-1)
+			return NULL;
+		index = find_free_slot(table, h, probe_length);
+		assert(index >= 0);
+		if (table->ctrl[index] == CTRL_DELETED)
+			table->tombstones--;
+		table->ctrl[index] = HASH_TAG(h);
+		struct Item* item = &table->items[index];
+		item->hash = h;
+		item->key_offset = key_offset;
+		item->key_length = length;
 		table->count++;
 	}
-	assert(ht_lookup(table, key) != NULL);
-	return collisions;
+	void* stored = &table->values[index * table->value_size];
+	memcpy(stored, value, table->value_size);
+	return stored;
+}
+
+void* ht_insert(Htable* table, const char* key, unsigned int length, const void* value) {
+	return insert(table, key, length, hash(key, length), value, NULL);
+}
+
+void* ht_insert_hashed(Htable* table, const char* key, unsigned int length, unsigned int h, const void* value) {
+	return insert(table, key, length, h, value, NULL);
+}
+
+// Returns the number of extra groups that were probed to find a slot for the key
+unsigned int ht_insert_element(Htable* table, const char* key, unsigned int length, const Hvalue value) {
+	assert(table->value_size == sizeof(Hvalue));
+	unsigned int probe_length = 1;
+	if (!insert(table, key, length, hash(key, length), &value, &probe_length))
+		return 0;
+	return probe_length - 1;
+}
+
+void* ht_lookup(const Htable* table, const char* key, unsigned int length) {
+	return ht_lookup_hashed(table, key, length, hash(key, length));
 }
 
-const Hvalue* ht_lookup(const Htable* table, const Hkey key) {
+void* ht_lookup_hashed(const Htable* table, const char* key, unsigned int length, unsigned int h) {
 	assert(table != NULL);
 	if (ht_get_size(table) == 0) return NULL;
-	unsigned int collisions = 0;
-	int index = linear_probe(table, key, &collisions);
-	if (index >= 0 && index < ht_get_size(table)) {
-		struct Item* item = &table->items[index];
-		if (item->used_slot == UNUSED_SLOT)
-			return NULL;
-		if (key_compare(item->key, key))
-			return &item->value;
-	}
+	int index = find(table, key, length, h, NULL);
+	if (index >= 0)
+		return &table->values[index * table->value_size];
 	return NULL;
 }
 
-const Hvalue* ht_lookup_byindex(const Htable* table, const unsigned int index) {
+void* ht_lookup_byindex(const Htable* table, const unsigned int index) {
 	assert(table != NULL);
 	if (index < ht_get_size(table)) {
-		if (table->items[index].used_slot != UNUSED_SLOT)
-			return &table->items[index].value;
+		if (!(table->ctrl[index] & CTRL_EMPTY))
+			return &table->values[index * table->value_size];
 	}
 	return NULL;
 }
 
-const Hkey* ht_lookup_key(const Htable* table, const unsigned int index) {
+const char* ht_lookup_key(const Htable* table, const unsigned int index, unsigned int* length) {
 	assert(table != NULL);
 	if (index < ht_get_size(table)) {
-		if (table->items[index].used_slot != UNUSED_SLOT)
-			return &table->items[index].key;
+		if (!(table->ctrl[index] & CTRL_EMPTY)) {
+			const struct Item* item = &table->items[index];
+			if (length)
+				*length = item->key_length;
+			return &table->keys[item->key_offset];
+		}
 	}
 	return NULL;
 }
 
-int ht_element_exists(const Htable* table, const Hkey key) {
+int ht_element_exists(const Htable* table, const char* key, unsigned int length) {
 	assert(table != NULL);
-	return ht_lookup(table, key) != NULL;
+	return ht_lookup(table, key, length) != NULL;
+}
+
+void ht_remove_element(Htable* table, const char* key, unsigned int length) {
+	ht_remove_hashed(table, key, length, hash(key, length));
 }
 
-void ht_remove_element(Htable* table, const Hkey key) {
+void ht_remove_hashed(Htable* table, const char* key, unsigned int length, unsigned int h) {
 	assert(table != NULL);
-	if (ht_num_elements(table) < (ht_get_size(table) / 4)) {
-		*table = resize_table(table, table->size / 2);
+	if (ht_get_size(table) == 0)
+		return;
+	int index = find(table, key, length, h, NULL);
+	if (index < 0)
+		return;
+	// Lookups stop at a group with an empty slot, so if this group has one there is no need for a tombstone
+	table->keys_garbage += table->items[index].key_length;
+	const unsigned char* group = &table->ctrl[index - index % HTABLE_GROUP_SIZE];
+	if (group_match_empty(group))
+		table->ctrl[index] = CTRL_EMPTY;
+	else {
+		table->ctrl[index] = CTRL_DELETED;
+		table->tombstones++;
 	}
+	table->count--;
+	assert(find(table, key, length, h, NULL) < 0);
+}
 
-	unsigned int collisions = 0;
-	int index = linear_probe(table, key, &collisions);
-	if (index >= 0 && index < ht_get_size(table)) {
-		table->items[index].used_slot = UNUSED_SLOT;
-		table->count--;
-
-		struct Item item;
-		for (; index < ht_get_size(table);) {
-			if (index + 1 >= ht_get_size(table)) index = 0;
-
-			item = table->items[++index];
-			if (item.used_slot != UNUSED_SLOT) {
-				table->items[index].used_slot = UNUSED_SLOT;
-				table->count--;	// We are just moving this slot, not adding a new one, so decrement the count
-				ht_insert_element(table, item.key, item.value);	// This function will increment count by 1
-			}
-			if (item.used_slot == UNUSED_SLOT)
-				break;
-		}
-		assert(!ht_element_exists(table, key));
-	}
+// Move the elements to a smaller table once at most an eighth of the slots are in use
+// The new table is a quarter full, so it takes a good number of inserts to grow it again
+int ht_shrink(Htable* table) {
+	assert(table != NULL);
+	if (table->size <= HASH_TABLE_INIT_SIZE || table->count > table->size / 8)
+		return 0;
+	unsigned int new_size = table->count * 4 > HASH_TABLE_INIT_SIZE ? table->count * 4 : HASH_TABLE_INIT_SIZE;
+	return resize_table(table, round_size(new_size));
 }
 
 unsigned int ht_get_size(const Htable* table) {
@@ -209,12 +391,42 @@ unsigned int ht_num_elements(const Htable* table) {
 	return table->count;
 }
 
+void ht_get_stats(const Htable* table, struct Htable_stats* stats) {
+	assert(table != NULL);
+	assert(stats != NULL);
+	stats->count = table->count;
+	stats->size = table->size;
+	stats->tombstones = table->tombstones;
+	stats->load_factor = table->size ? (float)(table->count + table->tombstones) / table->size : 0;
+	stats->avg_probe_length = 0;
+	stats->max_probe_length = 0;
+	unsigned long total = 0;
+	for (unsigned int i = 0; i < ht_get_size(table); i++) {
+		if (table->ctrl[i] & CTRL_EMPTY)
+			continue;
+		const struct Item* item = &table->items[i];
+		unsigned int probe_length = 0;
+		find(table, &table->keys[item->key_offset], item->key_length, item->hash, &probe_length);
+		total += probe_length;
+		if (probe_length > stats->max_probe_length)
+			stats->max_probe_length = probe_length;
+	}
+	if (table->count)
+		stats->avg_probe_length = (float)total / table->count;
+	stats->key_bytes = table->keys_used;
+}
+
 void ht_free(Htable* table) {
 	assert(table != NULL);
 	if (table->items) {
+		mfree(table->ctrl, table->size);
 		mfree(table->items, table->size * sizeof(struct Item));
-		table->items = NULL;
-		table->size = 0;
-		table->count = 0;
+		mfree(table->values, table->size * table->value_size);
 	}
+	mfree(table->keys, table->keys_size);
+	*table = ht_create_empty_of(table->value_size);
+}
+
+unsigned int ht_hash(const char* key, unsigned int length) {
+	return hash(key, length);
 }
@@ -0,0 +1,95 @@
+// intern.c
+// String interning
+//
+// Every distinct string is stored once, so two interned strings are equal if and only if
+// their data pointers are equal.
+
+#include <assert.h>
+#include <string.h>
+
+#include "mem.h"
+#include "list.h"
+#include "intern.h"
+
+void intern_init(struct Intern_table* table) {
+  assert(table != NULL);
+  table->lookup = ht_create_empty();
+  table->strings = NULL;
+  table->count = 0;
+  table->capacity = 0;
+  table->free_slots = NULL;
+  table->free_count = 0;
+  table->free_capacity = 0;
+  table->bytes = 0;
+  table->mark = 0;
+}
+
+int intern_index(struct Intern_table* table, const char* string, int length) {
+  assert(table != NULL && string != NULL);
+  unsigned int hash = ht_hash(string, length);  // Once, for the lookup and for the insert
+  const Hvalue* found = ht_lookup_hashed(&table->lookup, string, length, hash);
+  if (found) {
+    intern_header(table->strings[*found].data)->mark = table->mark;
+    return *found;
+  }
+  struct Intern_header* header = mmalloc(intern_size(length));
+  if (!header)
+    return -1;
+  struct Interned interned = {
+    .data = (char*)(header + 1),
+    .length = length,
+    .hash = hash,
+  };
+  memcpy(interned.data, string, length);
+  interned.data[length] = '\0';
+  unsigned int count = table->count;
+  if (table->free_count > 0)
+    count = table->free_slots[--table->free_count];
+  else {
+    list_push(table->strings, table->count, table->capacity, interned);
+    if (table->count == count) {
+      mfree(header, intern_size(length));
+      return -1;
+    }
+  }
+  table->strings[count] = interned;
+  header->index = count;
+  header->mark = table->mark;
+  table->bytes += intern_size(length);
+  Hvalue value = count;
+  ht_insert_hashed(&table->lookup, string, length, hash, &value);
+  return count;
+}
+
+const struct Interned* intern_string(struct Intern_table* table, const char* string, int length) {
+  int index = intern_index(table, string, length);
+  if (index < 0)
+    return NULL;
+  return &table->strings[index];
+}
+
+void intern_remove(struct Intern_table* table, int index) {
+  assert(table != NULL && index >= 0 && (unsigned int)index < table->count);
+  struct Interned* interned = &table->strings[index];
+  assert(interned->data != NULL);
+  unsigned int free_count = table->free_count;
+  list_push(table->free_slots, table->free_count, table->free_capacity, index);
+  if (table->free_count == free_count)
+    return; // Kept, rather than losing track of the slot
+  ht_remove_hashed(&table->lookup, interned->data, interned->length, interned->hash);
+  mfree(intern_header(interned->data), intern_size(interned->length));
+  table->bytes -= intern_size(interned->length);
+  interned->data = NULL;
+}
+
+void intern_free(struct Intern_table* table) {
+  assert(table != NULL);
+  for (unsigned int i = 0; i < table->count; i++) {
+    if (table->strings[i].data)
+      mfree(intern_header(table->strings[i].data), intern_size(table->strings[i].length));
+  }
+  list_free(table->strings, table->count, table->capacity);
+  list_free(table->free_slots, table->free_count, table->free_capacity);
+  ht_free(&table->lookup);
+  intern_init(table);
+}
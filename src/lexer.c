@@ -1,7 +1,17 @@
 // lexer.c
+//
+// Characters are classified with a lookup table. Runs of blanks, identifier characters,
+// comments and strings are skipped 16 bytes at a time where SSE2 is available.
+// Keywords are found with a perfect hash on the length and the first and last character.
+// The input is not null-terminated (mapped files aren't, see file.c), nothing is read at or past 'end'.
 
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "str.h"
 #include "error.h"
@@ -12,58 +22,195 @@
 #define lexerror(fmt, ...) \
   error("%s:%i:%i: " COLOR_ERROR "lex-error: " COLOR_NONE fmt, lexer->filename, lexer->line, lexer->count, ##__VA_ARGS__)
 
-static int is_alpha(char ch);
-static int is_number(char ch);
-static int endofline(struct Lexer* lexer);
-static int match(struct Token token, const char* compare);
+// Character classes
+#define CC_BLANK    (1 << 0)  // Whitespace, except for newlines
+#define CC_NEWLINE  (1 << 1)
+#define CC_ALPHA    (1 << 2)
+#define CC_DIGIT    (1 << 3)
+#define CC_IDENT    (1 << 4)  // Can be part of an identifier
+#define CC_SKIP     (1 << 5)  // Has to be looked at when skipping a block: braces, strings and comments
+
+static const unsigned char char_class[256] = {
+  [' '] = CC_BLANK, ['\t'] = CC_BLANK, ['\v'] = CC_BLANK, ['\f'] = CC_BLANK,
+  ['\n'] = CC_NEWLINE | CC_SKIP, ['\r'] = CC_NEWLINE | CC_SKIP,
+  ['{'] = CC_SKIP, ['}'] = CC_SKIP, ['"'] = CC_SKIP, ['\''] = CC_SKIP, ['/'] = CC_SKIP,
+  ['a' ... 'z'] = CC_ALPHA | CC_IDENT,
+  ['A' ... 'Z'] = CC_ALPHA | CC_IDENT,
+  ['0' ... '9'] = CC_DIGIT | CC_IDENT,
+  ['_'] = CC_IDENT,
+};
+
+#define char_is(ch, cc) (char_class[(unsigned char)(ch)] & (cc))
+
+// The character after the current one, or a null character at the end of the input
+#define peek(lexer) ((lexer)->index < (lexer)->end ? *(lexer)->index : '\0')
+
+struct Keyword {
+  const char* name;
+  int length;
+  int type;
+};
+
+#define KEYWORD_HASH_SIZE 16
+#define keyword_hash(string, length) \
+  ((((length) << 2) + (unsigned char)(string)[0] + ((unsigned char)(string)[(length) - 1] << 1)) & (KEYWORD_HASH_SIZE - 1))
+
+// Indexed by keyword_hash, which has no collisions for these keywords
+static const struct Keyword keywords[KEYWORD_HASH_SIZE] = {
+  [0] = { TOKEN_DECL, 3, T_DECL },
+  [6] = { TOKEN_RETURN, 6, T_RETURN },
+  [13] = { TOKEN_IF, 2, T_IF },
+  [5] = { TOKEN_WHILE, 5, T_WHILE },
+  [12] = { TOKEN_BREAK, 5, T_BREAK },
+  [10] = { TOKEN_FUNC_DEF, 2, T_FUNC_DEF },
+  [9] = { TOKEN_IMPORT, 6, T_IMPORT },
+  [4] = { TOKEN_LOAD, 4, T_LOAD },
+  [2] = { TOKEN_NIL, 3, T_NIL },
+};
+
+static int span_blank(const char* string, const char* end);
+static int span_ident(const char* string, const char* end);
+static int scan_until(const char* string, const char* end, char a, char b);
+static int keyword_type(const char* string, int length);
 static void next(struct Lexer* lexer);
+static void skip(struct Lexer* lexer, int count);
 static struct Token read_number(struct Lexer* lexer);
 static struct Token read_symbol(struct Lexer* lexer);
 
-int is_alpha(char ch) {
-  return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z');
+#if defined(__SSE2__)
+
+// The 16 byte loads stay within the input, the rest of it is handled a character at a time
+#define CAN_LOAD16(p, end) ((end) - (p) >= 16)
+
+static unsigned int mask_blank(__m128i chunk) {
+  __m128i m = _mm_or_si128(
+    _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t'))),
+    _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\v')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\f'))));
+  return _mm_movemask_epi8(m);
+}
+
+static unsigned int mask_ident(__m128i chunk) {
+  __m128i lower = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+  __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+  __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(chunk, _mm_set1_epi8('9' + 1)));
+  __m128i underscore = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('_'));
+  return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), underscore));
 }
 
-int is_number(char ch) {
-  return ch >= '0' && ch <= '9';
+int span_blank(const char* string, const char* end) {
+  int n = 0;
+  if (string == end || !char_is(string[0], CC_BLANK))  // Most often there is only a single blank
+    return 0;
+  while (CAN_LOAD16(string + n, end)) {
+    unsigned int stop = ~mask_blank(_mm_loadu_si128((const __m128i*)(string + n))) & 0xffff;
+    if (stop)
+      return n + __builtin_ctz(stop);
+    n += 16;
+  }
+  while (string + n < end && char_is(string[n], CC_BLANK))
+    n++;
+  return n;
 }
 
-int endofline(struct Lexer* lexer) {
-  return *lexer->index == '\n' || *lexer->index == '\r';
+int span_ident(const char* string, const char* end) {
+  int n = 0;
+  while (n < 4 && string + n < end && char_is(string[n], CC_IDENT))  // Short identifiers are common, don't bother with SIMD for them
+    n++;
+  if (n < 4)
+    return n;
+  while (CAN_LOAD16(string + n, end)) {
+    unsigned int stop = ~mask_ident(_mm_loadu_si128((const __m128i*)(string + n))) & 0xffff;
+    if (stop)
+      return n + __builtin_ctz(stop);
+    n += 16;
+  }
+  while (string + n < end && char_is(string[n], CC_IDENT))
+    n++;
+  return n;
 }
 
-int match(struct Token token, const char* compare) {
-  const char* index = compare;
-  for (int i = 0; i < token.length; i++, index++) {
-    if (token.string[i] != *index) {
-      return 0;
-    }
+// Number of characters before the first 'a' or 'b', or before the end if there is neither
+int scan_until(const char* string, const char* end, char a, char b) {
+  int n = 0;
+  while (CAN_LOAD16(string + n, end)) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(string + n));
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(a)), _mm_cmpeq_epi8(chunk, _mm_set1_epi8(b)));
+    unsigned int stop = _mm_movemask_epi8(m);
+    if (stop)
+      return n + __builtin_ctz(stop);
+    n += 16;
   }
-  return (*index == 0);
+  while (string + n < end && string[n] != a && string[n] != b)
+    n++;
+  return n;
+}
+
+#else
+
+int span_blank(const char* string, const char* end) {
+  int n = 0;
+  while (string + n < end && char_is(string[n], CC_BLANK))
+    n++;
+  return n;
+}
+
+int span_ident(const char* string, const char* end) {
+  int n = 0;
+  while (string + n < end && char_is(string[n], CC_IDENT))
+    n++;
+  return n;
+}
+
+int scan_until(const char* string, const char* end, char a, char b) {
+  int n = 0;
+  while (string + n < end && string[n] != a && string[n] != b)
+    n++;
+  return n;
+}
+
+#endif
+
+int keyword_type(const char* string, int length) {
+  const struct Keyword* keyword = &keywords[keyword_hash(string, length)];
+  if (keyword->length == length && !memcmp(keyword->name, string, length))
+    return keyword->type;
+  return T_IDENTIFIER;
 }
 
 void next(struct Lexer* lexer) {
   lexer->token.string = lexer->index++;
   lexer->token.length = 0;
+  lexer->token.symbol = -1;
   lexer->count++;
   lexer->token.count = lexer->count;
   lexer->token.line = lexer->line;
 }
 
+// Advance past characters that don't start a new line
+void skip(struct Lexer* lexer, int count) {
+  lexer->index += count;
+  lexer->count += count;
+}
+
 struct Token read_number(struct Lexer* lexer) {
-  while (
-        is_number(*lexer->index) ||
-        *lexer->index == '.' ||
-        *lexer->index == 'x' ||
-        (*lexer->index >= 'a' && *lexer->index <= 'f') ||
-        (*lexer->index >= 'A' && *lexer->index <= 'F')) {
-    lexer->index++;
-    lexer->count++;
+  // Take everything that could belong to the literal, so that '12ab' is reported as a bad number
+  // instead of a number followed by an identifier
+  const char* string = lexer->token.string;
+  int hex = string[0] == '0' && (peek(lexer) == 'x' || peek(lexer) == 'X');
+  for (;;) {
+    char ch = peek(lexer);
+    if (char_is(ch, CC_IDENT) || ch == '.')
+      skip(lexer, 1);
+    else if ((ch == '+' || ch == '-') && !hex && (lexer->index[-1] == 'e' || lexer->index[-1] == 'E'))
+      skip(lexer, 1); // Sign of the exponent
+    else
+      break;
   }
-  lexer->token.length = lexer->index - lexer->token.string;
+  lexer->token.length = lexer->index - string;
   double num = 0;
-  if (safe_string_to_number(lexer->token.string, lexer->token.length, &num) != 0) {
-    lexerror("Bad number\n");
+  int parsed = string_parse_number(string, lexer->token.length, &num);
+  if (parsed != lexer->token.length) {
+    error("%s:%i:%i: " COLOR_ERROR "lex-error: " COLOR_NONE "Bad number '%.*s', unexpected '%c'\n", lexer->filename, lexer->line, lexer->token.count + parsed, lexer->token.length, string, string[parsed]);
     lexer->token.type = T_EOF;
     return lexer->token;
   }
@@ -73,35 +220,16 @@ struct Token read_number(struct Lexer* lexer) {
 }
 
 struct Token read_symbol(struct Lexer* lexer) {
-  while (
-      is_alpha(*lexer->index) ||
-      is_number(*lexer->index) ||
-      *lexer->index == '_'
-  ) {
-    lexer->index++;
-    lexer->count++;
-  }
+  skip(lexer, span_ident(lexer->index, lexer->end));
   lexer->token.length = lexer->index - lexer->token.string;
-  if (match(lexer->token, TOKEN_DECL))
-    lexer->token.type = T_DECL;
-  else if (match(lexer->token, TOKEN_RETURN))
-    lexer->token.type = T_RETURN;
-  else if (match(lexer->token, TOKEN_IF))
-    lexer->token.type = T_IF;
-  else if (match(lexer->token, TOKEN_WHILE))
-    lexer->token.type = T_WHILE;
-  else if (match(lexer->token, TOKEN_BREAK))
-    lexer->token.type = T_BREAK;
-  else if (match(lexer->token, TOKEN_FUNC_DEF))
-    lexer->token.type = T_FUNC_DEF;
-  else if (match(lexer->token, TOKEN_IMPORT))
-    lexer->token.type = T_IMPORT;
-  else if (match(lexer->token, TOKEN_LOAD))
-    lexer->token.type = T_LOAD;
-  else if (match(lexer->token, TOKEN_NIL))
-    lexer->token.type = T_NIL;
-  else
-    lexer->token.type = T_IDENTIFIER;
+  lexer->token.type = keyword_type(lexer->token.string, lexer->token.length);
+  if (lexer->token.type == T_IDENTIFIER) {
+    lexer->token.symbol = intern_index(lexer->symbols, lexer->token.string, lexer->token.length);
+    if (lexer->token.symbol < 0) {
+      lexerror("Failed to store identifier\n");
+      lexer->token.type = T_EOF;
+    }
+  }
   return lexer->token;
 }
 
@@ -110,7 +238,7 @@ struct Token next_token(struct Lexer* lexer) {
   for (;;) {
 begin_loop:
     next(lexer);
-    char ch = *lexer->token.string;
+    char ch = lexer->token.string < lexer->end ? *lexer->token.string : '\0';
     switch (ch) {
       case '\n':
       case '\r':
@@ -123,14 +251,13 @@ begin_loop:
       case '\t':
       case '\v':
       case '\f':
+        skip(lexer, span_blank(lexer->index, lexer->end));
         break;
 
       // Shebang!
       case '#': {
-        if (*lexer->index == '!') {
-          next(lexer);
-          while (!endofline(lexer) && *lexer->index != '\0')
-            next(lexer);
+        if (peek(lexer) == '!') {
+          skip(lexer, scan_until(lexer->index, lexer->end, '\n', '\r'));
           break;
         }
         lexerror("Invalid token\n");
@@ -153,48 +280,40 @@ begin_loop:
       case '"':
       case '\'': {
         char to_match = ch;
-        while (1) {
-          if ((*lexer->index) == '\0') {
-            lexerror("Unfinished string; missing terminating character (%c)\n", to_match);
-            break;
-          }
-          if ((*lexer->index) == to_match) {
-            break;
-          }
-          lexer->index++;
-          lexer->count++;
-        }
+        skip(lexer, scan_until(lexer->index, lexer->end, to_match, to_match));
         lexer->token.string++;
         lexer->token.length = lexer->index - lexer->token.string;
         lexer->token.type = T_STRING;
-        lexer->index++;
+        if (lexer->index == lexer->end)
+          lexerror("Unfinished string; missing terminating character (%c)\n", to_match);
+        else
+          lexer->index++;
         return lexer->token;
       }
 
       case '/': {
-        if (*lexer->index == '/') { // Single line comment
-          next(lexer);
-          while (!endofline(lexer) && *lexer->index != '\0')
-            next(lexer);
+        if (peek(lexer) == '/') { // Single line comment
+          skip(lexer, scan_until(lexer->index, lexer->end, '\n', '\r'));
           break;
         }
-        else if (*lexer->index == '*') {  // Multi-line comment
-          next(lexer);
-          while (*lexer->index != '\0') {
+        else if (peek(lexer) == '*') {  // Multi-line comment
+          skip(lexer, 1);
+          for (;;) {
+            skip(lexer, scan_until(lexer->index, lexer->end, '*', '\n'));
+            if (lexer->index == lexer->end)
+              break;
             if (*lexer->index == '*') {
-              next(lexer);
-              if (*lexer->index == '/') {
-                next(lexer);
+              skip(lexer, 1);
+              if (peek(lexer) == '/') {
+                skip(lexer, 1);
                 goto begin_loop;
               }
             }
-            else if (endofline(lexer)) {
+            else {
               lexer->line++;
               lexer->count = 1;
-              next(lexer);
+              lexer->index++;
             }
-            else
-              next(lexer);
           }
           lexerror("Unfinished multi-line comment\n");
           lexer->token.type = T_EOF;  // Just to be safe
@@ -205,12 +324,12 @@ begin_loop:
       }
 
       case '<': {
-        if (*lexer->index == '=') {
+        if (peek(lexer) == '=') {
           lexer->token.type = T_LEQ;
           lexer->index++;
           return lexer->token;
         }
-        if (*lexer->index == '<') {
+        if (peek(lexer) == '<') {
           lexer->token.type = T_LEFTSHIFT;
           lexer->index++;
           return lexer->token;
@@ -220,12 +339,12 @@ begin_loop:
       }
 
       case '>': {
-        if (*lexer->index == '=') {
+        if (peek(lexer) == '=') {
           lexer->token.type = T_GEQ;
           lexer->index++;
           return lexer->token;
         }
-        if (*lexer->index == '>') {
+        if (peek(lexer) == '>') {
           lexer->token.type = T_RIGHTSHIFT;
           lexer->index++;
           return lexer->token;
@@ -239,7 +358,7 @@ begin_loop:
         return lexer->token;
 
       case '&': {
-        if (*lexer->index == '&') {
+        if (peek(lexer) == '&') {
           lexer->token.type = T_AND;
           lexer->index++;
           return lexer->token;
@@ -249,7 +368,7 @@ begin_loop:
       }
 
       case '|': {
-        if (*lexer->index == '|') {
+        if (peek(lexer) == '|') {
           lexer->token.type = T_OR;
           lexer->index++;
           return lexer->token;
@@ -263,7 +382,7 @@ begin_loop:
         return lexer->token;
 
       case '!': {
-        if (*lexer->index == '=') {
+        if (peek(lexer) == '=') {
           lexer->token.type = T_NEQ;
           lexer->index++;
           return lexer->token;
@@ -273,7 +392,7 @@ begin_loop:
       }
 
       case '=': {
-        if (*lexer->index == '=') {
+        if (peek(lexer) == '=') {
           lexer->token.type = T_EQ;
           lexer->index++;
           return lexer->token;
@@ -318,15 +437,18 @@ begin_loop:
         lexer->token.type = T_COMMA;
         return lexer->token;
 
-      case '\0':
+      case '\0':  // The end of the input, or a null character in it
+        if (lexer->token.string < lexer->end)
+          lexerror("Unexpected null character\n");
+        lexer->index = lexer->token.string;  // Stay at the end, no matter how many times we are called
         lexer->token.type = T_EOF;
         return lexer->token;
 
       default: {
-        if (is_number(ch)) {
+        if (char_is(ch, CC_DIGIT)) {
           return read_number(lexer);
         }
-        else if (is_alpha(ch) || ch == '_') {
+        else if (char_is(ch, CC_ALPHA) || ch == '_') {
           return read_symbol(lexer);
         }
         else {
@@ -346,3 +468,88 @@ struct Token get_token(struct Lexer* lexer) {
   assert(lexer != NULL);
   return lexer->token;
 }
+
+// Skip over the block that the current '{' token opens, without making tokens of what is in it
+// Strings and comments are skipped as the lexer would, so braces in them don't count
+// The matching '}' becomes the current token
+int skip_block(struct Lexer* lexer) {
+  assert(lexer != NULL);
+  assert(lexer->token.type == T_BLOCKBEGIN);
+  char* p = lexer->index;
+  const char* end = lexer->end;
+  const char* line_begin = lexer->index - lexer->count;
+  int depth = 1;
+  for (;;) {
+    while (p < end && !char_is(*p, CC_SKIP))
+      p++;
+    if (p == end)
+      goto unfinished;
+    switch (*p) {
+      case '\n':
+      case '\r':
+        lexer->line++;
+        line_begin = ++p;
+        break;
+
+      case '{':
+        depth++;
+        p++;
+        break;
+
+      case '}':
+        if (--depth == 0)
+          goto done;
+        p++;
+        break;
+
+      case '"':
+      case '\'': {
+        char to_match = *p++;
+        p += scan_until(p, end, to_match, to_match);
+        if (p == end)
+          goto unfinished;
+        p++;
+        break;
+      }
+
+      case '/':
+        p++;
+        if (p < end && *p == '/')
+          p += scan_until(p, end, '\n', '\r');
+        else if (p < end && *p == '*') {
+          p++;
+          for (;;) {
+            p += scan_until(p, end, '*', '\n');
+            if (p == end)
+              goto unfinished;
+            if (*p++ == '\n') {
+              lexer->line++;
+              line_begin = p;
+            }
+            else if (p < end && *p == '/') {
+              p++;
+              break;
+            }
+          }
+        }
+        break;
+    }
+  }
+done:
+  lexer->index = p + 1;
+  lexer->count = p - line_begin + 1;
+  lexer->token = (struct Token) {
+    .type = T_BLOCKEND,
+    .string = p,
+    .length = 0,
+    .symbol = -1,
+    .count = lexer->count,
+    .line = lexer->line,
+  };
+  return NO_ERR;
+unfinished:
+  lexer->index = p;
+  lexer->count = p - line_begin + 1;
+  lexer->token.type = T_EOF;
+  return ERR;
+}
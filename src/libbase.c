@@ -2,19 +2,25 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "si.h"
+#include "verify.h"
 
 int print_state(struct VM_state* vm, struct Scope* scope, int level) {
   if (!scope)
     return 0;
   printf("{\n");
   for (int i = 0; i < ht_get_size(&scope->var_locations); i++) {
-    const Hkey* key = ht_lookup_key(&scope->var_locations, i);
+    unsigned int length = 0;
+    const char* key = ht_lookup_key(&scope->var_locations, i, &length);
     const Hvalue* value = ht_lookup_byindex(&scope->var_locations, i);
     if (key != NULL && value != NULL) {
+      int symbol = -1;
+      memcpy(&symbol, key, sizeof(symbol));
+      const struct Interned* name = &vm->symbols.strings[symbol];
       for (int i = 0; i < level; i++) printf("  ");
-      printf("  %s: ", *key);
+      printf("  %.*s: ", name->length, name->data);
       struct Object* object = &vm->variables[*value];
       if (object->type == T_FUNCTION) {
         print_state(vm, &object->value.func.scope, level + 1);
@@ -169,7 +175,8 @@ static int base__index(struct VM_state* vm) {
     return 0;
   }
   struct Scope* scope = &arg->value.func.scope;
-  const int* found = ht_lookup(&scope->var_locations, str->value.str.data);
+  int symbol = intern_index(&vm->symbols, str->value.str.data, str->value.str.length);
+  const int* found = symbol >= 0 ? ht_lookup(&scope->var_locations, SYMBOL_KEY(symbol)) : NULL;
   if (found) {
     si_push_object(vm, vm->variables[*found]);
     return 1;
@@ -198,28 +205,174 @@ static int base_introspect_type(struct VM_state* vm) {
   return 1;
 }
 
+// reload(path)
+// Recompile the functions of the file that have changed, returns how many were compiled
+static int base_reload(struct VM_state* vm) {
+  int arg_count = si_get_argc(vm);
+  if (arg_count != 1) {
+    si_error("Missing argument\n");
+    return 0;
+  }
+  const struct Object* arg = si_get_arg(vm, 0);
+  if (arg->type != T_STRING) {
+    si_error("Invalid argument type (should be: T_STRING)\n");
+    return 0;
+  }
+  char path[PATH_LENGTH_MAX] = {0};
+  snprintf(path, PATH_LENGTH_MAX, "%.*s", arg->value.str.length, arg->value.str.data);
+  int reloaded = 0;
+  if (vm_reload(vm, path, &reloaded) != NO_ERR)
+    return 0;
+  si_push_number(vm, reloaded);
+  return 1;
+}
+
+#if defined(TEST_BUILTINS)
+// Builtins that only the tests use, to make the files they need and to run the verifier on code
+// that the compiler wouldn't emit
+
+// Write the arguments after the path to the file, opened with 'mode'
+// Strings are written with the same escape sequences as printf, numbers as print would show them
+static int write_file(struct VM_state* vm, const char* mode) {
+  int arg_count = si_get_argc(vm);
+  if (arg_count < 1) {
+    si_error("Missing argument\n");
+    return 0;
+  }
+  const struct Object* arg = si_get_arg(vm, 0);
+  if (arg->type != T_STRING) {
+    si_error("Invalid argument type (should be: T_STRING)\n");
+    return 0;
+  }
+  char path[PATH_LENGTH_MAX] = {0};
+  snprintf(path, PATH_LENGTH_MAX, "%.*s", arg->value.str.length, arg->value.str.data);
+  FILE* file = fopen(path, mode);
+  if (!file) {
+    si_error("Failed to open file '%s'\n", path);
+    return 0;
+  }
+  for (int i = 1; i < arg_count; i++) {
+    arg = si_get_arg(vm, i);
+    if (arg->type == T_NUMBER) {
+      fprintf(file, "%.10g", arg->value.number);
+      continue;
+    }
+    if (arg->type != T_STRING) {
+      si_error("Invalid argument type (should be: T_STRING or T_NUMBER)\n");
+      break;
+    }
+    const char* string = arg->value.str.data;
+    for (int c = 0; c < arg->value.str.length; c++) {
+      if (string[c] != '\\' || c + 1 >= arg->value.str.length) {
+        fputc(string[c], file);
+        continue;
+      }
+      switch (string[++c]) {
+        case 'n':
+          fputc('\n', file);
+          break;
+        case 't':
+          fputc('\t', file);
+          break;
+        default:
+          fputc(string[c], file);
+          break;
+      }
+    }
+  }
+  fclose(file);
+  return 0;
+}
+
+// file_write(path, ...)
+// Replace the contents of the file with the rest of the arguments
+static int base_file_write(struct VM_state* vm) {
+  return write_file(vm, "w");
+}
+
+// file_append(path, ...)
+static int base_file_append(struct VM_state* vm) {
+  return write_file(vm, "a");
+}
+
+// verify_bytecode(list)
+// Verify code given as instruction names, each followed by its operand (if it takes one), as if it
+// was global code. Any other number is added as a byte, so that broken code can be made as well.
+// Returns 1 if the verifier accepts the code
+static int base_verify_bytecode(struct VM_state* vm) {
+  int arg_count = si_get_argc(vm);
+  if (arg_count != 1) {
+    si_error("Missing argument\n");
+    return 0;
+  }
+  const struct Object* arg = si_get_arg(vm, 0);
+  if (arg->type != T_LIST) {
+    si_error("Object is not a list\n");
+    return 0;
+  }
+  const struct List* list = arg->value.list;
+  Instruction* code = NULL;
+  int size = 0;
+  int capacity = 0;
+  int status = NO_ERR;
+  for (int i = 0; i < list->length && status == NO_ERR; i++) {
+    const struct Object* item = &list->data[i];
+    if (item->type == T_NUMBER) {
+      list_push(code, size, capacity, (Instruction)item->value.number);
+      continue;
+    }
+    int op = item->type == T_STRING ? vm_instruction(item->value.str.data, item->value.str.length) : I_UNKNOWN;
+    if (op == I_UNKNOWN) {
+      si_error("Invalid instruction name\n");
+      status = ERR;
+      break;
+    }
+    if (compile_get_ins_arg_count(op) == 0 || i + 1 >= list->length || list->data[i + 1].type != T_NUMBER) {
+      list_push(code, size, capacity, op);
+      continue;
+    }
+    int operand = (int)list->data[++i].value.number;
+    int operand_size = ARG_SIZE;
+    if (operand < ARG_MIN_16 || operand > ARG_MAX_16) {
+      list_push(code, size, capacity, I_WIDE);
+      operand_size = ARG_SIZE_WIDE;
+    }
+    else if (operand < ARG_MIN || operand > ARG_MAX) {
+      list_push(code, size, capacity, I_WIDE16);
+      operand_size = ARG_SIZE_16;
+    }
+    list_push(code, size, capacity, op);
+    for (int b = 0; b < operand_size; b++)
+      list_push(code, size, capacity, (Instruction)(((unsigned int)operand >> (b * 8)) & 0xff));
+  }
+  if (status == NO_ERR)
+    si_push_number(vm, verify_code(vm, code, size) == NO_ERR);
+  list_free(code, size, capacity);
+  return status == NO_ERR;
+}
+#endif
+
 // list(...)
 // TODO(lucas): Need to have a way of passing references to variables in functions!
 static int base_list(struct VM_state* vm) {
   int arg_count = si_get_argc(vm);
   struct Object object = (struct Object) {
-    .value.list = mmalloc(sizeof(struct List)),
+    .value.list = gc_new_list(vm, arg_count),
     .type = T_LIST
   };
-  object.value.list->data = NULL;
-  object.value.list->length = 0;
-
+  if (!object.value.list)
+    return 0;
   for (int i = 0; i < arg_count; i++) {
     struct Object* item = si_get_arg(vm, i);
     assert(item);
-    list_push(object.value.list->data, object.value.list->length, *item);
+    list_push(object.value.list->data, object.value.list->length, object.value.list->capacity, *item);
+    gc_barrier(vm, &object.value.list->gc, item);
   }
   si_push_object(vm, object);
   return 1;
 }
 
-// NOTE(lucas): We are freeing the list, not the contents of the list
-// NOTE(lucas): Be sure to not use the list after you have free'd it. Also do free it, ya know.
+// The items of the list are released right away, the list itself once nothing refers to it anymore
 static int base_list_free(struct VM_state* vm) {
   int arg_count = si_get_argc(vm);
   if (arg_count != 1) {
@@ -232,8 +385,10 @@ static int base_list_free(struct VM_state* vm) {
     return 0;
   }
   assert(arg->value.list != NULL);
-  list_free(arg->value.list->data, arg->value.list->length);
-  mfree(arg->value.list, 1);
+  if (arg->value.list->region)  // Released when the function returns
+    return 0;
+  list_free(arg->value.list->data, arg->value.list->length, arg->value.list->capacity);
+  gc_resize(vm, &arg->value.list->gc);
   return 0;
 }
 
@@ -249,7 +404,8 @@ static int base_list_empty(struct VM_state* vm) {
     return 0;
   }
   assert(arg->value.list != NULL);
-  list_free(arg->value.list->data, arg->value.list->length);
+  list_free(arg->value.list->data, arg->value.list->length, arg->value.list->capacity);
+  gc_resize(vm, &arg->value.list->gc);
   return 0;
 }
 
@@ -266,11 +422,14 @@ static int base_list_push(struct VM_state* vm) {
     return 0;
   }
   struct List* list = arg->value.list;
-  list_push(list->data, list->length, *item);
+  int capacity = list->capacity;
+  list_push(list->data, list->length, list->capacity, *item);
+  gc_barrier(vm, &list->gc, item);
+  if (list->capacity != capacity)
+    gc_resize(vm, &list->gc);
   return 0;
 }
 
-// TODO(lucas): Something is iffy here, fix! It goes wrong when trying to pop lists which contains only 1 element.
 static int base_list_pop(struct VM_state* vm) {
   int arg_count = si_get_argc(vm);
   if (arg_count != 1) {
@@ -286,6 +445,11 @@ static int base_list_pop(struct VM_state* vm) {
   if (list->length > 0) {
     list_shrink(list->data, list->length, 1);
   }
+  // Give back the memory once the list is down to a quarter of its capacity
+  if (!list->region && list->length <= list->capacity / 4) {
+    list_shrink_to_fit(list->data, list->length, list->capacity);
+    gc_resize(vm, &list->gc);
+  }
   return 0;
 }
 
@@ -333,6 +497,170 @@ static int base_list_length(struct VM_state* vm) {
   return 1;
 }
 
+static struct Map* map_arg(struct VM_state* vm, int arg_count, int needed) {
+  if (arg_count < needed) {
+    si_error("Missing arguments\n");
+    return NULL;
+  }
+  struct Object* arg = si_get_arg(vm, 0);
+  if (arg->type != T_MAP) {
+    si_error("Object is not a map\n");
+    return NULL;
+  }
+  assert(arg->value.map != NULL);
+  return arg->value.map;
+}
+
+static const struct Object* map_key_arg(struct VM_state* vm) {
+  const struct Object* key = si_get_arg(vm, 1);
+  if (!map_is_valid_key(key)) {
+    si_error("Invalid key type (should be: T_NUMBER or T_STRING)\n");
+    return NULL;
+  }
+  return key;
+}
+
+// map(key, value, ...)
+static int base_map(struct VM_state* vm) {
+  int arg_count = si_get_argc(vm);
+  if (arg_count % 2 != 0) {
+    si_error("Missing value for the last key\n");
+    return 0;
+  }
+  struct Map* map = gc_new_map(vm);
+  if (!map)
+    return 0;
+  for (int i = 0; i < arg_count; i += 2) {
+    const struct Object* key = si_get_arg(vm, i);
+    if (!map_is_valid_key(key)) {
+      si_error("Invalid key type (should be: T_NUMBER or T_STRING)\n");
+      continue;
+    }
+    map_set(map, key, si_get_arg(vm, i + 1));
+    gc_barrier(vm, &map->gc, key);
+    gc_barrier(vm, &map->gc, si_get_arg(vm, i + 1));
+  }
+  gc_resize(vm, &map->gc);
+  si_push_object(vm, (struct Object) { .value.map = map, .type = T_MAP });
+  return 1;
+}
+
+// The entries of the map are released right away, the map itself once nothing refers to it anymore
+static int base_map_free(struct VM_state* vm) {
+  struct Map* map = map_arg(vm, si_get_argc(vm), 1);
+  if (map) {
+    map_clear(map);
+    gc_resize(vm, &map->gc);
+  }
+  return 0;
+}
+
+// Returns nil if there is no such key
+static int base_map_get(struct VM_state* vm) {
+  struct Map* map = map_arg(vm, si_get_argc(vm), 2);
+  const struct Object* key = map ? map_key_arg(vm) : NULL;
+  const struct Object* value = key ? map_get(map, key) : NULL;
+  if (value) {
+    si_push_object(vm, *value);
+    return 1;
+  }
+  si_push_nil(vm);
+  return 1;
+}
+
+static int base_map_set(struct VM_state* vm) {
+  struct Map* map = map_arg(vm, si_get_argc(vm), 3);
+  const struct Object* key = map ? map_key_arg(vm) : NULL;
+  if (key) {
+    map_set(map, key, si_get_arg(vm, 2));
+    gc_barrier(vm, &map->gc, key);
+    gc_barrier(vm, &map->gc, si_get_arg(vm, 2));
+    gc_resize(vm, &map->gc);
+  }
+  return 0;
+}
+
+static int base_map_has(struct VM_state* vm) {
+  struct Map* map = map_arg(vm, si_get_argc(vm), 2);
+  const struct Object* key = map ? map_key_arg(vm) : NULL;
+  si_push_number(vm, key && map_get(map, key) != NULL);
+  return 1;
+}
+
+static int base_map_del(struct VM_state* vm) {
+  struct Map* map = map_arg(vm, si_get_argc(vm), 2);
+  const struct Object* key = map ? map_key_arg(vm) : NULL;
+  if (key && map_del(map, key))
+    gc_resize(vm, &map->gc);
+  return 0;
+}
+
+static int base_map_count(struct VM_state* vm) {
+  struct Map* map = map_arg(vm, si_get_argc(vm), 1);
+  if (!map)
+    return 0;
+  si_push_number(vm, map_count(map));
+  return 1;
+}
+
+// Returns a new list with the keys (or the values) of the map, in the same order for both
+static int map_to_list(struct VM_state* vm, int keys) {
+  struct Map* map = map_arg(vm, si_get_argc(vm), 1);
+  if (!map)
+    return 0;
+  struct List* list = gc_new_list(vm, map_count(map));
+  if (!list)
+    return 0;
+  unsigned int iter = 0;
+  const struct Map_entry* entry = NULL;
+  while ((entry = map_next(map, &iter))) {
+    const struct Object* item = keys ? &entry->key : &entry->value;
+    list_push(list->data, list->length, list->capacity, *item);
+    gc_barrier(vm, &list->gc, item);
+  }
+  si_push_object(vm, (struct Object) { .value.list = list, .type = T_LIST });
+  return 1;
+}
+
+static int base_map_keys(struct VM_state* vm) {
+  return map_to_list(vm, 1);
+}
+
+static int base_map_values(struct VM_state* vm) {
+  return map_to_list(vm, 0);
+}
+
+// gc_collect()
+// Finish the collection that is under way, and then do a whole one
+static int base_gc_collect(struct VM_state* vm) {
+  gc_collect(vm);
+  return 0;
+}
+
+static int base_gc_stats(struct VM_state* vm) {
+  gc_print_stats(vm);
+  return 0;
+}
+
+// gc_budget(budget)
+// Set the number of objects that a step of the collector handles, returns the previous budget
+static int base_gc_budget(struct VM_state* vm) {
+  int arg_count = si_get_argc(vm);
+  if (arg_count != 1) {
+    si_error("Missing argument\n");
+    return 0;
+  }
+  const struct Object* arg = si_get_arg(vm, 0);
+  if (arg->type != T_NUMBER || arg->value.number < 1) {
+    si_error("Invalid argument (should be: T_NUMBER, at least 1)\n");
+    return 0;
+  }
+  unsigned int budget = vm->gc.step_budget;
+  vm->gc.step_budget = (unsigned int)arg->value.number;
+  si_push_number(vm, budget);
+  return 1;
+}
+
 static struct Lib_def baselib_funcs[] = {
   {"print", base_print},
   {"printf", base_printf},
@@ -342,7 +670,13 @@ static struct Lib_def baselib_funcs[] = {
   {"index", base_index},
   {"_index", base__index},
   {"assert", base_assert},
+  {"reload", base_reload},
   {"introspect_type", base_introspect_type},
+#if defined(TEST_BUILTINS)
+  {"file_write", base_file_write},
+  {"file_append", base_file_append},
+  {"verify_bytecode", base_verify_bytecode},
+#endif
 
   {"list", base_list},
   {"list_free", base_list_free},
@@ -352,6 +686,20 @@ static struct Lib_def baselib_funcs[] = {
   {"list_index", base_list_index},
   {"list_length", base_list_length},
 
+  {"map", base_map},
+  {"map_free", base_map_free},
+  {"map_get", base_map_get},
+  {"map_set", base_map_set},
+  {"map_has", base_map_has},
+  {"map_del", base_map_del},
+  {"map_count", base_map_count},
+  {"map_keys", base_map_keys},
+  {"map_values", base_map_values},
+
+  {"gc_collect", base_gc_collect},
+  {"gc_stats", base_gc_stats},
+  {"gc_budget", base_gc_budget},
+
   {NULL, NULL},
 };
 
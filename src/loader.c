@@ -0,0 +1,245 @@
+// loader.c
+// Parallel parsing of imported files
+//
+// Every file that is imported is a job, which is parsed into a tree of its own by whichever
+// thread gets to it first. The file that imports it gets a placeholder node instead, so parsing
+// carries on without waiting, and the imports of the imported file are queued as they are found.
+// Lexers and parsers share nothing but the loader: each job interns its identifiers in a symbol
+// table of its own, which are mapped to the vm symbols once everything has been parsed. The lock
+// is only held to queue and take jobs, and to add the sources: files are read by the job itself.
+//
+// The trees are then put together on the calling thread: the tree of each file is linked to the
+// placeholder of the first import of it (in the order the imports would have been parsed in place),
+// and compiled from there. Any other import of the same file is left empty.
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "mem.h"
+#include "list.h"
+#include "parser.h"
+#include "loader.h"
+
+static void remap_symbol(Value* value, void* data);
+static int map_symbols(struct Loader* loader, struct Import_job* job);
+static int load_job(struct Loader* loader, struct Import_job* job);
+static void run_jobs(struct Loader* loader);
+static void* worker(void* data);
+static int splice(struct Loader* loader, struct Import_arr* imports);
+static void job_free(struct Import_job* job);
+
+void remap_symbol(Value* value, void* data) {
+  const int* symbols = data;
+  if (value->type == T_IDENTIFIER)
+    value->symbol = symbols[value->symbol];
+}
+
+int map_symbols(struct Loader* loader, struct Import_job* job) {
+  unsigned int count = job->symbols.count;
+  if (count == 0)
+    return NO_ERR;
+  int* symbols = mmalloc(sizeof(int) * count);
+  if (!symbols)
+    return ALLOC_ERR;
+  for (unsigned int i = 0; i < count; i++) {
+    const struct Interned* symbol = &job->symbols.strings[i];
+    symbols[i] = intern_index(loader->symbols, symbol->data, symbol->length);
+    if (symbols[i] < 0) {
+      mfree(symbols, sizeof(int) * count);
+      return ALLOC_ERR;
+    }
+  }
+  ast_for_each_value(&job->ast, remap_symbol, symbols);
+  mfree(symbols, sizeof(int) * count);
+  return NO_ERR;
+}
+
+// Read the file without the lock held, and add it to the sources with it
+int load_job(struct Loader* loader, struct Import_job* job) {
+  int status = source_load_file(job->path, &job->source);
+  if (status != NO_ERR) {
+    error("%s: Failed to open file '%s'\n", __FUNCTION__, job->path);
+    return status;
+  }
+  pthread_mutex_lock(&loader->lock);
+  status = sources_add(loader->sources, job->path, &job->source);
+  pthread_mutex_unlock(&loader->lock);
+  return status;
+}
+
+// Must be called with the lock held
+void run_jobs(struct Loader* loader) {
+  while (loader->next_job < loader->job_count) {
+    struct Import_job* job = loader->jobs[loader->next_job++];
+    int cancelled = loader->cancelled;
+    pthread_mutex_unlock(&loader->lock);
+    int status = ERR;
+    if (!cancelled)
+      status = load_job(loader, job);
+    if (status == NO_ERR)
+      status = parser_parse_file(loader, &job->source, &job->symbols, job->path, loader->strict, &job->ast, &job->imports);
+    pthread_mutex_lock(&loader->lock);
+    job->status = status;
+    if (status != NO_ERR)
+      loader->cancelled = 1;
+    loader->jobs_done++;
+    pthread_cond_broadcast(&loader->changed);
+  }
+}
+
+void* worker(void* data) {
+  struct Loader* loader = data;
+  pthread_mutex_lock(&loader->lock);
+  for (;;) {
+    run_jobs(loader);
+    if (loader->finished)
+      break;
+    pthread_cond_wait(&loader->changed, &loader->lock);
+  }
+  pthread_mutex_unlock(&loader->lock);
+  return NULL;
+}
+
+int splice(struct Loader* loader, struct Import_arr* imports) {
+  for (unsigned int i = 0; i < imports->count; i++) {
+    struct Import* import = &imports->imports[i];
+    if (import->job < 0)
+      continue;
+    struct Import_job* job = loader->jobs[import->job];
+    assert(job->status == NO_ERR);
+    if (job->spliced)
+      continue;
+    job->spliced = 1;
+    int status = map_symbols(loader, job);
+    if (status == NO_ERR)
+      status = splice(loader, &job->imports);
+    if (status == NO_ERR)
+      status = ast_link(&import->node, &job->ast);
+    if (status != NO_ERR)
+      return status;
+  }
+  return NO_ERR;
+}
+
+void job_free(struct Import_job* job) {
+  intern_free(&job->symbols);
+  ast_free(&job->ast);
+  list_free(job->imports.imports, job->imports.count, job->imports.capacity);
+  mfree(job, sizeof(struct Import_job));
+}
+
+int loader_init(struct Loader* loader, struct Source_arr* sources, struct Module_registry* modules, struct Intern_table* symbols, int strict) {
+  assert(loader != NULL);
+  loader->strict = strict;
+  loader->sources = sources;
+  loader->modules = modules;
+  loader->symbols = symbols;
+  loader->job_lookup = ht_create_empty();
+  loader->jobs = NULL;
+  loader->job_count = 0;
+  loader->job_capacity = 0;
+  loader->next_job = 0;
+  loader->jobs_done = 0;
+  loader->cancelled = 0;
+  loader->finished = 0;
+  loader->thread_count = 0;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  loader->thread_max = cpus > 1 ? cpus - 1 : 0; // The calling thread parses as well
+  if (loader->thread_max > PARSE_THREADS_MAX)
+    loader->thread_max = PARSE_THREADS_MAX;
+  pthread_mutex_init(&loader->lock, NULL);
+  pthread_cond_init(&loader->changed, NULL);
+  return NO_ERR;
+}
+
+int loader_import(struct Loader* loader, const char* path, int* job) {
+  assert(loader != NULL && path != NULL && job != NULL);
+  char canonical[PATH_MAX] = {0};
+  *job = -1;
+  if (modules_resolve(path, canonical) != NO_ERR)
+    return ERR;
+  unsigned int length = strlen(canonical);
+  int status = NO_ERR;
+  pthread_mutex_lock(&loader->lock);
+  const Hvalue* found = ht_lookup(&loader->job_lookup, canonical, length);
+  if (found) {
+    *job = *found;
+    goto done;
+  }
+  int loaded = 0;
+  if ((status = modules_register(loader->modules, canonical, &loaded)) != NO_ERR)
+    goto done;
+  if (loaded) {
+    ht_insert_element(&loader->job_lookup, canonical, length, -1);
+    goto done;
+  }
+  struct Import_job* new_job = mmalloc(sizeof(struct Import_job));
+  if (!new_job) {
+    status = ALLOC_ERR;
+    goto done;
+  }
+  snprintf(new_job->path, PATH_LENGTH_MAX, "%s", path);  // Read by the job (see load_job)
+  intern_init(&new_job->symbols);
+  new_job->ast = ast_create();
+  new_job->imports = (struct Import_arr) { NULL, 0, 0 };
+  new_job->status = NO_ERR;
+  new_job->spliced = 0;
+  unsigned int count = loader->job_count;
+  list_push(loader->jobs, loader->job_count, loader->job_capacity, new_job);
+  if (loader->job_count == count) {
+    job_free(new_job);
+    status = ALLOC_ERR;
+    goto done;
+  }
+  ht_insert_element(&loader->job_lookup, canonical, length, count);
+  *job = count;
+  // One thread for each job that is waiting, up to the limit
+  if (loader->thread_count < loader->thread_max && loader->thread_count < loader->job_count - loader->jobs_done) {
+    if (pthread_create(&loader->threads[loader->thread_count], NULL, worker, loader) == 0)
+      loader->thread_count++;
+  }
+  pthread_cond_broadcast(&loader->changed);
+done:
+  pthread_mutex_unlock(&loader->lock);
+  return status;
+}
+
+int loader_wait(struct Loader* loader, int cancel) {
+  assert(loader != NULL);
+  pthread_mutex_lock(&loader->lock);
+  if (cancel)
+    loader->cancelled = 1;
+  for (;;) {
+    run_jobs(loader);
+    if (loader->jobs_done == loader->job_count)
+      break;
+    pthread_cond_wait(&loader->changed, &loader->lock);
+  }
+  loader->finished = 1;
+  pthread_cond_broadcast(&loader->changed);
+  pthread_mutex_unlock(&loader->lock);
+  for (unsigned int i = 0; i < loader->thread_count; i++)
+    pthread_join(loader->threads[i], NULL);
+  loader->thread_count = 0;
+  return loader->cancelled ? PARSE_ERR : NO_ERR;
+}
+
+int loader_splice(struct Loader* loader, struct Import_arr* imports) {
+  assert(loader != NULL && imports != NULL);
+  return splice(loader, imports);
+}
+
+void loader_free(struct Loader* loader) {
+  assert(loader != NULL);
+  assert(loader->thread_count == 0);
+  for (unsigned int i = 0; i < loader->job_count; i++)
+    job_free(loader->jobs[i]);
+  list_free(loader->jobs, loader->job_count, loader->job_capacity);
+  ht_free(&loader->job_lookup);
+  pthread_mutex_destroy(&loader->lock);
+  pthread_cond_destroy(&loader->changed);
+}
@@ -0,0 +1,117 @@
+// map.c
+//
+// Maps are stored in an Htable, where the key is the type of the key object and its value.
+// Strings are interned, so the string data pointer identifies the string and there is no need
+// to hash (or compare) the characters of the string.
+
+#include <assert.h>
+#include <string.h>
+
+#include "error.h"
+#include "mem.h"
+#include "token.h"
+#include "map.h"
+
+struct Map_key {
+  int type;
+  union {
+    obj_number number;
+    const char* str;
+  } value;
+};
+
+static int map_key(const struct Object* object, struct Map_key* key);
+
+int map_key(const struct Object* object, struct Map_key* key) {
+  memset(key, 0, sizeof(struct Map_key));  // Padding is part of the key
+  key->type = object->type;
+  switch (object->type) {
+    case T_NUMBER:
+      key->value.number = object->value.number + 0.0;  // -0 and 0 are the same key
+      return 1;
+    case T_STRING:
+      key->value.str = object->value.str.data;
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+void map_init(struct Map* map) {
+  assert(map != NULL);
+  map->table = ht_create_empty_of(sizeof(struct Map_entry));
+}
+
+int map_is_valid_key(const struct Object* key) {
+  assert(key != NULL);
+  return key->type == T_NUMBER || key->type == T_STRING;
+}
+
+struct Object* map_get(struct Map* map, const struct Object* key) {
+  assert(map != NULL && key != NULL);
+  struct Map_key k;
+  if (!map_key(key, &k))
+    return NULL;
+  struct Map_entry* entry = ht_lookup(&map->table, (const char*)&k, sizeof(k));
+  return entry ? &entry->value : NULL;
+}
+
+int map_set(struct Map* map, const struct Object* key, const struct Object* value) {
+  assert(map != NULL && key != NULL && value != NULL);
+  struct Map_key k;
+  if (!map_key(key, &k))
+    return ERR;
+  struct Map_entry* entry = ht_lookup(&map->table, (const char*)&k, sizeof(k));
+  if (entry) {
+    entry->value = *value;
+    return NO_ERR;
+  }
+  struct Map_entry new_entry = {
+    .key = *key,
+    .value = *value,
+  };
+  if (!ht_insert(&map->table, (const char*)&k, sizeof(k), &new_entry))
+    return ALLOC_ERR;
+  return NO_ERR;
+}
+
+int map_del(struct Map* map, const struct Object* key) {
+  assert(map != NULL && key != NULL);
+  struct Map_key k;
+  if (!map_key(key, &k))
+    return 0;
+  ht_remove_element(&map->table, (const char*)&k, sizeof(k));
+  return ht_shrink(&map->table);
+}
+
+unsigned int map_count(const struct Map* map) {
+  assert(map != NULL);
+  return ht_num_elements(&map->table);
+}
+
+const struct Map_entry* map_next(const struct Map* map, unsigned int* iter) {
+  assert(map != NULL && iter != NULL);
+  while (*iter < ht_get_size(&map->table)) {
+    const struct Map_entry* entry = ht_lookup_byindex(&map->table, (*iter)++);
+    if (entry)
+      return entry;
+  }
+  return NULL;
+}
+
+unsigned int map_size(const struct Map* map) {
+  assert(map != NULL);
+  return sizeof(struct Map) + ht_get_size(&map->table) * (sizeof(struct Map_key) + sizeof(struct Map_entry));
+}
+
+void map_clear(struct Map* map) {
+  assert(map != NULL);
+  ht_free(&map->table);
+  map_init(map);
+}
+
+void map_free(struct Map* map) {
+  assert(map != NULL);
+  ht_free(&map->table);
+  mfree(map, sizeof(struct Map));
+}
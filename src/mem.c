@@ -10,9 +10,10 @@
 
 #if defined(TRACK_MEMORY)
 
+// Memory is allocated from the parser threads as well, see loader.c
 #define mem_info_update(add_total, add_count) \
-info.alloc_total += add_total; \
-info.alloc_count += add_count
+__atomic_fetch_add(&info.alloc_total, add_total, __ATOMIC_RELAXED); \
+__atomic_fetch_add(&info.alloc_count, add_count, __ATOMIC_RELAXED)
 
 struct Memory_info {
   int alloc_total;
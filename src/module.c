@@ -0,0 +1,100 @@
+// module.c
+// Module registry
+//
+// Files are identified by their canonical path, so the same file imported through different
+// relative paths (or symlinks) is still only loaded once. A file that has been modified since it
+// was loaded (a different size or modification time) is loaded again.
+//
+// A file is registered as soon as it's found, before it has been parsed, so that it isn't loaded
+// twice when it's imported more than once. Until the code that imported it has compiled, the file
+// is pending: if anything fails to load, all pending files are forgotten and loaded again the next
+// time, instead of being taken for loaded without their code ever having been compiled.
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "error.h"
+#include "mem.h"
+#include "list.h"
+#include "module.h"
+
+static void pending_free(struct Module_registry* registry);
+
+void modules_init(struct Module_registry* registry) {
+  assert(registry != NULL);
+  registry->modules = ht_create_empty_of(sizeof(struct Module));
+  registry->pending = NULL;
+  registry->pending_count = 0;
+  registry->pending_capacity = 0;
+}
+
+void pending_free(struct Module_registry* registry) {
+  for (unsigned int i = 0; i < registry->pending_count; i++)
+    mfree(registry->pending[i], strlen(registry->pending[i]) + 1);
+  registry->pending_count = 0;
+}
+
+int modules_resolve(const char* path, char* canonical) {
+  assert(path != NULL && canonical != NULL);
+  return realpath(path, canonical) ? NO_ERR : ERR;
+}
+
+int modules_register(struct Module_registry* registry, const char* canonical, int* loaded) {
+  assert(registry != NULL && canonical != NULL && loaded != NULL);
+  struct stat st;
+  *loaded = 0;
+  if (stat(canonical, &st) != 0)
+    return ERR;
+  struct Module module = {
+    .size = st.st_size,
+    .mtime_sec = st.st_mtim.tv_sec,
+    .mtime_nsec = st.st_mtim.tv_nsec,
+  };
+  unsigned int length = strlen(canonical);
+  struct Module* found = ht_lookup(&registry->modules, canonical, length);
+  if (found && found->size == module.size && found->mtime_sec == module.mtime_sec && found->mtime_nsec == module.mtime_nsec) {
+    *loaded = 1;
+    return NO_ERR;
+  }
+  char* path = mmalloc(length + 1);
+  if (!path)
+    return ALLOC_ERR;
+  memcpy(path, canonical, length + 1);
+  unsigned int count = registry->pending_count;
+  list_push(registry->pending, registry->pending_count, registry->pending_capacity, path);
+  if (registry->pending_count == count) {
+    mfree(path, length + 1);
+    return ALLOC_ERR;
+  }
+  if (found)
+    *found = module;
+  else if (!ht_insert(&registry->modules, canonical, length, &module))
+    return ALLOC_ERR;
+  return NO_ERR;
+}
+
+void modules_forget(struct Module_registry* registry, const char* canonical) {
+  assert(registry != NULL && canonical != NULL);
+  ht_remove_element(&registry->modules, canonical, strlen(canonical));
+}
+
+void modules_commit(struct Module_registry* registry) {
+  assert(registry != NULL);
+  pending_free(registry);
+}
+
+void modules_rollback(struct Module_registry* registry) {
+  assert(registry != NULL);
+  for (unsigned int i = 0; i < registry->pending_count; i++)
+    modules_forget(registry, registry->pending[i]);
+  pending_free(registry);
+}
+
+void modules_free(struct Module_registry* registry) {
+  assert(registry != NULL);
+  pending_free(registry);
+  list_free(registry->pending, registry->pending_count, registry->pending_capacity);
+  ht_free(&registry->modules);
+}
@@ -10,8 +10,9 @@
 #include "vm.h"
 #include "token.h"
 #include "str.h"
-#include "strarr.h"
+#include "intern.h"
 #include "object.h"
+#include "map.h"
 
 struct Object token_to_object(struct VM_state* vm, struct Token token) {
 	struct Object object = { .type = token.type };
@@ -21,15 +22,10 @@ struct Object token_to_object(struct VM_state* vm, struct Token token) {
 			break;
 
     case T_STRING: {
-      // NOTE(lucas): We are doing a string copy here and in the strarr_append function too.
-      char* copy = string_new_copy(token.string, token.length);
-      int length = token.length;
-      strarr_append(&vm->buffers, copy);
-      char* top = strarr_top(&vm->buffers);
-      assert(top != NULL);
-      object.value.str.data = top;
-      object.value.str.length = length;
-      string_nfree(copy, length);
+      const struct Interned* interned = intern_string(&vm->strings, token.string, token.length);
+      assert(interned != NULL);
+      object.value.str.data = interned->data;
+      object.value.str.length = interned->length;
       break;
     }
 
@@ -61,12 +57,14 @@ int func_init(struct Function* func) {
 int func_init_with_parent_scope(struct Function* func, struct Scope* parent) {
   assert(func != NULL);
   func->addr = 0;
+  func->lazy = -1;
   return scope_init(&func->scope, parent);
 }
 
 int scope_init(struct Scope* scope, struct Scope* parent) {
 	assert(scope != NULL);
 	scope->constants_count = 0;
+	scope->constants_capacity = 0;
 	scope->constants = NULL;
 	scope->var_locations = ht_create_empty();
 	scope->parent = parent;
@@ -75,7 +73,7 @@ int scope_init(struct Scope* scope, struct Scope* parent) {
 
 int scope_free(struct Scope* scope) {
 	assert(scope != NULL);
-	mfree(scope->constants, scope->constants_count * sizeof(struct Object));
+	list_free(scope->constants, scope->constants_count, scope->constants_capacity);
 	ht_free(&scope->var_locations);
 	return NO_ERR;
 }
@@ -119,6 +117,10 @@ void object_print(const struct Object* object) {
 			printf(COLOR_TYPE "[List] " COLOR_NONE "(of length: %i)", object->value.list->length);
 			break;
 
+		case T_MAP:
+			printf(COLOR_TYPE "[Map] " COLOR_NONE "(of count: %u)", map_count(object->value.map));
+			break;
+
 		default:
 			printf(COLOR_TYPE "[Undefined]" COLOR_NONE);
 			break;
@@ -152,6 +154,10 @@ void object_print_raw(const struct Object* object) {
       printf("[List] (of length: %i)", object->value.list->length);
       break;
 
+    case T_MAP:
+      printf("[Map] (of count: %u)", map_count(object->value.map));
+      break;
+
     default:
       printf("[Undefined]");
       break;
@@ -176,6 +182,9 @@ inline int object_checktrue(const struct Object* object) {
     case T_LIST:
       return object->value.list->length != 0;
 
+    case T_MAP:
+      return map_count(object->value.map) != 0;
+
     default:
       assert(0);
       return 0;
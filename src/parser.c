@@ -7,12 +7,13 @@
 
 #include "config.h"
 #include "file.h"
-#include "strarr.h"
+#include "list.h"
 #include "token.h"
 #include "ast.h"
 #include "lexer.h"
 #include "error.h"
 #include "parser.h"
+#include "loader.h"
 
 #define parseerror(fmt, ...) \
   (error("%s:%i:%i: " COLOR_ERROR "parse-error: " COLOR_NONE fmt, p->lexer->filename, p->lexer->line, p->lexer->count, ##__VA_ARGS__))
@@ -22,16 +23,15 @@ struct Parser {
   Ast* ast;
   int status;
   int loop; // Are we in a loop block?
-  struct Str_arr* str_arr;
-};
-
-struct Operator {
-  int left, right;
+  int depth;  // Number of function bodies we are in
+  int strict; // Parse function bodies right away, instead of skipping them (see funcstat)
+  struct Loader* loader;
+  struct Import_arr* imports;  // Placeholders of the files imported by this file
 };
 
 // Warning: Order is reserved. DO NOT CHANGE.
 // See enum Token_types in token.h for the order
-static const struct Operator op_priority[] = {
+const struct Operator op_priority[] = {
   {0, 0}, // T_UNKNOWN
   {10, 10}, {10, 10}, // '+', '-'
   {11, 11}, {11, 11}, // '*', '/'
@@ -42,13 +42,10 @@ static const struct Operator op_priority[] = {
   {6, 6}, {4, 4}, {5, 5}, // '&', '|', '^'
   {7, 7}, {7, 7}, // '<<', '>>'
   {2, 2}, {1, 1}, // '&&', '||'
+  {1, 1}, // T_OR, every binary operator needs an entry
 };
 
-#define UNARY_PRIORITY 12
-
 static int add_current_token(struct Parser* p);
-static int get_binop(struct Token token);
-static int get_uop(struct Token token);
 static int block_end(struct Parser* p);
 static int expect(struct Parser* p, enum Token_types expected_type);
 static void check(struct Parser* p, enum Token_types type);
@@ -69,6 +66,7 @@ static int statements(struct Parser* p);
 static int postfix_expr(struct Parser* p);
 static int simple_expr(struct Parser* p);
 static int expr(struct Parser* p, int priority);
+static int finish_imports(struct Loader* loader, struct Import_arr* imports, int status);
 
 // Add current token to ast and move on the the next one
 int add_current_token(struct Parser* p) {
@@ -217,7 +215,9 @@ int returnstat(struct Parser* p) {
 }
 
 // import filename
+// The imported file is parsed separately (see loader.c), a placeholder for it is added to the tree
 int importstat(struct Parser* p) {
+  struct Token import_node = get_token(p->lexer);
   struct Token token = next_token(p->lexer);
   next_token(p->lexer);
   if (token.type != T_STRING) {
@@ -226,14 +226,22 @@ int importstat(struct Parser* p) {
   }
   char path[PATH_LENGTH_MAX] = {0};
   snprintf(path, PATH_LENGTH_MAX, "%.*s", token.length, token.string);
-  char* input = read_file(path);
-  if (!input) {
+  int job = -1;
+  if (loader_import(p->loader, path, &job) != NO_ERR) {
     parseerror("'%s': No such file\n", path);
     return p->status = PARSE_ERR;
   }
-  int status = parser_parse(input, p->str_arr, path, p->ast);
-  free(input);
-  return status;
+  if (ast_add_node(p->ast, import_node) != NO_ERR)
+    return p->status = ALLOC_ERR;
+  struct Import import = {
+    .node = ast_get_last(p->ast),
+    .job = job,
+  };
+  unsigned int count = p->imports->count;
+  list_push(p->imports->imports, p->imports->count, p->imports->capacity, import);
+  if (p->imports->count == count)
+    return p->status = ALLOC_ERR;
+  return NO_ERR;
 }
 
 int loadstat(struct Parser* p) {
@@ -295,6 +303,10 @@ int arglist(struct Parser* p, int* num_args) {
 //  \--> ( parameter list )
 // T_BLOCK
 //  \--> { BLOCK }
+//
+// Unless we are in strict mode, the bodies of functions outside of other functions are only
+// scanned for the closing brace. They are added as a T_DEFERRED token spanning the body, and are
+// parsed once they are compiled (see parser_parse_body).
 int funcstat(struct Parser* p) {
   Ast* orig_branch = p->ast;
   add_current_token(p); // Add and skip 'fn'
@@ -320,12 +332,26 @@ int funcstat(struct Parser* p) {
     parseerror("Expected '{'\n");
     return p->status = PARSE_ERR;
   }
+  if (!p->strict && p->depth == 0) {
+    struct Token body = get_token(p->lexer);
+    if (skip_block(p->lexer) != NO_ERR) {
+      parseerror("Expected '}' block end\n");
+      return p->status = PARSE_ERR;
+    }
+    body.type = T_DEFERRED;
+    body.length = p->lexer->index - body.string;
+    ast_add_node(orig_branch, body);
+    next_token(p->lexer); // Skip '}'
+    return NO_ERR;
+  }
   next_token(p->lexer); // Skip '{'
   struct Token block_begin = { .type = T_BLOCK };
   ast_add_node(orig_branch, block_begin);
   Ast block_branch = ast_get_last(orig_branch);
   p->ast = &block_branch;
+  p->depth++;
   block(p);
+  p->depth--;
   p->ast = orig_branch;
   return NO_ERR;
 }
@@ -560,27 +586,80 @@ int expr(struct Parser* p, int priority) {
   return op;
 }
 
-int parser_parse(char* input, struct Str_arr* str_arr, const char* filename, Ast* ast) {
-  strarr_append(str_arr, input);
+int parser_parse_file(struct Loader* loader, const struct Source* source, struct Intern_table* symbols, const char* filename, int strict, Ast* ast, struct Import_arr* imports) {
   struct Lexer lexer = {
-    .index = &strarr_top(str_arr)[0],
+    .index = source->data,
+    .end = source->data + source->size,
     .line = 1,
     .count = 0,
     .token = (struct Token) {0},
     .filename = filename,
+    .symbols = symbols,
   };
-#if 0
-  printf("Parsing file: %s, index: %i\n", filename, str_arr->count);
-#endif
   struct Parser parser = {
     .lexer = &lexer,
     .ast = ast,
     .status = NO_ERR,
     .loop = 0,
-    .str_arr = str_arr
+    .depth = 0,
+    .strict = strict,
+    .loader = loader,
+    .imports = imports,
   };
   next_token(parser.lexer);
   statements(&parser);
   check(&parser, T_EOF);
   return parser.status;
 }
+
+// Wait for the imported files to be parsed, and link their trees to the tree that imported them
+int finish_imports(struct Loader* loader, struct Import_arr* imports, int status) {
+  if (loader_wait(loader, status != NO_ERR) != NO_ERR && status == NO_ERR)
+    status = PARSE_ERR;
+  if (status == NO_ERR)
+    status = loader_splice(loader, imports);
+  list_free(imports->imports, imports->count, imports->capacity);
+  loader_free(loader);
+  return status;
+}
+
+int parser_parse(const struct Source* source, struct Source_arr* sources, struct Module_registry* modules, struct Intern_table* symbols, const char* filename, int strict, Ast* ast) {
+  struct Loader loader;
+  loader_init(&loader, sources, modules, symbols, strict);
+  struct Import_arr imports = { NULL, 0, 0 };
+  int status = parser_parse_file(&loader, source, symbols, filename, strict, ast, &imports);
+  return finish_imports(&loader, &imports, status);
+}
+
+int parser_parse_body(const struct Source* source, struct Source_arr* sources, struct Module_registry* modules, struct Intern_table* symbols, const struct Token* body, int strict, Ast* ast) {
+  assert(body->type == T_DEFERRED);
+  struct Loader loader;
+  loader_init(&loader, sources, modules, symbols, strict);
+  struct Import_arr imports = { NULL, 0, 0 };
+  struct Lexer lexer = {
+    .index = body->string,
+    .end = source->data + source->size,
+    .line = body->line,
+    .count = body->count - 1,
+    .token = (struct Token) {0},
+    .filename = source->name,
+    .symbols = symbols,
+  };
+  struct Parser parser = {
+    .lexer = &lexer,
+    .ast = ast,
+    .status = NO_ERR,
+    .loop = 0,
+    .depth = 1,
+    .strict = 1,
+    .loader = &loader,
+    .imports = &imports,
+  };
+  next_token(parser.lexer);
+  check(&parser, T_BLOCKBEGIN);
+  if (parser.status == NO_ERR) {
+    next_token(parser.lexer); // Skip '{'
+    block(&parser);
+  }
+  return finish_imports(&loader, &imports, parser.status);
+}
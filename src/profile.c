@@ -0,0 +1,140 @@
+// profile.c
+// Branch profiles, recorded while a program runs and used to guide the next compile
+//
+// Branch sites are identified by the order they are compiled in, which stays the same
+// for the same source no matter how the code ends up being laid out.
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "error.h"
+#include "mem.h"
+#include "list.h"
+#include "profile.h"
+
+#define PROFILE_HEADER "si-profile 1"
+
+void profile_init(struct Profile* profile) {
+  assert(profile != NULL);
+  profile->sites = NULL;
+  profile->site_count = 0;
+  profile->site_capacity = 0;
+  profile->counts = NULL;
+  profile->counts_size = 0;
+  profile->input = NULL;
+  profile->input_count = 0;
+  profile->recording = 0;
+}
+
+int profile_load(struct Profile* profile, const char* path) {
+  assert(profile != NULL);
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    error("%s: Failed to open profile '%s'\n", __FUNCTION__, path);
+    return ERR;
+  }
+  char header[32] = {0};
+  unsigned int count = 0;
+  if (!fgets(header, sizeof(header), file) || strncmp(header, PROFILE_HEADER, strlen(PROFILE_HEADER)) != 0 || fscanf(file, "%u", &count) != 1) {
+    error("%s: '%s' is not a valid profile\n", __FUNCTION__, path);
+    fclose(file);
+    return ERR;
+  }
+  struct Branch_count* input = mcalloc(sizeof(struct Branch_count), count + 1);
+  if (!input) {
+    fclose(file);
+    return ALLOC_ERR;
+  }
+  for (unsigned int i = 0; i < count; i++) {
+    int kind = 0;
+    if (fscanf(file, "%i %lu %lu", &kind, &input[i].executed, &input[i].taken) != 3) {
+      error("%s: '%s' is not a valid profile\n", __FUNCTION__, path);
+      mfree(input, sizeof(struct Branch_count) * (count + 1));
+      fclose(file);
+      return ERR;
+    }
+  }
+  fclose(file);
+  mfree(profile->input, sizeof(struct Branch_count) * (profile->input_count + 1));
+  profile->input = input;
+  profile->input_count = count;
+  return NO_ERR;
+}
+
+int profile_save(struct Profile* profile, const char* path) {
+  assert(profile != NULL);
+  FILE* file = fopen(path, "w");
+  if (!file) {
+    error("%s: Failed to open file '%s'\n", __FUNCTION__, path);
+    return ERR;
+  }
+  fprintf(file, "%s\n%u\n", PROFILE_HEADER, profile->site_count);
+  for (unsigned int i = 0; i < profile->site_count; i++) {
+    const struct Branch_site* site = &profile->sites[i];
+    struct Branch_count count = {0, 0};
+    int addrs[] = { site->addr, site->back_edge };
+    for (int j = 0; j < 2; j++) {
+      if (addrs[j] >= 0 && addrs[j] < profile->counts_size) {
+        count.executed += profile->counts[addrs[j]].executed;
+        count.taken += profile->counts[addrs[j]].taken;
+      }
+    }
+    fprintf(file, "%i %lu %lu\n", site->kind, count.executed, count.taken);
+  }
+  fclose(file);
+  return NO_ERR;
+}
+
+// Returns the site id
+int profile_add_site(struct Profile* profile, int kind) {
+  struct Branch_site site = {
+    .kind = kind,
+    .addr = -1,
+    .back_edge = -1,
+  };
+  list_push(profile->sites, profile->site_count, profile->site_capacity, site);
+  return profile->site_count - 1;
+}
+
+void profile_set_site_addr(struct Profile* profile, int site, int addr, int back_edge) {
+  assert(site >= 0 && site < profile->site_count);
+  profile->sites[site].addr = addr;
+  profile->sites[site].back_edge = back_edge;
+}
+
+int profile_is_hot_loop(const struct Profile* profile, int site) {
+  if (site < 0 || site >= profile->input_count)
+    return 0;
+  const struct Branch_count* count = &profile->input[site];
+  unsigned long entries = count->executed - count->taken; // The loop condition is false once per entry (unless we break out of it)
+  if (count->taken < PROFILE_HOT_LOOP_MIN)
+    return 0;
+  return count->taken >= entries * PROFILE_HOT_LOOP_ITERATIONS;
+}
+
+void profile_branch(struct Profile* profile, int addr, int taken) {
+  assert(addr >= 0);
+  if (addr >= profile->counts_size) {
+    unsigned int new_size = addr * 2 + 1;
+    struct Branch_count* counts = profile->counts ?
+      mrealloc(profile->counts, sizeof(struct Branch_count) * profile->counts_size, sizeof(struct Branch_count) * new_size) :
+      mmalloc(sizeof(struct Branch_count) * new_size);
+    if (!counts)
+      return;
+    memset(&counts[profile->counts_size], 0, sizeof(struct Branch_count) * (new_size - profile->counts_size));
+    profile->counts = counts;
+    profile->counts_size = new_size;
+  }
+  profile->counts[addr].executed++;
+  profile->counts[addr].taken += taken != 0;
+}
+
+void profile_free(struct Profile* profile) {
+  assert(profile != NULL);
+  list_free(profile->sites, profile->site_count, profile->site_capacity);
+  mfree(profile->counts, sizeof(struct Branch_count) * profile->counts_size);
+  mfree(profile->input, sizeof(struct Branch_count) * (profile->input_count + 1));
+  profile_init(profile);
+}
@@ -0,0 +1,96 @@
+// region.c
+// Bump allocator for values that live as long as a function frame
+//
+// Memory is handed out from a chain of blocks. Everything allocated after a mark is released at once
+// by resetting the region to that mark; the blocks are kept around for reuse.
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "mem.h"
+#include "region.h"
+
+#define REGION_ALIGN(size) (((size) + 7) & ~7u)
+
+static void block_free(struct Region_block* block);
+
+void block_free(struct Region_block* block) {
+  mfree(block, sizeof(struct Region_block) + block->size);
+}
+
+void region_init(struct Region* region) {
+  assert(region != NULL);
+  region->head = NULL;
+  region->free_blocks = NULL;
+}
+
+void* region_alloc(struct Region* region, unsigned int size) {
+  assert(region != NULL);
+  size = REGION_ALIGN(size);
+  struct Region_block* block = region->head;
+  if (!block || block->used + size > block->size) {
+    block = region->free_blocks;
+    if (block) {
+      region->free_blocks = block->prev;
+      if (block->size < size) {
+        block_free(block);
+        block = NULL;
+      }
+    }
+    if (!block) {
+      unsigned int block_size = size > REGION_BLOCK_SIZE ? size : REGION_BLOCK_SIZE;
+      block = mmalloc(sizeof(struct Region_block) + block_size);
+      if (!block)
+        return NULL;
+      block->size = block_size;
+    }
+    block->used = 0;
+    block->prev = region->head;
+    region->head = block;
+  }
+  void* pointer = &block->data[block->used];
+  block->used += size;
+  return pointer;
+}
+
+struct Region_mark region_get_mark(const struct Region* region) {
+  struct Region_mark mark = {
+    .block = region->head,
+    .used = region->head ? region->head->used : 0,
+  };
+  return mark;
+}
+
+// Release everything that was allocated after 'mark'
+void region_reset(struct Region* region, struct Region_mark mark) {
+  while (region->head != mark.block) {
+    struct Region_block* block = region->head;
+    assert(block != NULL);
+    region->head = block->prev;
+    block->prev = region->free_blocks;
+    region->free_blocks = block;
+  }
+  if (region->head)
+    region->head->used = mark.used;
+}
+
+// Does 'pointer' lie in memory that is still allocated from the region?
+int region_contains(const struct Region* region, const void* pointer) {
+  assert(region != NULL);
+  const unsigned char* p = pointer;
+  for (const struct Region_block* block = region->head; block; block = block->prev) {
+    if (p >= block->data && p < block->data + block->used)
+      return 1;
+  }
+  return 0;
+}
+
+void region_free(struct Region* region) {
+  assert(region != NULL);
+  region_reset(region, (struct Region_mark) { .block = NULL, .used = 0 });
+  while (region->free_blocks) {
+    struct Region_block* block = region->free_blocks;
+    region->free_blocks = block->prev;
+    block_free(block);
+  }
+}
@@ -12,6 +12,7 @@
 #include "error.h"
 #include "mem.h"
 #include "vm.h"
+#include "lexer.h"
 #include "file.h"
 #include "config.h"
 #include "si.h"
@@ -38,6 +39,13 @@ struct Args {
   int show_warnings;
   int interactive_mode;
   int bytecode_out;
+  int profile_out;  // Record a branch profile
+  int profile_in;   // Compile using the branch profile from a previous run
+  int lex_benchmark;  // Only lex the input, and report how fast that was
+  int eager_compile;  // Compile all functions before running, instead of on their first call
+  int strict; // Parse all function bodies before running, instead of when they are compiled
+  int strip_unused; // Leave out the functions that are never used
+  int table_stats;  // Print the statistics of the hash tables once the input has run
 };
 
 void signal_exit(int x) {
@@ -49,6 +57,8 @@ static void args_parse(struct Args* arguments, int argc, char** argv) {
     char* arg = argv[i];
     if (arg[0] == '-') {
       if (arg[1] == '-') {
+        if (!strcmp(arg, "--strip-unused"))
+          arguments->strip_unused = 1;
         continue;
       }
       switch (arg[1]) {
@@ -61,6 +71,24 @@ static void args_parse(struct Args* arguments, int argc, char** argv) {
         case 'o':
           arguments->bytecode_out = 1;
           break;
+        case 'p':
+          arguments->profile_out = 1;
+          break;
+        case 'P':
+          arguments->profile_in = 1;
+          break;
+        case 'l':
+          arguments->lex_benchmark = 1;
+          break;
+        case 'e':
+          arguments->eager_compile = 1;
+          break;
+        case 's':
+          arguments->strict = 1;
+          break;
+        case 't':
+          arguments->table_stats = 1;
+          break;
         default:
           break;
       }
@@ -71,7 +99,40 @@ static void args_parse(struct Args* arguments, int argc, char** argv) {
   }
 }
 
-int user_input(struct VM_state* vm, struct Str_arr* str_arr) {
+// Lex the input over and over for about a second, and print the throughput
+static void lex_benchmark(struct VM_state* vm, const char* filename) {
+  struct Source source;
+  if (sources_add_file(&vm->sources, filename, &source) != NO_ERR) {
+    error("Failed to open file '%s'\n", filename);
+    return;
+  }
+  unsigned long size = source.size;
+  unsigned long tokens = 0;
+  unsigned int passes = 0;
+  clock_t start = clock();
+  clock_t elapsed = 0;
+  do {
+    struct Lexer lexer = {
+      .index = source.data,
+      .end = source.data + source.size,
+      .line = 1,
+      .count = 0,
+      .token = (struct Token) {0},
+      .filename = filename,
+      .symbols = &vm->symbols,
+    };
+    while (next_token(&lexer).type != T_EOF)
+      tokens++;
+    passes++;
+    elapsed = clock() - start;
+  } while (elapsed < CLOCKS_PER_SEC);
+  double seconds = (double)elapsed / CLOCKS_PER_SEC;
+  double mb = (double)size * passes / (1024 * 1024);
+  printf("%s: %lu tokens, %.2f MB in %u pass(es), %.3f s (%.1f MB/s, %.1f M tokens/s)\n",
+    filename, tokens / passes, (double)size / (1024 * 1024), passes, seconds, mb / seconds, tokens / seconds / 1e6);
+}
+
+int user_input(struct VM_state* vm) {
   assert(vm != NULL);
   char input[INPUT_MAX] = {0};
   char* buffer = input;
@@ -80,7 +141,7 @@ int user_input(struct VM_state* vm, struct Str_arr* str_arr) {
   char filename[] = "stdin";
   while (is_running) {
     if (readinput(buffer, PROMPT)) {
-      status = vm_exec(vm, filename, buffer, str_arr);
+      status = vm_exec(vm, filename, buffer);
       if (status != NO_ERR)
         return status;
       addhistory(buffer);
@@ -99,34 +160,52 @@ int si_exec(int argc, char** argv) {
     .input_file = NULL,
     .show_warnings = 1,
     .interactive_mode = 0,
-    .bytecode_out = 0
+    .bytecode_out = 0,
+    .profile_out = 0,
+    .profile_in = 0,
+    .lex_benchmark = 0,
+    .eager_compile = 0,
+    .strict = 0,
+    .strip_unused = 0,
+    .table_stats = 0,
   };
   args_parse(&arguments, argc, argv);
   error_init(arguments.show_warnings);
   struct VM_state vm;
   vm_init(&vm);
-  struct Str_arr str_arr; // NOTE(lucas): We store all import strings here
-  strarr_init(&str_arr);
+  vm.eager = arguments.eager_compile || arguments.bytecode_out;  // The bytecode listing should have every function in it
+  vm.strict = arguments.strict;
 
   if (arguments.input_file) {
-    char* input = read_file(arguments.input_file);
-    if (input) {
-      vm_exec(&vm, arguments.input_file, input, &str_arr);
+    if (arguments.lex_benchmark)
+      lex_benchmark(&vm, arguments.input_file);
+    else {
+      char profile_filename[PATH_LENGTH_MAX];
+      snprintf(profile_filename, PATH_LENGTH_MAX, "%s.prof", arguments.input_file);
+      int use_profile = arguments.profile_in && profile_load(&vm.profile, profile_filename) == NO_ERR;
+      vm.profile.recording = arguments.profile_out;
+      vm.strip = arguments.strip_unused && !arguments.interactive_mode; // Input from the prompt could use any function
+      vm_exec_file(&vm, arguments.input_file);
+      vm.strip = 0;
+      if (use_profile && vm.profile.input_count != vm.profile.site_count)
+        warn("Profile '%s' does not match the program\n", profile_filename);
+      if (arguments.profile_out)
+        profile_save(&vm.profile, profile_filename);
       if (arguments.bytecode_out) {
         char out_filename[INPUT_MAX];
         sprintf(out_filename, "%s.out", arguments.input_file);
         vm_disasm(&vm, out_filename);
       }
-      free(input);
+      if (arguments.table_stats)
+        vm_print_table_stats(&vm);
     }
   }
   if (arguments.interactive_mode || argc <= 1) {
     if (!arguments.input_file) {
       fprintf(stdout, "%s\n", MESSAGE_TITLE);
     }
-    user_input(&vm, &str_arr);
+    user_input(&vm);
   }
-  strarr_free(&str_arr);
   vm_state_free(&vm);
   return NO_ERR;
 }
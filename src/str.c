@@ -34,15 +34,123 @@ int string_to_number(char* string, double* number) {
 int safe_string_to_number(char* string, int length, double* number) {
 	assert(string != NULL);
 	assert(number != NULL);
-	double result = 0;
-	char* temp = string_new_copy(string, length);
-	char* end;
-  result = strtod(temp, &end);
-  mfree(temp, length);
-  if (*end != '\0')
-	  (void)0; //	return -1;
-  *number = result;
-  return 0;	// No error
+	if (string_parse_number(string, length, number) != length)
+		return -1;
+	return 0;	// No error
+}
+
+// Powers of ten that can be represented exactly by a double
+static const double exact_pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+#define MAX_EXACT_POW10 22
+#define MAX_EXACT_MANTISSA (1ULL << 53)
+#define MAX_LITERAL_LENGTH 512
+
+static int hex_digit(char ch) {
+	if (ch >= '0' && ch <= '9')
+		return ch - '0';
+	if (ch >= 'a' && ch <= 'f')
+		return ch - 'a' + 10;
+	if (ch >= 'A' && ch <= 'F')
+		return ch - 'A' + 10;
+	return -1;
+}
+
+// Integers (42), decimals with an optional exponent (4.2, 42e-1) and hexadecimal integers (0x2a)
+// The string doesn't have to be null-terminated, and nothing is allocated
+//
+// Decimals take the fast path when both the digits and the power of ten are exact in a double,
+// since then a single multiplication or division is correctly rounded. Anything else (more than
+// 19 digits, or large exponents) goes to strtod on a copy on the stack.
+int string_parse_number(const char* string, int length, double* number) {
+	assert(string != NULL);
+	assert(number != NULL);
+	int i = 0;
+	*number = 0;
+	if (length >= 2 && string[0] == '0' && (string[1] == 'x' || string[1] == 'X')) {
+		double result = 0;
+		int digits = 0;
+		for (i = 2; i < length; i++, digits++) {
+			int digit = hex_digit(string[i]);
+			if (digit < 0)
+				break;
+			result = result * 16 + digit;
+		}
+		if (digits == 0)
+			return 1;	// "0x" without any digits
+		*number = result;
+		return i;
+	}
+
+	unsigned long long mantissa = 0;
+	int digits = 0;	// Significant digits in the mantissa
+	int exponent = 0;
+	int too_many_digits = 0;
+	int any_digits = 0;
+	for (; i < length && string[i] >= '0' && string[i] <= '9'; i++) {
+		any_digits = 1;
+		if (digits < 19) {
+			mantissa = mantissa * 10 + (string[i] - '0');
+			digits += mantissa != 0;
+		}
+		else {
+			too_many_digits = 1;
+			exponent++;
+		}
+	}
+	if (i < length && string[i] == '.') {
+		i++;
+		for (; i < length && string[i] >= '0' && string[i] <= '9'; i++) {
+			any_digits = 1;
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (string[i] - '0');
+				digits += mantissa != 0;
+				exponent--;
+			}
+			else
+				too_many_digits = 1;
+		}
+	}
+	if (!any_digits)
+		return 0;
+	if (i < length && (string[i] == 'e' || string[i] == 'E')) {
+		int start = i++;
+		int sign = 1;
+		if (i < length && (string[i] == '+' || string[i] == '-'))
+			sign = string[i++] == '-' ? -1 : 1;
+		if (i >= length || string[i] < '0' || string[i] > '9')
+			return start;	// Exponent without digits
+		int exp = 0;
+		for (; i < length && string[i] >= '0' && string[i] <= '9'; i++) {
+			if (exp < 100000)
+				exp = exp * 10 + (string[i] - '0');
+		}
+		exponent += sign * exp;
+	}
+
+	if (!too_many_digits && mantissa <= MAX_EXACT_MANTISSA && exponent >= -MAX_EXACT_POW10 && exponent <= MAX_EXACT_POW10) {
+		double result = (double)mantissa;
+		if (exponent < 0)
+			result /= exact_pow10[-exponent];
+		else
+			result *= exact_pow10[exponent];
+		*number = result;
+		return i;
+	}
+	if (mantissa == 0 && !too_many_digits) {
+		*number = 0;
+		return i;
+	}
+	if (i >= MAX_LITERAL_LENGTH)
+		return 0;
+	char copy[MAX_LITERAL_LENGTH];
+	memcpy(copy, string, i);
+	copy[i] = '\0';
+	*number = strtod(copy, NULL);
+	return i;
 }
 
 void string_free(char* string) {
@@ -0,0 +1,166 @@
+// strip.c
+// Dead function elimination
+//
+// Functions declared in the global scope, of the program and of every file it imports, are only
+// kept if the global code can reach them. Any use of the name of a function counts, not only
+// calls, since functions can be passed around as values. Unused functions are removed from the
+// tree before it is compiled, so they never get a variable slot, bytecode or constants.
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "error.h"
+#include "mem.h"
+#include "list.h"
+#include "token.h"
+#include "vm.h"
+#include "strip.h"
+
+struct Strip_func {
+  Ast parent;
+  int index;  // Of the 'fn' token in the parent
+  Ast block;
+  int next;   // Next function with the same name, or -1
+  unsigned char scanned;
+};
+
+struct Stripper {
+  struct Strip_func* funcs;
+  unsigned int func_count;
+  unsigned int func_capacity;
+  int* by_symbol;         // First function with this name, or -1
+  unsigned char* used;    // Indexed by symbol
+  int* worklist;          // Symbols that have been found to be used, but not looked into yet
+  unsigned int worklist_count;
+  unsigned int symbol_count;
+  int status;
+};
+
+static void use(struct Stripper* s, int symbol);
+static void scan(struct Stripper* s, Ast* ast);
+static void collect(struct Stripper* s, Ast* tree);
+
+void use(struct Stripper* s, int symbol) {
+  if (symbol < 0 || (unsigned int)symbol >= s->symbol_count || s->used[symbol])
+    return;
+  s->used[symbol] = 1;
+  s->worklist[s->worklist_count++] = symbol;
+}
+
+// Mark every identifier in the tree as used, including the ones in imported files
+void scan(struct Stripper* s, Ast* ast) {
+  for (int i = 0; i < ast_child_count(ast); i++) {
+    const struct Token* token = ast_get_node_value(ast, i);
+    if (!token)
+      continue;
+    Ast child = ast_get_node_at(ast, i);
+    if (token->type == T_IDENTIFIER)
+      use(s, token->symbol);
+    else if (token->type == T_IMPORT) {
+      Ast link = ast_get_link(&child);
+      scan(s, &link);
+    }
+    scan(s, &child);
+  }
+}
+
+// Find the functions in the global scope, the rest of the global code is where we start from
+void collect(struct Stripper* s, Ast* tree) {
+  for (int i = 0; i < ast_child_count(tree); i++) {
+    const struct Token* token = ast_get_node_value(tree, i);
+    if (!token)
+      continue;
+    Ast child = ast_get_node_at(tree, i);
+    switch (token->type) {
+      case T_FUNC_DEF: {
+        const struct Token* identifier = ast_get_node_value(tree, i + 1);
+        assert(identifier != NULL && identifier->symbol >= 0);
+        struct Strip_func func = {
+          .parent = *tree,
+          .index = i,
+          .block = ast_get_node_at(tree, i + 2),
+          .next = s->by_symbol[identifier->symbol],
+          .scanned = 0,
+        };
+        unsigned int count = s->func_count;
+        list_push(s->funcs, s->func_count, s->func_capacity, func);
+        if (s->func_count == count) {
+          s->status = ALLOC_ERR;
+          return;
+        }
+        s->by_symbol[identifier->symbol] = count;
+        i += 2;
+        break;
+      }
+
+      case T_IMPORT: {
+        Ast link = ast_get_link(&child);
+        collect(s, &link);
+        break;
+      }
+
+      case T_IDENTIFIER:
+        use(s, token->symbol);
+        // Fallthrough
+
+      default:
+        scan(s, &child);
+        break;
+    }
+  }
+}
+
+int strip_unused(struct VM_state* vm, Ast* ast, int* stripped) {
+  assert(vm != NULL && ast != NULL);
+  unsigned int symbol_count = vm->symbols.count;
+  struct Stripper s = {
+    .funcs = NULL,
+    .func_count = 0,
+    .func_capacity = 0,
+    .by_symbol = mmalloc(sizeof(int) * (symbol_count + 1)),
+    .used = mcalloc(sizeof(unsigned char), symbol_count + 1),
+    .worklist = mmalloc(sizeof(int) * (symbol_count + 1)),
+    .worklist_count = 0,
+    .symbol_count = symbol_count,
+    .status = NO_ERR,
+  };
+  int count = 0;
+  if (!s.by_symbol || !s.used || !s.worklist) {
+    s.status = ALLOC_ERR;
+    goto done;
+  }
+  for (unsigned int i = 0; i < symbol_count; i++)
+    s.by_symbol[i] = -1;
+  collect(&s, ast);
+  if (s.status != NO_ERR)
+    goto done;
+
+  while (s.worklist_count > 0) {
+    int symbol = s.worklist[--s.worklist_count];
+    for (int f = s.by_symbol[symbol]; f >= 0; f = s.funcs[f].next) {
+      struct Strip_func* func = &s.funcs[f];
+      if (func->scanned)
+        continue;
+      func->scanned = 1;
+      scan(&s, &func->block);
+    }
+  }
+
+  // Backwards, so that the index of the functions that come before stays the same
+  for (int f = (int)s.func_count - 1; f >= 0; f--) {
+    struct Strip_func* func = &s.funcs[f];
+    if (func->scanned)
+      continue;
+    for (int i = 0; i < 3; i++) // fn, identifier (with the parameters) and the block
+      ast_remove_node_at(&func->parent, func->index);
+    count++;
+  }
+done:
+  list_free(s.funcs, s.func_count, s.func_capacity);
+  mfree(s.by_symbol, sizeof(int) * (symbol_count + 1));
+  mfree(s.used, sizeof(unsigned char) * (symbol_count + 1));
+  mfree(s.worklist, sizeof(int) * (symbol_count + 1));
+  if (stripped)
+    *stripped = count;
+  return s.status;
+}
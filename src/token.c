@@ -48,6 +48,7 @@ const char* token_desc[T_COUNT] = {
   "c function",
   "list",
   TOKEN_NIL,
+  "map",
 
   TOKEN_DECL,
   TOKEN_RETURN,
@@ -60,6 +61,7 @@ const char* token_desc[T_COUNT] = {
 
   "call",
   "block",
+  "deferred",
   "EOF",
 };
 
@@ -0,0 +1,490 @@
+// trace.c
+// Trace recorder and executor for hot while loops
+//
+// When a loop back-edge has been taken TRACE_HOT_LOOP times, one iteration of the loop is
+// recorded, starting from the loop head and following the path that the current values would take.
+// Calls to script functions are inlined. Every branch becomes a guard that leaves the trace and
+// continues in the bytecode when the condition turns out differently than when it was recorded.
+//
+// Traces only deal with numbers: the variables and arguments that the loop touches are type checked
+// and loaded into registers once when entering the trace, and written back when leaving it.
+// Anything else (C functions, strings, lists, breaks, ...) makes us give up on the loop.
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "error.h"
+#include "mem.h"
+#include "ast.h"
+#include "vm.h"
+#include "compile.h"
+#include "trace.h"
+
+// Registers [0, TRACE_MAX_STACK) hold temporary values, indexed by their stack position.
+// Variables, arguments and constants get the registers after those.
+#define TEMP_REG(pos) (pos)
+#define IS_TEMP_REG(reg) ((reg) < TRACE_MAX_STACK)
+
+// Value on the stack while recording
+struct Entry {
+  short reg;
+  int func;  // Variable slot of a function, or -1 if the value is a number held in 'reg'
+};
+
+// Inlined function call
+struct Frame {
+  int bp;
+  int return_addr;
+  const struct Scope* scope;
+};
+
+struct Recorder {
+  struct VM_state* vm;
+  const struct Function* func;
+  int stack_bp;
+  int site;
+  struct Entry stack[TRACE_MAX_STACK];
+  int top;
+  struct Frame frames[TRACE_MAX_DEPTH];
+  int depth;  // 0 when we are in the function that the loop belongs to
+  obj_number values[TRACE_MAX_REGS];  // Values of the registers in the recorded iteration
+  unsigned char is_const[TRACE_MAX_REGS];
+  int reg_count;
+  struct Trace_slot slots[TRACE_MAX_REGS];
+  int slot_count;
+  struct Trace_const consts[TRACE_MAX_REGS];
+  int const_count;
+  struct Trace_ins ins[TRACE_MAX_LENGTH];
+  int ins_count;
+};
+
+static struct Object* slot_object(struct VM_state* vm, const struct Trace_slot* slot, int stack_bp);
+static int slot_reg(struct Recorder* r, int kind, int index);
+static int const_reg(struct Recorder* r, obj_number value);
+static int emit(struct Recorder* r, struct Trace_ins ins);
+static int push(struct Recorder* r, int reg, int func);
+static int pop(struct Recorder* r);
+static struct Trace* record(struct VM_state* vm, const struct Function* func, int stack_bp, int site, int head);
+
+struct Object* slot_object(struct VM_state* vm, const struct Trace_slot* slot, int stack_bp) {
+  if (slot->kind == SLOT_ARG)
+    return &vm->stack[stack_bp + slot->index];
+  return &vm->variables[slot->index];
+}
+
+// Find (or load) the register of a variable or argument, -1 if it's not a number
+int slot_reg(struct Recorder* r, int kind, int index) {
+  for (int i = 0; i < r->slot_count; i++) {
+    if (r->slots[i].kind == kind && r->slots[i].index == index)
+      return r->slots[i].reg;
+  }
+  if (r->reg_count >= TRACE_MAX_REGS)
+    return -1;
+  struct Trace_slot slot = {
+    .kind = kind,
+    .written = 0,
+    .reg = r->reg_count,
+    .index = index,
+  };
+  const struct Object* obj = slot_object(r->vm, &slot, r->stack_bp);
+  if (obj->type != T_NUMBER)
+    return -1;
+  r->values[slot.reg] = obj->value.number;
+  r->slots[r->slot_count++] = slot;
+  return r->reg_count++;
+}
+
+int const_reg(struct Recorder* r, obj_number value) {
+  for (int i = 0; i < r->const_count; i++) {
+    if (r->consts[i].value == value)
+      return r->consts[i].reg;
+  }
+  if (r->reg_count >= TRACE_MAX_REGS)
+    return -1;
+  struct Trace_const constant = {
+    .reg = r->reg_count,
+    .value = value,
+  };
+  r->values[constant.reg] = value;
+  r->is_const[constant.reg] = 1;
+  r->consts[r->const_count++] = constant;
+  return r->reg_count++;
+}
+
+int emit(struct Recorder* r, struct Trace_ins ins) {
+  if (r->ins_count >= TRACE_MAX_LENGTH)
+    return ERR;
+  r->ins[r->ins_count++] = ins;
+  return NO_ERR;
+}
+
+int push(struct Recorder* r, int reg, int func) {
+  if (r->top >= TRACE_MAX_STACK || (reg < 0 && func < 0))
+    return ERR;
+  r->stack[r->top].reg = reg;
+  r->stack[r->top].func = func;
+  r->top++;
+  return NO_ERR;
+}
+
+// Pop a number, returns its register or -1
+int pop(struct Recorder* r) {
+  if (r->top <= r->frames[r->depth].bp)
+    return -1;
+  const struct Entry* entry = &r->stack[--r->top];
+  if (entry->func >= 0)
+    return -1;
+  return entry->reg;
+}
+
+#define RECORD_ARITH(OP, C_OP, CAST) \
+  case I_##OP: \
+    value = ((CAST)r->values[a]) C_OP ((CAST)r->values[b]); \
+    trace_op = TR_##OP; \
+    break;
+
+struct Trace* record(struct VM_state* vm, const struct Function* func, int stack_bp, int site, int head) {
+  struct Recorder* r = mcalloc(sizeof(struct Recorder), 1);
+  if (!r)
+    return NULL;
+  r->vm = vm;
+  r->func = func;
+  r->stack_bp = stack_bp;
+  r->site = site;
+  r->frames[0].bp = 0;
+  r->frames[0].scope = &func->scope;
+  r->reg_count = TRACE_MAX_STACK;
+
+  struct Trace* trace = NULL;
+  int addr = head;
+  for (;;) {
+    // Leaving the loop, or we went somewhere we didn't expect
+    if (r->depth == 0 && (addr < head || addr >= site))
+      goto done;
+    Instruction op = I_UNKNOWN;
+    int arg = 0;
+    int size = compile_decode_ins(&vm->program[addr], &op, &arg);
+    int next = addr + size;
+    int jump_from = addr + (vm->program[addr] == I_WIDE || vm->program[addr] == I_WIDE16) + 1;  // Jumps are relative to the operand
+    switch (op) {
+      case I_PUSHK: {
+        const struct Object* constant = &r->frames[r->depth].scope->constants[arg];
+        if (constant->type != T_NUMBER || push(r, const_reg(r, constant->value.number), -1) != NO_ERR)
+          goto done;
+        break;
+      }
+
+      case I_PUSH_VAR: {
+        const struct Object* variable = &vm->variables[arg];
+        if (variable->type == T_FUNCTION) {
+          if (push(r, -1, arg) != NO_ERR)
+            goto done;
+          break;
+        }
+        if (push(r, slot_reg(r, SLOT_VARIABLE, arg), -1) != NO_ERR)
+          goto done;
+        break;
+      }
+
+      case I_PUSH_ARG: {
+        if (r->depth > 0) {
+          const struct Entry entry = r->stack[r->frames[r->depth].bp + arg];
+          if (push(r, entry.reg, entry.func) != NO_ERR)
+            goto done;
+          break;
+        }
+        if (push(r, slot_reg(r, SLOT_ARG, arg), -1) != NO_ERR)
+          goto done;
+        break;
+      }
+
+      case I_ASSIGN: {
+        int value = pop(r);
+        if (value < 0 || vm->variables[arg].type == T_FUNCTION)
+          goto done;
+        int reg = slot_reg(r, SLOT_VARIABLE, arg);
+        if (reg < 0)
+          goto done;
+        // The old value of the variable is still on the stack
+        for (int i = 0; i < r->top; i++) {
+          if (r->stack[i].func < 0 && r->stack[i].reg == reg)
+            goto done;
+        }
+        for (int i = 0; i < r->slot_count; i++) {
+          if (r->slots[i].reg == reg)
+            r->slots[i].written = 1;
+        }
+        r->values[reg] = r->values[value];
+        // Store the result of the previous instruction directly into the variable
+        struct Trace_ins* last = r->ins_count > 0 ? &r->ins[r->ins_count - 1] : NULL;
+        if (value == TEMP_REG(r->top) && last && last->op != TR_GUARD && last->op != TR_LOOP && last->dst == value) {
+          last->dst = reg;
+          break;
+        }
+        if (emit(r, (struct Trace_ins) { .op = TR_MOV, .dst = reg, .a = value }) != NO_ERR)
+          goto done;
+        break;
+      }
+
+      case I_POP:
+        if (r->top <= r->frames[r->depth].bp)
+          goto done;
+        r->top--;
+        break;
+
+      case I_IF:
+      case I_WHILE: {
+        int cond = pop(r);
+        // Leaving the trace from inside of an inlined call, or with values on the stack, is not supported
+        if (cond < 0 || r->depth > 0 || r->top > 0)
+          goto done;
+        int taken = r->values[cond] != 0;
+        if (!r->is_const[cond]) {
+          struct Trace_ins guard = {
+            .op = TR_GUARD,
+            .expect = taken,
+            .a = cond,
+            .exit = taken ? jump_from + arg : next,
+          };
+          if (emit(r, guard) != NO_ERR)
+            goto done;
+        }
+        if (!taken) {
+          addr = jump_from + arg;
+          continue;
+        }
+        break;
+      }
+
+      case I_JUMP:
+        if (jump_from != site || r->depth > 0 || r->top > 0)
+          goto done;
+        if (emit(r, (struct Trace_ins) { .op = TR_LOOP }) != NO_ERR)
+          goto done;
+        trace = mcalloc(sizeof(struct Trace), 1);
+        if (!trace)
+          goto done;
+        trace->head = head;
+        trace->slots = mmalloc(sizeof(struct Trace_slot) * r->slot_count);
+        trace->consts = mmalloc(sizeof(struct Trace_const) * r->const_count);
+        trace->ins = mmalloc(sizeof(struct Trace_ins) * r->ins_count);
+        if ((!trace->slots && r->slot_count) || (!trace->consts && r->const_count) || !trace->ins) {
+          mfree(trace->slots, sizeof(struct Trace_slot) * r->slot_count);
+          mfree(trace->consts, sizeof(struct Trace_const) * r->const_count);
+          mfree(trace->ins, sizeof(struct Trace_ins) * r->ins_count);
+          mfree(trace, sizeof(struct Trace));
+          trace = NULL;
+          goto done;
+        }
+        memcpy(trace->slots, r->slots, sizeof(struct Trace_slot) * r->slot_count);
+        trace->slot_count = r->slot_count;
+        memcpy(trace->consts, r->consts, sizeof(struct Trace_const) * r->const_count);
+        trace->const_count = r->const_count;
+        memcpy(trace->ins, r->ins, sizeof(struct Trace_ins) * r->ins_count);
+        trace->ins_count = r->ins_count;
+        goto done;
+
+      case I_CALL: {
+        int bp = r->top - arg;
+        if (bp < 1 || r->depth + 1 >= TRACE_MAX_DEPTH)
+          goto done;
+        const struct Entry callee = r->stack[bp - 1];
+        if (callee.func < 0)
+          goto done;
+        const struct Function* function = &vm->variables[callee.func].value.func;
+        if (function->argc != arg || function->lazy >= 0)  // Not compiled yet
+          goto done;
+        for (int i = bp; i < r->top; i++) {
+          if (r->stack[i].func >= 0)
+            goto done;
+        }
+        struct Frame* frame = &r->frames[++r->depth];
+        frame->bp = bp;
+        frame->return_addr = next;
+        frame->scope = &function->scope;
+        addr = function->addr;
+        continue;
+      }
+
+      case I_RETURN: {
+        if (r->depth == 0)
+          goto done;
+        const struct Frame* frame = &r->frames[r->depth--];
+        struct Entry result = r->stack[r->top - 1];
+        // Temporaries are kept in the register of their stack position, so move the return value
+        // in place before the registers above it are reused
+        if (result.func < 0 && IS_TEMP_REG(result.reg) && result.reg != TEMP_REG(frame->bp - 1)) {
+          int dst = TEMP_REG(frame->bp - 1);
+          r->values[dst] = r->values[result.reg];
+          if (emit(r, (struct Trace_ins) { .op = TR_MOV, .dst = dst, .a = result.reg }) != NO_ERR)
+            goto done;
+          result.reg = dst;
+        }
+        r->stack[frame->bp - 1] = result; // The return value replaces the function
+        r->top = frame->bp;
+        addr = frame->return_addr;
+        continue;
+      }
+
+      case I_MINUS:
+      case I_NOT: {
+        int a = pop(r);
+        if (a < 0)
+          goto done;
+        int dst = TEMP_REG(r->top);
+        r->values[dst] = op == I_MINUS ? -r->values[a] : !r->values[a];
+        if (emit(r, (struct Trace_ins) { .op = op == I_MINUS ? TR_MINUS : TR_NOT, .dst = dst, .a = a }) != NO_ERR)
+          goto done;
+        push(r, dst, -1);
+        break;
+      }
+
+      case I_ADD: case I_SUB: case I_MULT: case I_DIV:
+      case I_LT: case I_GT: case I_EQ: case I_LEQ: case I_GEQ: case I_NEQ:
+      case I_MOD: case I_BAND: case I_BOR: case I_BXOR: case I_LEFTSHIFT: case I_RIGHTSHIFT:
+      case I_AND: case I_OR: {
+        int b = pop(r);
+        int a = pop(r);
+        if (a < 0 || b < 0)
+          goto done;
+        int dst = TEMP_REG(r->top);
+        obj_number value = 0;
+        int trace_op = TR_ADD;
+        switch (op) {
+          TRACE_ARITH(RECORD_ARITH)
+          default:
+            assert(0);
+            break;
+        }
+        r->values[dst] = value;
+        if (emit(r, (struct Trace_ins) { .op = trace_op, .dst = dst, .a = a, .b = b }) != NO_ERR)
+          goto done;
+        push(r, dst, -1);
+        break;
+      }
+
+      default:  // I_LOCAL_ASSIGN, I_LOOP, I_EXIT, ...
+        goto done;
+    }
+    addr = next;
+  }
+done:
+  mfree(r, sizeof(struct Recorder));
+  return trace;
+}
+
+void trace_cache_init(struct Trace_cache* cache) {
+  assert(cache != NULL);
+  cache->sites = NULL;
+  cache->sites_size = 0;
+  cache->trace_count = 0;
+}
+
+// Called when the back-edge jump at 'addr' (location of the operand) is taken
+// Returns the trace for the loop, if there is one
+struct Trace* trace_back_edge(struct VM_state* vm, const struct Function* func, int stack_bp, int addr, int head) {
+  struct Trace_cache* cache = &vm->traces;
+  assert(addr >= 0);
+  if (addr >= cache->sites_size) {
+    unsigned int new_size = addr * 2 + 1;
+    struct Trace_site* sites = cache->sites ?
+      mrealloc(cache->sites, sizeof(struct Trace_site) * cache->sites_size, sizeof(struct Trace_site) * new_size) :
+      mmalloc(sizeof(struct Trace_site) * new_size);
+    if (!sites)
+      return NULL;
+    memset(&sites[cache->sites_size], 0, sizeof(struct Trace_site) * (new_size - cache->sites_size));
+    cache->sites = sites;
+    cache->sites_size = new_size;
+  }
+  struct Trace_site* site = &cache->sites[addr];
+  if (site->trace || site->hits < 0)
+    return site->trace;
+  if (++site->hits < TRACE_HOT_LOOP)
+    return NULL;
+  site->trace = record(vm, func, stack_bp, addr, head);
+  if (!site->trace) {
+    site->hits = -1;
+    return NULL;
+  }
+  cache->trace_count++;
+  return site->trace;
+}
+
+#define EXEC_ARITH(OP, C_OP, CAST) \
+  case TR_##OP: \
+    regs[ins->dst] = ((CAST)regs[ins->a]) C_OP ((CAST)regs[ins->b]); \
+    break;
+
+// Run the trace until one of its guards fails
+// Returns the location in the bytecode to continue from, or -1 if the trace could not be entered
+int trace_execute(struct VM_state* vm, const struct Trace* trace, int stack_bp) {
+  obj_number regs[TRACE_MAX_REGS];
+  for (unsigned int i = 0; i < trace->slot_count; i++) {
+    const struct Object* obj = slot_object(vm, &trace->slots[i], stack_bp);
+    if (obj->type != T_NUMBER)
+      return -1;
+    regs[trace->slots[i].reg] = obj->value.number;
+  }
+  for (unsigned int i = 0; i < trace->const_count; i++)
+    regs[trace->consts[i].reg] = trace->consts[i].value;
+
+  int exit = -1;
+  const struct Trace_ins* ins = trace->ins;
+  for (;;) {
+    switch (ins->op) {
+      TRACE_ARITH(EXEC_ARITH)
+
+      case TR_MINUS:
+        regs[ins->dst] = -regs[ins->a];
+        break;
+
+      case TR_NOT:
+        regs[ins->dst] = !regs[ins->a];
+        break;
+
+      case TR_MOV:
+        regs[ins->dst] = regs[ins->a];
+        break;
+
+      case TR_GUARD:
+        if ((regs[ins->a] != 0) != ins->expect) {
+          exit = ins->exit;
+          goto done;
+        }
+        break;
+
+      case TR_LOOP:
+        ins = trace->ins;
+        continue;
+
+      default:
+        assert(0);
+        break;
+    }
+    ins++;
+  }
+done:
+  for (unsigned int i = 0; i < trace->slot_count; i++) {
+    const struct Trace_slot* slot = &trace->slots[i];
+    if (slot->written)
+      slot_object(vm, slot, stack_bp)->value.number = regs[slot->reg];
+  }
+  return exit;
+}
+
+void trace_cache_free(struct Trace_cache* cache) {
+  assert(cache != NULL);
+  for (unsigned int i = 0; i < cache->sites_size; i++) {
+    struct Trace* trace = cache->sites[i].trace;
+    if (!trace)
+      continue;
+    mfree(trace->slots, sizeof(struct Trace_slot) * trace->slot_count);
+    mfree(trace->consts, sizeof(struct Trace_const) * trace->const_count);
+    mfree(trace->ins, sizeof(struct Trace_ins) * trace->ins_count);
+    mfree(trace, sizeof(struct Trace));
+  }
+  mfree(cache->sites, sizeof(struct Trace_site) * cache->sites_size);
+  trace_cache_init(cache);
+}
@@ -0,0 +1,370 @@
+// verify.c
+// Load-time bytecode verification
+//
+// Every instruction that can be reached from the global code or from a function entry point is
+// checked once before the program is executed: opcodes and operand encoding, jump targets,
+// constant indices, variable slots, argument indices and the stack depth.
+// Functions that are compiled on their first call are checked right after they are compiled.
+// Code that has been verified can be run by execute() without any runtime checks on its operands.
+//
+// The stack depth before each instruction is tracked as a range over all paths that reach it.
+// An instruction must have the values it needs on every path (the least depth), and no path may
+// need more than the stack can hold. Expression statements leave their value behind, so the depth
+// can keep growing around a loop; the greatest depth is then widened to STACK_SIZE and the stack
+// is checked for overflow at run time instead. A call is counted as leaving its return value, which
+// is the one thing that can't be proven: a C function may not, and execute() checks for that.
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "error.h"
+#include "config.h"
+#include "mem.h"
+#include "list.h"
+#include "vm.h"
+#include "ast.h"
+#include "compile.h"
+#include "verify.h"
+
+#define verify_error(addr, fmt, ...) \
+  error(COLOR_ERROR "verify-error: " COLOR_NONE "%.4i: " fmt, addr, ##__VA_ARGS__)
+
+#define INS_BEGIN   (1 << 0)  // An instruction begins at this address
+#define INS_VISITED (1 << 1)
+#define INS_QUEUED  (1 << 2)
+
+struct Ins_state {
+  int min_depth;  // Stack depth (relative to the frame) before this instruction, over all paths
+  int max_depth;
+  int unit;   // The function (or global code) this instruction belongs to
+  unsigned char flags;
+};
+
+// Function, or the global code
+struct Unit {
+  const struct Scope* scope;
+  int addr;
+  int argc;
+  int base; // Number of stack values below the frame (function and arguments)
+};
+
+struct Verifier {
+  struct VM_state* vm;
+  int start;
+  struct Ins_state* ins;  // Indexed by (address - start)
+  int* worklist;
+  int worklist_count;
+};
+
+static struct Ins_state* ins_state(struct Verifier* v, int addr);
+static int decode(struct Verifier* v, int addr, Instruction* op, int* arg, int* size, int* arg_size);
+static int mark_instructions(struct Verifier* v);
+static int merge(struct Verifier* v, int unit, int addr, int min_depth, int max_depth);
+static int verify_unit(struct Verifier* v, int unit_id, const struct Unit* unit);
+static int verify_range(struct VM_state* vm, int start, const struct Unit* entry);
+
+struct Ins_state* ins_state(struct Verifier* v, int addr) {
+  assert(addr >= v->start && addr < v->vm->program_size);
+  return &v->ins[addr - v->start];
+}
+
+int decode(struct Verifier* v, int addr, Instruction* op, int* arg, int* size, int* arg_size) {
+  const Instruction* program = v->vm->program;
+  int end = v->vm->program_size;
+  int wide = 0;  // Size of the operand given by the prefix
+  *size = 1;
+  if (program[addr] == I_WIDE || program[addr] == I_WIDE16) {
+    if (addr + 1 >= end) {
+      verify_error(addr, "Truncated instruction\n");
+      return ERR;
+    }
+    wide = program[addr] == I_WIDE ? ARG_SIZE_WIDE : ARG_SIZE_16;
+    (*size)++;
+  }
+  *op = program[addr + *size - 1];
+  if (*op == I_UNKNOWN || *op == I_WIDE || *op == I_WIDE16 || *op >= I_BREAKJUMP) {
+    verify_error(addr, "Invalid instruction (%i)\n", *op);
+    return ERR;
+  }
+  *arg = 0;
+  *arg_size = 0;
+  if (compile_get_ins_arg_count(*op) > 0)
+    *arg_size = wide ? wide : ARG_SIZE;
+  else if (wide) {
+    verify_error(addr, "Wide prefix on instruction without operand\n");
+    return ERR;
+  }
+  if (addr + *size + *arg_size > end) {
+    verify_error(addr, "Truncated operand\n");
+    return ERR;
+  }
+  if (*arg_size == ARG_SIZE_WIDE)
+    *arg = ARG_DECODE_WIDE(&program[addr + *size]);
+  else if (*arg_size == ARG_SIZE_16)
+    *arg = ARG_DECODE_16(&program[addr + *size]);
+  else if (*arg_size == ARG_SIZE)
+    *arg = ARG_DECODE(&program[addr + *size]);
+  *size += *arg_size;
+  return NO_ERR;
+}
+
+// Linear sweep over the new code, marking where each instruction begins
+int mark_instructions(struct Verifier* v) {
+  for (int addr = v->start; addr < v->vm->program_size;) {
+    Instruction op = I_UNKNOWN;
+    int arg = 0, size = 0, arg_size = 0;
+    if (decode(v, addr, &op, &arg, &size, &arg_size) != NO_ERR)
+      return ERR;
+    ins_state(v, addr)->flags |= INS_BEGIN;
+    addr += size;
+  }
+  return NO_ERR;
+}
+
+// Join the stack depth of a new path with the range already recorded for this instruction
+int merge(struct Verifier* v, int unit, int addr, int min_depth, int max_depth) {
+  if (addr < v->start || addr >= v->vm->program_size || !(ins_state(v, addr)->flags & INS_BEGIN)) {
+    verify_error(addr, "Invalid jump target\n");
+    return ERR;
+  }
+  struct Ins_state* state = ins_state(v, addr);
+  if (max_depth > STACK_SIZE)
+    max_depth = STACK_SIZE;
+  if (state->flags & INS_VISITED) {
+    if (state->unit != unit) {
+      verify_error(addr, "Jump into another function\n");
+      return ERR;
+    }
+    if (min_depth >= state->min_depth && max_depth <= state->max_depth)
+      return NO_ERR;
+    // A loop that keeps taking values from the stack underflows within a few rounds
+    if (min_depth < state->min_depth)
+      state->min_depth = min_depth;
+    // Depth keeps growing around a loop, widen it to the maximum so that we terminate
+    if (max_depth > state->max_depth)
+      state->max_depth = STACK_SIZE;
+  }
+  else {
+    state->min_depth = min_depth;
+    state->max_depth = max_depth;
+    state->unit = unit;
+    state->flags |= INS_VISITED;
+  }
+  if (!(state->flags & INS_QUEUED)) {
+    state->flags |= INS_QUEUED;
+    v->worklist[v->worklist_count++] = addr;
+  }
+  return NO_ERR;
+}
+
+int verify_unit(struct Verifier* v, int unit_id, const struct Unit* unit) {
+  struct VM_state* vm = v->vm;
+  if (merge(v, unit_id, unit->addr, 0, 0) != NO_ERR)
+    return ERR;
+  while (v->worklist_count > 0) {
+    int addr = v->worklist[--v->worklist_count];
+    struct Ins_state* state = ins_state(v, addr);
+    state->flags &= ~INS_QUEUED;
+    int depth = 0;  // How much the instruction changes the depth
+    Instruction op = I_UNKNOWN;
+    int arg = 0, size = 0, arg_size = 0;
+    decode(v, addr, &op, &arg, &size, &arg_size);  // Already checked by mark_instructions
+    int next = addr + size;
+    int jump_target = addr + size - arg_size + arg; // Jumps are relative to their operand
+    int jumps = 0;
+    int falls_through = 1;
+    int needed = 0; // Number of values this instruction needs on the stack
+    switch (op) {
+      case I_PUSHK:
+        if (arg < 0 || arg >= unit->scope->constants_count) {
+          verify_error(addr, "Constant index out of range (%i)\n", arg);
+          return ERR;
+        }
+        depth++;
+        break;
+
+      case I_PUSH_VAR:
+      case I_ASSIGN:
+        if (arg < 0 || arg >= vm->variable_count) {
+          verify_error(addr, "Variable slot out of range (%i)\n", arg);
+          return ERR;
+        }
+        if (op == I_PUSH_VAR)
+          depth++;
+        else {
+          needed = 1;
+          depth--;
+        }
+        break;
+
+      case I_PUSH_ARG:
+      case I_LOCAL_ASSIGN:
+        if (arg < 0 || arg >= unit->argc) {
+          verify_error(addr, "Argument index out of range (%i)\n", arg);
+          return ERR;
+        }
+        if (op == I_PUSH_ARG)
+          depth++;
+        else {
+          needed = 1;
+          depth--;
+        }
+        break;
+
+      case I_IF:
+      case I_WHILE:
+      case I_LOOP:
+        needed = 1;
+        depth--;
+        jumps = 1;
+        break;
+
+      case I_JUMP:
+        jumps = 1;
+        falls_through = 0;
+        break;
+
+      case I_LOCAL_LIST:
+        if (arg < 0) {
+          verify_error(addr, "Invalid list length (%i)\n", arg);
+          return ERR;
+        }
+        needed = arg;
+        depth -= arg - 1;
+        break;
+
+      case I_CALL:
+        if (arg < 0) {
+          verify_error(addr, "Invalid argument count (%i)\n", arg);
+          return ERR;
+        }
+        needed = arg + 1;
+        depth -= arg; // The function is replaced by its return value (a C function may not leave one)
+        break;
+
+      case I_RETURN:
+      case I_EXIT:
+        falls_through = 0;
+        break;
+
+      case I_MINUS:
+      case I_NOT:
+        needed = 1;
+        break;
+
+      case I_POP:
+        needed = 1;
+        depth--;
+        break;
+
+      default:  // Binary operators
+        needed = 2;
+        depth--;
+        break;
+    }
+    if (state->min_depth + unit->base < needed) {
+      verify_error(addr, "Stack underflow (needs %i value(s))\n", needed);
+      return ERR;
+    }
+    int min_depth = state->min_depth + depth;
+    int max_depth = state->max_depth + depth;
+    if (min_depth + unit->base > STACK_SIZE) {
+      verify_error(addr, "Stack overflow\n");
+      return ERR;
+    }
+    if (jumps) {
+      if (merge(v, unit_id, jump_target, min_depth, max_depth) != NO_ERR)
+        return ERR;
+    }
+    if (falls_through) {
+      if (next >= vm->program_size) {
+        verify_error(addr, "Control flows past the end of the program\n");
+        return ERR;
+      }
+      if (merge(v, unit_id, next, min_depth, max_depth) != NO_ERR)
+        return ERR;
+    }
+  }
+  return NO_ERR;
+}
+
+// Verify all code from 'start' to the end of the program, beginning with the entry unit
+// Any function that has been compiled since 'start' is verified as well
+int verify_range(struct VM_state* vm, int start, const struct Unit* entry) {
+  int count = vm->program_size - start;
+  if (count <= 0)
+    return NO_ERR;
+  struct Verifier v = {
+    .vm = vm,
+    .start = start,
+    .ins = mcalloc(sizeof(struct Ins_state), count),
+    .worklist = mmalloc(sizeof(int) * count),
+    .worklist_count = 0,
+  };
+  int status = ERR;
+  if (!v.ins || !v.worklist)
+    goto done;
+  if (mark_instructions(&v) != NO_ERR)
+    goto done;
+
+  if (verify_unit(&v, 0, entry) != NO_ERR)
+    goto done;
+
+  for (int i = 0; i < vm->variable_count; i++) {
+    const struct Object* obj = &vm->variables[i];
+    if (obj->type != T_FUNCTION || obj->value.func.lazy >= 0 || obj->value.func.addr < start || obj->value.func.addr == entry->addr)
+      continue;
+    struct Unit func = {
+      .scope = &obj->value.func.scope,
+      .addr = obj->value.func.addr,
+      .argc = obj->value.func.argc,
+      .base = obj->value.func.argc + 1,
+    };
+    if (verify_unit(&v, i + 1, &func) != NO_ERR)
+      goto done;
+  }
+  status = NO_ERR;
+done:
+  mfree(v.ins, sizeof(struct Ins_state) * count);
+  mfree(v.worklist, sizeof(int) * count);
+  return status;
+}
+
+// The global code begins at 'start'
+int verify_program(struct VM_state* vm, int start) {
+  assert(vm != NULL);
+  struct Unit global = {
+    .scope = &vm->global.scope,
+    .addr = start,
+    .argc = 0,
+    .base = 0,
+  };
+  return verify_range(vm, start, &global);
+}
+
+// Verify a function that has just been compiled at 'start', along with the functions inside of it
+int verify_function(struct VM_state* vm, int start, const struct Function* func) {
+  assert(vm != NULL && func != NULL);
+  struct Unit entry = {
+    .scope = &func->scope,
+    .addr = func->addr,
+    .argc = func->argc,
+    .base = func->argc + 1,
+  };
+  return verify_range(vm, start, &entry);
+}
+
+int verify_code(struct VM_state* vm, const unsigned char* code, int size) {
+  assert(vm != NULL && code != NULL);
+  int start = vm->program_size;
+  for (int i = 0; i < size; i++)
+    list_push(vm->program, vm->program_size, vm->program_capacity, code[i]);
+  if (vm->program_size != start + size) {
+    list_shrink(vm->program, vm->program_size, vm->program_size - start);
+    return ALLOC_ERR;
+  }
+  int status = verify_program(vm, start);
+  list_shrink(vm->program, vm->program_size, size);
+  return status;
+}
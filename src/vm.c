@@ -3,25 +3,30 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
 
 #include "common.h"
 #include "error.h"
 #include "str.h"
 #include "mem.h"
 #include "list.h"
-#include "strarr.h"
+#include "file.h"
 #include "ast.h"
 #include "parser.h"
 #include "compile.h"
 #include "api.h"
 #include "lib.h"
 #include "stack.h"
+#include "verify.h"
+#include "strip.h"
+#include "emit.h"
 #include "vm.h"
 
 static const char* ins_descriptions[INSTRUCTION_COUNT] = {
   "unknown",
-  "add",
   "minus",
+  "add",
   "sub",
   "mult",
   "div",
@@ -49,9 +54,13 @@ static const char* ins_descriptions[INSTRUCTION_COUNT] = {
   "return",
   "if",
   "while",
+  "loop",
   "jump",
   "call",
   "push_arg",
+  "local_list",
+  "wide",
+  "wide16",
 
   "exit",
 };
@@ -62,11 +71,28 @@ static const char* ins_descriptions[INSTRUCTION_COUNT] = {
 #define vmfetch() { \
   i = *(ip++); \
 }
-#define vmjump(n) i = *(ip += n)
+#define vmarg(arg) { \
+  if (!wide) { \
+    arg = ARG_DECODE(ip); \
+    ip += ARG_SIZE; \
+  } \
+  else { \
+    arg = wide == ARG_SIZE_WIDE ? ARG_DECODE_WIDE(ip) : ARG_DECODE_16(ip); \
+    ip += wide; \
+    wide = 0; \
+  } \
+}
+// Jumps are relative to the location of the jump operand
+#define vmjump(from, n) (ip = (from) + (n))
 // TODO: Fix goto!
 #define vmgoto(n) { \
   i = *(ip += (ip - (vm->program + n))); \
 }
+// Leave the frame with an error, through the same exit that releases the frame region
+#define vmfail(error) { \
+  status = (error); \
+  goto done_exec; \
+}
 
 #define OP_ARITH_CAST(OP, CAST) { \
   if (vm->stack_top > 1) { \
@@ -100,11 +126,27 @@ static const char* ins_descriptions[INSTRUCTION_COUNT] = {
 
 #define OP_SAMETYPE(LEFT, RIGHT, TYPE) (LEFT.type == TYPE && RIGHT.type == TYPE)
 
+// All strings are interned, so they are equal only if they point to the same data
+#define OP_STRING_COMPARE(OP) { \
+  if (vm->stack_top > 1) { \
+    struct Object* left = stack_get(vm, 1); \
+    const struct Object* right = stack_gettop(vm); \
+    if (OP_SAMETYPE((*left), (*right), T_STRING)) { \
+      left->type = T_NUMBER; \
+      left->value.number = left->value.str.data OP right->value.str.data; \
+      stack_pop(vm); \
+      vmbreak; \
+    } \
+  } \
+} \
+
 inline struct Object* get_variable(struct VM_state* vm, struct Scope* scope, int var);
 inline int equal_types(const struct Object* a, const struct Object* b);
+static void release_region_lists(struct VM_state* vm);
 static int execute(struct VM_state* vm, struct Function* func);
 static int disasm(struct VM_state* vm, FILE* file);
 static int free_variables(struct VM_state* vm);
+static int exec_source(struct VM_state* vm, const char* filename, const struct Source* source);
 
 struct Object* get_variable(struct VM_state* vm, struct Scope* scope, int var) {
   assert(var >= 0 && vm->variable_count > var);
@@ -117,19 +159,33 @@ int equal_types(const struct Object* a, const struct Object* b) {
   return a->type == b->type;
 }
 
+// Clear the variables that still refer to lists in the part of the region that has been released
+void release_region_lists(struct VM_state* vm) {
+  for (int i = 0; i < vm->variable_count; i++) {
+    const struct Object* variable = &vm->variables[i];
+    if (variable->type == T_LIST && variable->value.list->region && !region_contains(&vm->region, variable->value.list))
+      vm->variables[i] = (struct Object) { .type = T_NIL };
+  }
+}
 
+// The program has been checked by verify_program() before we get here,
+// so jump targets, operand indices and stack depths are not checked again (except in debug builds)
 int execute(struct VM_state* vm, struct Function* func) {
 #if !defined(NO_JUMPTABLE)
 #include "jumptable.h"
 #endif
   Instruction* ip = &vm->program[func->addr];
   Instruction i = I_RETURN;
+  int wide = 0; // Size of the operand of the current instruction if it has a prefix, 0 if it doesn't
   int stack_bp = vm->stack_bp;
+  struct Region_mark frame_region = region_get_mark(&vm->region);
+  int status = NO_ERR;
   for (;;) {
     vmfetch();
     vmdispatch(i) {
       vmcase(I_ASSIGN) {
-        int var_location = *(ip++);
+        int var_location;
+        vmarg(var_location);
         struct Object* variable = get_variable(vm, &func->scope, var_location);
         const struct Object* top = stack_gettop(vm);
         if (!top) {
@@ -138,18 +194,20 @@ int execute(struct VM_state* vm, struct Function* func) {
         }
         if (top->type == T_FUNCTION) {
           vmerror("Can't assign function to variable\n");
-          return RUNTIME_ERR;
+          vmfail(RUNTIME_ERR);
         }
         if (variable->type == T_FUNCTION) {
           vmerror("Can't modify function\n");
-          return RUNTIME_ERR;
+          vmfail(RUNTIME_ERR);
         }
+        gc_barrier_variable(vm, top);
         *variable = *top;
         stack_pop(vm);
         vmbreak;
       }
       vmcase(I_LOCAL_ASSIGN) {
-        int local_addr = *(ip++);
+        int local_addr;
+        vmarg(local_addr);
         int arg_count = func->argc;
         assert(local_addr < arg_count);
         struct Object* local = stack_get(vm, vm->stack_bp - (arg_count + local_addr - 1));
@@ -168,7 +226,8 @@ int execute(struct VM_state* vm, struct Function* func) {
         vmbreak;
       }
       vmcase(I_PUSHK) {
-        int constant = *(ip++);
+        int constant;
+        vmarg(constant);
         stack_pushk(vm, &func->scope, constant);
         vmbreak;
       }
@@ -178,7 +237,8 @@ int execute(struct VM_state* vm, struct Function* func) {
         vmbreak;
 
       vmcase(I_PUSH_VAR) {
-        int variable = *(ip++);
+        int variable;
+        vmarg(variable);
         stack_pushvar(vm, &func->scope, variable);
         vmbreak;
       }
@@ -191,15 +251,23 @@ int execute(struct VM_state* vm, struct Function* func) {
       // continue if true (skip jump address)
       vmcase(I_IF) {
         const struct Object* top = stack_gettop(vm);
-        if (object_checktrue(top)) {
+        Instruction* jump_from = ip;
+        int jump;
+        vmarg(jump); // Skip jump
+        if (!top) { // A C function call may not have left a value
+          vmerror("Missing condition\n");
+          vmfail(RUNTIME_ERR);
+        }
+        int taken = object_checktrue(top);
+        if (vm->profile.recording)
+          profile_branch(&vm->profile, jump_from - vm->program, taken);
+        if (taken) {
           stack_pop(vm);
-          ip++; // Skip jump
           vmbreak;  // Enter if-block
         }
         stack_pop(vm);
-        int jump = *(ip);
-        assert(jump >= 0 && jump < vm->program_size);
-        vmjump(jump);
+        assert(jump > 0 && (jump_from - vm->program) + jump <= vm->program_size);
+        vmjump(jump_from, jump);
         vmbreak;
       }
 
@@ -208,32 +276,79 @@ int execute(struct VM_state* vm, struct Function* func) {
       // Jump if condition is false (next instruction is jump)
       vmcase(I_WHILE) {
         const struct Object* top = stack_gettop(vm);
-        if (object_checktrue(top)) {
+        Instruction* jump_from = ip;
+        int jump;
+        vmarg(jump); // Skip jump
+        if (!top) {
+          vmerror("Missing condition\n");
+          vmfail(RUNTIME_ERR);
+        }
+        int taken = object_checktrue(top);
+        if (vm->profile.recording)
+          profile_branch(&vm->profile, jump_from - vm->program, taken);
+        if (taken) {
           stack_pop(vm);
-          ip++; // Skip jump
           vmbreak;  // Enter while-block
         }
         stack_pop(vm);
-        int jump = *(ip);
         assert(jump != 0);
-        vmjump(jump);
+        vmjump(jump_from, jump);
+        vmbreak;
+      }
+
+      // Input: { BLOCK COND loop jmp_back }
+      // Bottom of a rotated while loop, jump back to the block if the condition is true
+      vmcase(I_LOOP) {
+        const struct Object* top = stack_gettop(vm);
+        Instruction* jump_from = ip;
+        int jump;
+        vmarg(jump);
+        if (!top) {
+          vmerror("Missing condition\n");
+          vmfail(RUNTIME_ERR);
+        }
+        int taken = object_checktrue(top);
+        if (vm->profile.recording)
+          profile_branch(&vm->profile, jump_from - vm->program, taken);
+        stack_pop(vm);
+        if (taken)
+          vmjump(jump_from, jump);
         vmbreak;
       }
 
       vmcase(I_JUMP) {
-        int jump = *(ip);
-        vmjump(jump);
+        Instruction* jump_from = ip;
+        int jump;
+        vmarg(jump);
+        vmjump(jump_from, jump);
+        // Back-edge of a while loop, run the trace of the loop if it's hot
+        if (jump < 0 && !vm->profile.recording) {
+          const struct Trace* trace = trace_back_edge(vm, func, stack_bp, jump_from - vm->program, ip - vm->program);
+          if (trace) {
+            int exit = trace_execute(vm, trace, stack_bp);
+            if (exit >= 0)
+              ip = &vm->program[exit];
+          }
+        }
         vmbreak;
       }
 
       // func, arg1, arg2, ..., CALL, arg_count
       vmcase(I_CALL) {
-        int arg_count = *(ip++);
+        int arg_count;
+        vmarg(arg_count);
         int bp = vm->stack_top - arg_count;
         vm->stack_bp = bp;
         const struct Object* obj = stack_get(vm, arg_count);
+        if (!obj) {
+          vmerror("Attempted to call a non-function value\n");
+          vmfail(RUNTIME_ERR);
+        }
         if (obj->type == T_CFUNCTION) {
+          Instruction* program = vm->program;
           int result = obj->value.cfunc(vm);
+          if (vm->program != program) // Functions may have been compiled (see vm_reload)
+            ip = vm->program + (ip - program);
           if (result == 1) {
             struct Object* top = stack_gettop(vm);
             vm->stack[bp - 1] = *top; // NOTE(lucas): The return value lies on the top of the stack after a C function call - might change later
@@ -243,32 +358,67 @@ int execute(struct VM_state* vm, struct Function* func) {
             vm->stack_top = bp;
             stack_pop(vm);
           }
+          gc_check(vm);  // Anything that the C function allocated is on the stack by now
           vmbreak;
         }
         if (obj->type != T_FUNCTION) {
           vmerror("Attempted to call a non-function value\n");
-          return RUNTIME_ERR;
+          vmfail(RUNTIME_ERR);
         }
         struct Function function = obj->value.func;
         if (function.argc != arg_count) {
           vmerror("Invalid number of arguments (should be: %i)\n", function.argc);
-          return RUNTIME_ERR;
+          vmfail(RUNTIME_ERR);
         }
-        Instruction* old_ip = ip;
-        execute(vm, &function);
+        Instruction* program = vm->program;
+        if (function.lazy >= 0 && compile_lazy(vm, &function) != NO_ERR)
+          vmfail(vm->status);
+        int result = execute(vm, &function);
+        if (result != NO_ERR)
+          vmfail(result);
+        if (vm->status == COMPILE_ERR)  // A function called from this one failed to compile
+          vmfail(vm->status);
         vm->stack[bp - 1] = *stack_gettop(vm);
         vm->stack_top = bp;
-        *ip = *old_ip;
+        if (vm->program != program) // Functions compiled during the call may have moved the program
+          ip = vm->program + (ip - program);
         vmbreak;
       }
 
       vmcase(I_PUSH_ARG) {
-        int arg_location = *(ip++);
+        int arg_location;
+        vmarg(arg_location);
         struct Object arg = vm->stack[stack_bp + arg_location];
         stack_push(vm, arg);
         vmbreak;
       }
 
+      // Input: { item1 ... itemN local_list N }
+      // Create a list that does not escape this function, in the region of the current frame
+      vmcase(I_LOCAL_LIST) {
+        int count;
+        vmarg(count);
+        if (vm->stack_top < count) {  // A C function call may not have left a value
+          vmerror("Missing list item\n");
+          vmfail(RUNTIME_ERR);
+        }
+        struct List* list = region_alloc(&vm->region, sizeof(struct List) + sizeof(struct Object) * count);
+        if (!list) {
+          vmerror("Failed to allocate list\n");
+          vmfail(RUNTIME_ERR);
+        }
+        list->gc = (struct Gc_object) { .next = NULL, .mark = 0, .size = 0, .type = T_LIST };  // Marked through, but never swept
+        list->data = count > 0 ? (struct Object*)(list + 1) : NULL;
+        list->length = count;
+        list->capacity = count;
+        list->region = 1;
+        vm->stack_top -= count;
+        if (count > 0)
+          memcpy(list->data, &vm->stack[vm->stack_top], sizeof(struct Object) * count);
+        stack_push(vm, (struct Object) { .value.list = list, .type = T_LIST });
+        vmbreak;
+      }
+
       vmcase(I_ADD)
         OP_ARITH(+);
         vmbreak;
@@ -294,6 +444,7 @@ int execute(struct VM_state* vm, struct Function* func) {
         vmbreak;
 
       vmcase(I_EQ)
+        OP_STRING_COMPARE(==);
         OP_ARITH(==);
         vmbreak;
 
@@ -306,6 +457,7 @@ int execute(struct VM_state* vm, struct Function* func) {
         vmbreak;
 
       vmcase(I_NEQ)
+        OP_STRING_COMPARE(!=);
         OP_ARITH(!=);
         vmbreak;
 
@@ -349,6 +501,16 @@ int execute(struct VM_state* vm, struct Function* func) {
         UNOP_ARITH(!);
         vmbreak;
 
+      // Prefix: the operand of the next instruction is 32-bit
+      vmcase(I_WIDE)
+        wide = ARG_SIZE_WIDE;
+        vmbreak;
+
+      // Prefix: the operand of the next instruction is 16-bit
+      vmcase(I_WIDE16)
+        wide = ARG_SIZE_16;
+        vmbreak;
+
       vmcase(I_UNKNOWN)
         assert(0);
         vmbreak;
@@ -358,22 +520,26 @@ int execute(struct VM_state* vm, struct Function* func) {
     }
   }
 done_exec:
-  return NO_ERR;
+  region_reset(&vm->region, frame_region);
+  if (status != NO_ERR) // The code that clears the variables of the frame lists (see compile_return) didn't run
+    release_region_lists(vm);
+  return status;
 }
 
 int disasm(struct VM_state* vm, FILE* file) {
   assert(file != NULL);
-  fprintf(file, "[%i instructions, %i variables, %i constants]\n", vm->program_size, vm->variable_count, vm->global.scope.constants_count);
-  for (int i = 0; i < vm->program_size; i++) {
-    Instruction instruction = vm->program[i];
-    unsigned int arg_count = compile_get_ins_arg_count(instruction);
-    if (arg_count > 0) {
-      fprintf(file, "%.4i %-14s%i\n", i, ins_descriptions[instruction], vm->program[i + 1]);
-      i += arg_count;
+  fprintf(file, "[%i bytes, %i variables, %i constants]\n", vm->program_size, vm->variable_count, vm->global.scope.constants_count);
+  for (int i = 0; i < vm->program_size;) {
+    Instruction instruction = I_UNKNOWN;
+    int arg = 0;
+    unsigned int size = compile_decode_ins(&vm->program[i], &instruction, &arg);
+    if (compile_get_ins_arg_count(instruction) > 0) {
+      fprintf(file, "%.4i %-14s%i\n", i, ins_descriptions[instruction], arg);
     }
     else {
       fprintf(file, "%.4i %s\n", i, ins_descriptions[instruction]);
     }
+    i += size;
   }
   return NO_ERR;
 }
@@ -390,7 +556,7 @@ int free_variables(struct VM_state* vm) {
 
         case T_STRING: {
           if (obj->value.str.data != NULL) {
-            // NOTE(lucas): Strings are stored in the buffer array (vm->buffers)
+            // NOTE(lucas): Strings are stored in the intern table (vm->strings)
             // string_free(obj->value.str.data);
             // obj->value.str.length = 0;
           }
@@ -401,8 +567,7 @@ int free_variables(struct VM_state* vm) {
       }
     }
   }
-  list_free(vm->variables, vm->variable_count);
-  vm->variable_count = 0;
+  list_free(vm->variables, vm->variable_count, vm->variable_capacity);
   return NO_ERR;
 }
 
@@ -411,13 +576,36 @@ int vm_init(struct VM_state* vm) {
   func_init(&vm->global);
   vm->variables = NULL;
   vm->variable_count = 0;
-  strarr_init(&vm->buffers);
+  vm->variable_capacity = 0;
+  intern_init(&vm->strings);
+  intern_init(&vm->symbols);
+  sources_init(&vm->sources);
+  modules_init(&vm->modules);
   vm->stack_top = 0;
   vm->stack_bp = 0;
   vm->status = NO_ERR;
   vm->program = NULL;
   vm->program_size = 0;
+  vm->program_capacity = 0;
   vm->prev_ip = 0;
+  profile_init(&vm->profile);
+  trace_cache_init(&vm->traces);
+  region_init(&vm->region);
+  gc_init(&vm->gc);
+  vm->lazy_functions = NULL;
+  vm->lazy_count = 0;
+  vm->lazy_capacity = 0;
+  vm->trees = NULL;
+  vm->tree_count = 0;
+  vm->tree_capacity = 0;
+  vm->global_constants = ht_create_empty();
+  vm->definitions = ht_create_empty_of(sizeof(struct Definition));
+  vm->retired_scopes = NULL;
+  vm->retired_count = 0;
+  vm->retired_capacity = 0;
+  vm->eager = 0;
+  vm->strict = 0;
+  vm->strip = 0;
   vm->heap_allocated = 0;
   lib_load(vm, libbase());
   lib_load(vm, libmath());
@@ -436,19 +624,41 @@ struct VM_state* vm_state_new() {
   return vm;
 }
 
-int vm_exec(struct VM_state* vm, const char* filename, char* input, struct Str_arr* str_arr) {
-  assert(input != NULL);
-  assert(vm != NULL);
+// Small sources are compiled in a single pass (see emit.c), unless the compile needs the whole tree
+// The source and the files it imports are released afterwards, unless a function still has to
+// be compiled from them. Nothing else keeps tokens: constants are copied, and the text of the global
+// functions is only remembered when their tree is kept (see store_definition).
+int exec_source(struct VM_state* vm, const char* filename, const struct Source* source) {
   Ast ast = ast_create();
-  if (parser_parse(input, str_arr, filename, &ast) == NO_ERR) {
+  unsigned int lazy_count = vm->lazy_count;
+  unsigned int tree_count = vm->tree_count;
+  int single_pass = source->size <= SINGLE_PASS_MAX && !vm->strict && !vm->eager && !vm->strip && !vm->profile.recording && vm->profile.input_count == 0;
+  int status = NO_ERR;
+  if (single_pass) {
+    status = emit_source(vm, filename, source, &ast);
+    if (status == PARSE_ERR)
+      vm->global.addr = vm->program_size; // Skip the code of the statements before the error
+  }
+  else
+    status = parser_parse(source, &vm->sources, &vm->modules, &vm->symbols, filename, vm->strict || vm->eager || vm->strip, &ast);
+  if (status == NO_ERR) {
 #if 1
-    compile_from_tree(vm, &ast);
+    if (vm->strip)
+      vm->status = strip_unused(vm, &ast, NULL);
+    if (vm->status == NO_ERR && !single_pass)
+      compile_from_tree(vm, &ast);
+    if (vm->status == NO_ERR)
+      vm->status = verify_program(vm, vm->global.addr);
+    if (vm->status == NO_ERR)
+      modules_commit(&vm->modules);  // The imported files have been compiled, whatever happens when they run
     if (vm->status == NO_ERR) {
       if (vm->prev_ip != vm->program_size) {  // Has program changed since last vm execution? 
-        execute(vm, &vm->global);
-        stack_print_top(vm);
+        int program_size = vm->program_size;
+        if (execute(vm, &vm->global) == NO_ERR && vm->status == NO_ERR)
+          stack_print_top(vm);
         stack_reset(vm);
-        list_shrink(vm->program, vm->program_size, 1);  // If so, remove the exit instruction
+        if (vm->program_size == program_size) // Unless functions have been compiled after it
+          list_shrink(vm->program, vm->program_size, 1);  // If so, remove the exit instruction
         vm->prev_ip = vm->program_size;
       }
     }
@@ -457,10 +667,91 @@ int vm_exec(struct VM_state* vm, const char* filename, char* input, struct Str_a
 #endif
     vm->global.addr = vm->program_size; // We're in interactive mode, move the start posiiton to the last instruction
   }
+  if (status != NO_ERR || vm->status != NO_ERR)
+    modules_rollback(&vm->modules); // None of the files imported since the last commit have been run, load them again
+  if (vm->lazy_count != lazy_count) { // Keep the tree around for the functions that haven't been compiled yet
+    unsigned int count = vm->tree_count;
+    list_push(vm->trees, vm->tree_count, vm->tree_capacity, ast);
+    if (vm->tree_count != count)
+      return vm->status;
+  }
   ast_free(&ast);
+  if (vm->lazy_count == lazy_count && vm->tree_count == tree_count)
+    sources_release(&vm->sources, source->serial);
   return vm->status;
 }
 
+int vm_exec(struct VM_state* vm, const char* filename, const char* input) {
+  assert(input != NULL);
+  assert(vm != NULL);
+  struct Source source;
+  if (sources_add_string(&vm->sources, filename, input, strlen(input), &source) != NO_ERR) {
+    vmerror("Failed to store input\n");
+    return vm->status = ALLOC_ERR;
+  }
+  return exec_source(vm, filename, &source);
+}
+
+int vm_exec_file(struct VM_state* vm, const char* path) {
+  assert(path != NULL);
+  assert(vm != NULL);
+  char canonical[PATH_MAX] = {0};
+  int loaded = 0;
+  struct Source source;
+  if (modules_resolve(path, canonical) != NO_ERR || modules_register(&vm->modules, canonical, &loaded) != NO_ERR || sources_add_file(&vm->sources, path, &source) != NO_ERR) {
+    modules_rollback(&vm->modules);
+    error("%s: Failed to open file '%s'\n", __FUNCTION__, path);
+    return vm->status = ERR;
+  }
+  return exec_source(vm, path, &source);
+}
+
+int vm_reload(struct VM_state* vm, const char* path, int* reloaded) {
+  assert(path != NULL);
+  assert(vm != NULL && reloaded != NULL);
+  char canonical[PATH_MAX] = {0};
+  int loaded = 0;
+  *reloaded = 0;
+  if (modules_resolve(path, canonical) != NO_ERR || modules_register(&vm->modules, canonical, &loaded) != NO_ERR) {
+    error("%s: Failed to open file '%s'\n", __FUNCTION__, path);
+    return ERR;
+  }
+  if (loaded)
+    return NO_ERR;  // Hasn't changed since it was loaded
+  struct Source source;
+  if (sources_add_file(&vm->sources, path, &source) != NO_ERR) {
+    modules_rollback(&vm->modules);
+    error("%s: Failed to open file '%s'\n", __FUNCTION__, path);
+    return ERR;
+  }
+  int vm_status = vm->status;
+  unsigned int tree_count = vm->tree_count;
+  Ast ast = ast_create();
+  int status = parser_parse(&source, &vm->sources, &vm->modules, &vm->symbols, path, 0, &ast);
+  if (status == NO_ERR)
+    status = compile_reload(vm, &ast, reloaded);
+  ast_free(&ast);
+  if (vm->tree_count == tree_count)  // No function has been compiled from it (see exec_source)
+    sources_release(&vm->sources, source.serial);
+  if (status == NO_ERR)
+    modules_commit(&vm->modules);
+  else
+    modules_rollback(&vm->modules);  // Try again the next time, even if the files are the same
+  vm->status = vm_status; // Whatever is running goes on with the functions it had
+  if (*reloaded > 0)
+    trace_cache_free(&vm->traces);  // Traces may have the old code of a function inlined
+  return status;
+}
+
+int vm_instruction(const char* name, int length) {
+  assert(name != NULL);
+  for (int i = 0; i < I_BREAKJUMP; i++) {
+    if ((int)strlen(ins_descriptions[i]) == length && !strncmp(ins_descriptions[i], name, length))
+      return i;
+  }
+  return I_UNKNOWN;
+}
+
 int vm_disasm(struct VM_state* vm, const char* output_file) {
   FILE* file = fopen(output_file, "w");
   if (!file) {
@@ -472,16 +763,48 @@ int vm_disasm(struct VM_state* vm, const char* output_file) {
   return NO_ERR;
 }
 
+static void print_table_stats(const char* name, const Htable* table) {
+  struct Htable_stats stats;
+  ht_get_stats(table, &stats);
+  printf("  %-18s %6u / %-6u slots, %u tombstones, load %.2f, probes avg %.2f max %u, %u key bytes\n",
+    name, stats.count, stats.size, stats.tombstones, stats.load_factor, stats.avg_probe_length, stats.max_probe_length, stats.key_bytes);
+}
+
+void vm_print_table_stats(struct VM_state* vm) {
+  assert(vm != NULL);
+  printf("Hash tables:\n");
+  print_table_stats("strings", &vm->strings.lookup);
+  print_table_stats("symbols", &vm->symbols.lookup);
+  print_table_stats("global variables", &vm->global.scope.var_locations);
+  print_table_stats("global constants", &vm->global_constants);
+  print_table_stats("definitions", &vm->definitions);
+}
+
 void vm_state_free(struct VM_state* vm) {
   assert(vm != NULL);
   scope_free(&vm->global.scope);
   free_variables(vm);
-  strarr_free(&vm->buffers);
+  gc_free(vm);
+  intern_free(&vm->strings);
+  intern_free(&vm->symbols);
+  sources_free(&vm->sources);
+  modules_free(&vm->modules);
   vm->stack_top = 0;
   vm->status = 0;
-  list_free(vm->program, vm->program_size);
-  vm->program_size = 0;
+  list_free(vm->program, vm->program_size, vm->program_capacity);
   vm->prev_ip = 0;
+  profile_free(&vm->profile);
+  trace_cache_free(&vm->traces);
+  region_free(&vm->region);
+  list_free(vm->lazy_functions, vm->lazy_count, vm->lazy_capacity);
+  for (unsigned int i = 0; i < vm->tree_count; i++)
+    ast_free(&vm->trees[i]);
+  list_free(vm->trees, vm->tree_count, vm->tree_capacity);
+  ht_free(&vm->global_constants);
+  ht_free(&vm->definitions);
+  for (unsigned int i = 0; i < vm->retired_count; i++)
+    scope_free(&vm->retired_scopes[i]);
+  list_free(vm->retired_scopes, vm->retired_count, vm->retired_capacity);
   if (vm->heap_allocated)
     mfree(vm, sizeof(struct VM_state));
   vm->heap_allocated = 0;